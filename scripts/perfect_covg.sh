@@ -20,7 +20,6 @@ then
   exit -1
 fi
 
-$DNACAT -P $2 | \
-  awk 'BEGIN{N='$1'} {l=length($0); for(i=1; i+N-1<=l; i++){ print substr($0,i,N) }}'
+$DNACAT -P --tile $1 $2
 
 exit $?
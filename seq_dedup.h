@@ -0,0 +1,161 @@
+/*
+ seq_dedup.h
+ project: seq_file
+ url: https://github.com/noporpoise/seq_file
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef _SEQ_DEDUP_HEADER
+#define _SEQ_DEDUP_HEADER
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include "seq_file.h"
+
+/*
+ Find duplicate reads or pairs by sequence. Each sequence is reduced to a
+ 64-bit fingerprint, held in an open addressing table. A canonical
+ fingerprint is the same for a sequence and its reverse complement (the
+ lexically lower of the two, ignoring case, as dnacat --key).
+
+ Fingerprints are never 0. With n distinct sequences the chance of two
+ sharing a fingerprint is about n^2/2^65.
+
+ seq_dedup_alloc(d,max_bytes)  - max_bytes = 0 for no limit
+ seq_dedup_hash(r,canonical)
+ seq_dedup_hash_pair(r1,r2,canonical)
+ seq_dedup_add(d,hash)
+ seq_dedup_batch(d,reads,n,canonical,status)
+ seq_dedup_dealloc(d)
+*/
+
+#define SEQ_DEDUP_FULL -1
+
+typedef struct
+{
+  uint64_t *table;
+  size_t capacity, count, max_capacity;
+} seq_dedup_t;
+
+// Returns 0 on success, -1 on error
+static inline int seq_dedup_alloc(seq_dedup_t *d, size_t max_bytes)
+{
+  d->max_capacity = max_bytes ? max_bytes / sizeof(uint64_t) : SIZE_MAX;
+  d->capacity = 1024;
+  d->count = 0;
+  d->table = (uint64_t*)calloc(d->capacity, sizeof(uint64_t));
+  return d->table ? 0 : -1;
+}
+
+static inline void seq_dedup_dealloc(seq_dedup_t *d)
+{
+  free(d->table);
+  memset(d, 0, sizeof(seq_dedup_t));
+}
+
+static inline uint64_t _seq_dedup_mix(uint64_t h)
+{
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h ? h : 1;
+}
+
+#define _seq_dedup_step(h,c) (((h) ^ (uint8_t)(c)) * 1099511628211ULL)
+
+// Fingerprint of a read's sequence
+static inline uint64_t seq_dedup_hash(const read_t *r, bool canonical)
+{
+  const char *s = r->seq.b;
+  size_t i, n = r->seq.end;
+  uint64_t h = 14695981039346656037ULL ^ n;
+  int a = 0, b = 0;
+
+  if(!canonical) {
+    for(i = 0; i < n; i++) h = _seq_dedup_step(h, s[i]);
+    return _seq_dedup_mix(h);
+  }
+
+  // Find which strand is lower, then hash it in upper case
+  for(i = 0; i < n && a == b; i++) {
+    a = toupper(s[i]);
+    b = toupper(seq_char_complement(s[n-1-i]));
+  }
+
+  if(a <= b) {
+    for(i = 0; i < n; i++) h = _seq_dedup_step(h, toupper(s[i]));
+  } else {
+    for(i = n; i > 0; i--)
+      h = _seq_dedup_step(h, toupper(seq_char_complement(s[i-1])));
+  }
+  return _seq_dedup_mix(h);
+}
+
+#undef _seq_dedup_step
+
+// Fingerprint of a pair. Canonical pairs are also the same if the mates are
+// swapped.
+static inline uint64_t seq_dedup_hash_pair(const read_t *r1, const read_t *r2,
+                                           bool canonical)
+{
+  uint64_t h1 = seq_dedup_hash(r1, canonical), h2 = seq_dedup_hash(r2, canonical);
+  if(canonical && h1 > h2) { uint64_t tmp = h1; h1 = h2; h2 = tmp; }
+  return _seq_dedup_mix(h1 * 0x9e3779b97f4a7c15ULL + h2);
+}
+
+static inline uint64_t* _seq_dedup_find(const seq_dedup_t *d, uint64_t hash)
+{
+  size_t i = hash & (d->capacity - 1);
+  while(d->table[i] && d->table[i] != hash) i = (i + 1) & (d->capacity - 1);
+  return &d->table[i];
+}
+
+// Returns 0 on success, -1 if at max size or out of memory
+static inline int _seq_dedup_grow(seq_dedup_t *d)
+{
+  seq_dedup_t tmp = *d;
+  size_t i;
+  if(d->capacity * 2 > d->max_capacity) return -1;
+  tmp.capacity = d->capacity * 2;
+  tmp.table = (uint64_t*)calloc(tmp.capacity, sizeof(uint64_t));
+  if(tmp.table == NULL) return -1;
+  for(i = 0; i < d->capacity; i++)
+    if(d->table[i]) *_seq_dedup_find(&tmp, d->table[i]) = d->table[i];
+  free(d->table);
+  *d = tmp;
+  return 0;
+}
+
+// Returns 1 if hash is new and was added, 0 if it was already present,
+// SEQ_DEDUP_FULL if it is new but the table has reached its memory limit
+static inline int seq_dedup_add(seq_dedup_t *d, uint64_t hash)
+{
+  uint64_t *ptr = _seq_dedup_find(d, hash);
+  if(*ptr) return 0;
+  // Keep load under 3/4
+  if(4 * (d->count + 1) > 3 * d->capacity) {
+    if(_seq_dedup_grow(d) < 0) return SEQ_DEDUP_FULL;
+    ptr = _seq_dedup_find(d, hash);
+  }
+  *ptr = hash;
+  d->count++;
+  return 1;
+}
+
+// Add reads[0..n-1], setting status[i] to the return value of seq_dedup_add()
+// Returns number of new reads
+static inline size_t seq_dedup_batch(seq_dedup_t *d, const read_t *reads,
+                                     size_t n, bool canonical, int *status)
+{
+  size_t i, nnew = 0;
+  for(i = 0; i < n; i++) {
+    status[i] = seq_dedup_add(d, seq_dedup_hash(&reads[i], canonical));
+    nnew += (status[i] == 1);
+  }
+  return nnew;
+}
+
+#endif
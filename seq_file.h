@@ -12,10 +12,15 @@ Sep 2015, Public Domain
 #include <string.h>
 #include <strings.h> // strcasecmp
 #include <stdbool.h>
+#include <stdint.h>
 #include <ctype.h>
 #include <limits.h>
 #include <zlib.h>
 #include <assert.h>
+#include <regex.h>
+#include <fcntl.h> // open()
+#include <sys/stat.h> // stat()
+#include <sys/mman.h> // mmap()
 
 // #define _USESAM 1
 
@@ -23,6 +28,12 @@ Sep 2015, Public Domain
 #undef _USESAM
 #endif
 
+// Define SEQ_BGZF_NTHREADS (e.g. -DSEQ_BGZF_NTHREADS=4) to decompress BAM on
+// that many threads, which needs -lpthread
+#ifdef SEQ_BGZF_NTHREADS
+#include <pthread.h>
+#endif
+
 #ifdef _USESAM
 #include "htslib/hfile.h"
 #include "htslib/hts.h"
@@ -35,9 +46,122 @@ typedef enum
 {
   SEQ_FMT_UNKNOWN = 0,
   SEQ_FMT_PLAIN = 1, SEQ_FMT_FASTA = 2, SEQ_FMT_FASTQ = 4,
-  SEQ_FMT_SAM = 8, SEQ_FMT_BAM = 16, SEQ_FMT_CRAM = 16
+  SEQ_FMT_SAM = 8, SEQ_FMT_BAM = 16, SEQ_FMT_CRAM = 32,
+  SEQ_FMT_SQC = 64, // columnar container, read as the format it was made from
+  SEQ_FMT_TWOBIT = 128 // UCSC .2bit, read as FASTA
 } seq_format;
 
+// Fields that can be skipped when parsing, see seq_skip_fields()
+#define SEQ_SKIP_NAME 1 /* don't store read names */
+#define SEQ_SKIP_SEQ  2 /* only store sequence length (seq.end), not bases */
+#define SEQ_SKIP_QUAL 4 /* don't store quality scores */
+
+// Entries that fail a filter are skipped by the parser, see seq_set_filter()
+typedef struct
+{
+  size_t min_len, max_len; // sequence length range, max_len == 0 for no limit
+  const char *name_prefix; // only keep names starting with prefix, or NULL
+  const regex_t *name_regex; // only keep names matching regex, or NULL
+  uint16_t sam_flags_excl; // drop SAM/BAM entries with any of these flags
+} seq_filter_t;
+
+// SAM/BAM flags, see read_t.flag and seq_filter_t.sam_flags_excl
+#define SEQ_SAM_FPAIRED           1
+#define SEQ_SAM_FUNMAP            4
+#define SEQ_SAM_FMUNMAP           8
+#define SEQ_SAM_FREVERSE         16
+#define SEQ_SAM_FREAD1           64
+#define SEQ_SAM_FREAD2          128
+#define SEQ_SAM_FSECONDARY      256
+#define SEQ_SAM_FQCFAIL         512
+#define SEQ_SAM_FDUP           1024
+#define SEQ_SAM_FSUPPLEMENTARY 2048
+
+// Native BGZF reader for BAM, see _seq_read_bam()
+#define SEQ_BGZF_BLOCK (1<<16) /* max block size */
+#define SEQ_BGZF_NBLOCKS 32 /* blocks decompressed at a time */
+
+typedef struct
+{
+  unsigned char *cdata;
+  char *udata;
+  size_t clen, ulen;
+  uint32_t crc;
+  int status;
+} _seq_bgzf_block_t;
+
+#ifdef SEQ_BGZF_NTHREADS
+typedef struct
+{
+  _seq_bgzf_block_t *blocks;
+  size_t nblocks, next, ndone; // blocks read, next to decompress, decompressed
+} _seq_bgzf_batch_t;
+#endif
+
+typedef struct
+{
+  FILE *fh;
+  _seq_bgzf_block_t *blocks;
+  size_t nblocks, curr, pos; // blocks loaded, block being read, offset in it
+  bool truncated; // bad or partial block after the loaded blocks
+  int status; // 0 ok, -1 on error
+#ifdef SEQ_BGZF_NTHREADS
+  // One batch is decompressed by the workers while the other is read
+  _seq_bgzf_batch_t batches[2], *job; // job is the batch being decompressed
+  bool started, quit;
+  pthread_t threads[SEQ_BGZF_NTHREADS];
+  size_t nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work, done;
+#endif
+} seq_bgzf_t;
+
+// Columnar container, see seq_sqc_writer_t. Columns: read lengths, names,
+// 2-bit bases, runs of other bases, runs of lower case, quality scores
+#define SEQ_SQC_NCOLS 6
+
+typedef struct
+{
+  size_t start, len; // bases from start of block
+  char c;
+} _seq_sqc_run_t;
+
+typedef struct
+{
+  uint64_t offset; // file offset of the first column
+  uint32_t nreads, clen[SEQ_SQC_NCOLS], ulen[SEQ_SQC_NCOLS];
+} _seq_sqc_block_t;
+
+typedef struct
+{
+  FILE *fh;
+  _seq_sqc_block_t *blocks;
+  size_t nblocks, next, end; // blocks in file, next to load, stop before
+  StreamBuffer cols[SEQ_SQC_NCOLS], tmp; // columns of the current block
+  bool loaded[SEQ_SQC_NCOLS];
+  size_t i, nreads; // reads taken from current block
+  size_t lenpos, namepos, namei, base, qualpos, excpos, maskpos; // cursors
+  _seq_sqc_run_t exc, mask;
+} seq_sqc_t;
+
+// UCSC .2bit, mapped into memory, see seq_twobit_fetch()
+typedef struct
+{
+  const char *name; // not NUL terminated
+  size_t namelen, idx;
+  uint64_t offset; // file offset of the record
+} _seq_twobit_entry_t;
+
+typedef struct
+{
+  const unsigned char *data;
+  size_t size;
+  bool swap; // file is big endian
+  _seq_twobit_entry_t *seqs, *byname; // in file order, sorted by name
+  size_t nseqs, next, end; // sequences in file, next to read, stop before
+  size_t pos; // bases of sequence next-1 read so far by seq_read_chunk()
+} seq_twobit_t;
+
 typedef struct seq_file_struct seq_file_t;
 typedef struct read_struct read_t;
 
@@ -48,14 +172,28 @@ struct seq_file_struct
   gzFile gz_file;
   void *hts_file; // cast to (htsFile*)
   void *bam_hdr; // cast to (bam_hdr_t*)
+  seq_bgzf_t *bgzf; // native BAM reading
+  seq_sqc_t *sqc; // columnar container
+  seq_twobit_t *twobit; // UCSC .2bit
 
   int (*readfunc)(seq_file_t *sf, read_t *r);
   StreamBuffer in;
   seq_format format;
+  uint8_t skip; // fields not to store, see seq_skip_fields()
+  seq_filter_t filter; // see seq_set_filter()
+  size_t filter_prefix_len;
 
   // Reads pushed onto a 'read stack' aka buffer
   read_t *rhead, *rtail; // 'unread' reads, add to tail, return from head
   int (*origreadfunc)(seq_file_t *sf, read_t *r); // used when read = _seq_read_pop
+
+  // Reading long entries in pieces with seq_read_chunk()
+  int (*chunkfunc)(seq_file_t *sf, read_t *r, size_t max_bases, bool *more);
+  bool in_chunk; // true if part way through an entry
+
+  // Reading a shard with seq_open_shard()
+  int (*shardfunc)(seq_file_t *sf, read_t *r);
+  off_t shard_end; // last offset an entry may start at
 };
 
 typedef struct {
@@ -69,12 +207,14 @@ struct read_struct
   void *bam; // cast to (bam1_t*) get/set with seq_read_bam()
   read_t *next; // for use in a linked list
   bool from_sam; // from sam or bam
+  uint16_t flag; // SAM flags (SEQ_SAM_F*) if from_sam
 };
 
 #define seq_read_init {.name = {.b = NULL, .end = 0, .size = 0}, \
                        .seq  = {.b = NULL, .end = 0, .size = 0}, \
                        .qual = {.b = NULL, .end = 0, .size = 0}, \
-                       .bam = NULL, .next = NULL, .from_sam = false}
+                       .bam = NULL, .next = NULL, .from_sam = false, \
+                       .flag = 0}
 
 #ifdef _USESAM
   #define seq_read_bam(r) ((bam1_t*)(r)->bam)
@@ -84,6 +224,8 @@ struct read_struct
 #define seq_is_bam(sf) ((sf)->format == SEQ_FMT_BAM)
 #define seq_is_sam(sf) ((sf)->format == SEQ_FMT_SAM)
 #define seq_use_gzip(sf) ((sf)->gz_file != NULL)
+#define seq_is_sqc(sf) ((sf)->sqc != NULL)
+#define seq_is_twobit(sf) ((sf)->twobit != NULL)
 
 // The following require a read to have been read successfully first
 // using seq_read
@@ -102,16 +244,102 @@ struct read_struct
 static inline int seq_read_primary(seq_file_t *sf, read_t *r)
 {
   int s = seq_read(sf, r);
-#ifdef _USESAM
-  if(s > 0 && r->from_sam) {
-    while(s > 0 && seq_read_bam(r)->core.flag & (BAM_FSECONDARY|BAM_FSUPPLEMENTARY))
-      s = seq_read(sf, r);
-  }
-#endif
+  while(s > 0 && r->from_sam &&
+        (r->flag & (SEQ_SAM_FSECONDARY|SEQ_SAM_FSUPPLEMENTARY)))
+    s = seq_read(sf, r);
   return s;
 }
 
 static inline void seq_close(seq_file_t *sf);
+static inline void seq_read_reverse_complement(read_t *r);
+
+/**
+ * Only return entries that pass filter f (pass NULL to remove the filter).
+ * Filters are evaluated by the parser as soon as the name / length is known
+ * and rejected entries are skipped without copying the rest of the entry.
+ * f is copied but name_prefix and name_regex must outlive sf.
+ */
+static inline void seq_set_filter(seq_file_t *sf, const seq_filter_t *f)
+{
+  memset(&sf->filter, 0, sizeof(sf->filter));
+  if(f != NULL) sf->filter = *f;
+  sf->filter_prefix_len = sf->filter.name_prefix ? strlen(sf->filter.name_prefix) : 0;
+}
+
+#define _seq_filter_on_name(sf) ((sf)->filter.name_prefix || (sf)->filter.name_regex)
+
+static inline bool _seq_filter_name(const seq_file_t *sf, const read_t *r)
+{
+  const seq_filter_t *f = &sf->filter;
+  return (!f->name_prefix ||
+          strncmp(r->name.b, f->name_prefix, sf->filter_prefix_len) == 0) &&
+         (!f->name_regex || regexec(f->name_regex, r->name.b, 0, NULL, 0) == 0);
+}
+
+static inline bool _seq_filter_len(const seq_file_t *sf, size_t len)
+{
+  return len >= sf->filter.min_len &&
+         (sf->filter.max_len == 0 || len <= sf->filter.max_len);
+}
+
+#define _SEQ_SKIP_ALL (SEQ_SKIP_NAME|SEQ_SKIP_SEQ|SEQ_SKIP_QUAL)
+
+// Names are needed to evaluate name filters even if the caller skips them
+static inline uint8_t _seq_parse_skip(const seq_file_t *sf)
+{
+  return _seq_filter_on_name(sf) ? sf->skip & ~SEQ_SKIP_NAME : sf->skip;
+}
+
+static inline void _seq_filter_clear_name(const seq_file_t *sf, read_t *r)
+{
+  if((sf->skip & SEQ_SKIP_NAME) && r->name.end) {
+    r->name.end = 0;
+    r->name.b[0] = '\0';
+  }
+}
+
+/**
+ * Skip fields (SEQ_SKIP_* flags or'd together) in the input rather than
+ * copying them into reads. Skipped names and quality scores are left empty.
+ * With SEQ_SKIP_SEQ, r->seq.end is the sequence length but r->seq.b is empty.
+ */
+static inline void seq_skip_fields(seq_file_t *sf, uint8_t fields)
+{
+  sf->skip = fields;
+}
+
+/**
+ * Move past the next entry without copying any of it, for reads not wanted
+ * e.g. when subsampling. Entries rejected by a filter are not counted.
+ * Only r->seq.end (and r->name if filtering on name) is set.
+ * Returns 1 on success, 0 on eof, -1 on error
+ */
+static inline int seq_skip_read(seq_file_t *sf, read_t *r)
+{
+  uint8_t skip = sf->skip;
+  int s;
+  sf->skip = _SEQ_SKIP_ALL;
+  s = seq_read(sf, r);
+  sf->skip = skip;
+  return s;
+}
+
+/**
+ * Read the next entry in pieces of at most max_bases (must be > 0) bases, so
+ * that chromosome-scale FASTA entries can be scanned in constant memory.
+ * Sets *more to true if the entry continues in the next call, false if this
+ * is the last (or only) piece. r->name is set on every piece of an entry.
+ * Only FASTA entries are split; other formats are read whole with seq_read.
+ * Don't call seq_read while *more is true.
+ * Returns 1 on success, 0 on eof, -1 if partially read / syntax error
+ */
+static inline int seq_read_chunk(seq_file_t *sf, read_t *r, size_t max_bases,
+                                 bool *more)
+{
+  *more = false;
+  if(sf->chunkfunc == NULL || sf->rhead != NULL) return seq_read(sf, r);
+  return sf->chunkfunc(sf, r, max_bases, more);
+}
 
 // File format information (http://en.wikipedia.org/wiki/FASTQ_format)
 static const char * const FASTQ_FORMATS[]
@@ -136,6 +364,7 @@ static inline void seq_read_reset(read_t *r) {
   r->name.end = r->seq.end = r->qual.end = 0;
   r->name.b[0] = r->seq.b[0] = r->qual.b[0] = '\0';
   r->from_sam = false;
+  r->flag = 0;
 }
 
 static inline void seq_read_dealloc(read_t *r)
@@ -173,6 +402,23 @@ static inline read_t* seq_read_alloc(read_t *r)
   return r;
 }
 
+// Release memory held by read buffers larger than `limit` bytes, keeping
+// enough to hold their current contents
+static inline void seq_read_shrink(read_t *r, size_t limit)
+{
+  seq_buf_t *bufs[3] = {&r->name, &r->seq, &r->qual}, *buf;
+  size_t i, newsize;
+  for(i = 0; i < 3; i++) {
+    buf = bufs[i];
+    if(buf->size <= limit) continue;
+    newsize = buf->end+1 < 256 ? 256 : ROUNDUP2POW(buf->end+1);
+    if(newsize < buf->size) {
+      char *tmp = realloc(buf->b, newsize);
+      if(tmp != NULL) { buf->b = tmp; buf->size = newsize; }
+    }
+  }
+}
+
 static inline read_t* seq_read_new()
 {
   read_t *r = calloc(1, sizeof(read_t));
@@ -201,110 +447,196 @@ static inline int _seq_read_sam(seq_file_t *sf, read_t *r)
   r->name.end = r->seq.end = r->qual.end = 0;
   r->name.b[0] = r->seq.b[0] = r->qual.b[0] = '\0';
 
-  if(sam_read1(sf->hts_file, sf->bam_hdr, r->bam) < 0) return 0;
-
   const bam1_t *b = seq_read_bam(r);
-  char *str = bam_get_qname(b);
-  cbuf_append_str(&r->name.b, &r->name.end, &r->name.size, str, strlen(str));
+  size_t qlen;
+
+  // Apply filters before decoding anything
+  do {
+    if(sam_read1(sf->hts_file, sf->bam_hdr, r->bam) < 0) return 0;
+    qlen = (size_t)b->core.l_qseq;
+  } while((b->core.flag & sf->filter.sam_flags_excl) ||
+          !_seq_filter_len(sf, qlen) ||
+          (sf->filter.name_prefix &&
+           strncmp(bam_get_qname(b), sf->filter.name_prefix,
+                   sf->filter_prefix_len) != 0) ||
+          (sf->filter.name_regex &&
+           regexec(sf->filter.name_regex, bam_get_qname(b), 0, NULL, 0) != 0));
 
-  size_t qlen = (size_t)b->core.l_qseq;
-  cbuf_capacity(&r->seq.b, &r->seq.end, qlen);
-  cbuf_capacity(&r->qual.b, &r->qual.end, qlen);
-  const uint8_t *bamseq = bam_get_seq(b);
-  const uint8_t *bamqual = bam_get_qual(b);
-
-  size_t i, j;
-  if(bam_is_rev(b))
-  {
-    for(i = 0, j = qlen - 1; i < qlen; i++, j--)
-    {
-      int8_t c = bam_seqi(bamseq, j);
-      r->seq.b[i] = seq_nt16_str[seq_comp_table[c]];
-      r->qual.b[i] = (char)(33 + bamqual[j]);
+  r->from_sam = true;
+  r->flag = b->core.flag;
+
+  if(!(sf->skip & SEQ_SKIP_NAME)) {
+    char *str = bam_get_qname(b);
+    uint8_t *co = bam_aux_get(b, "CO");
+    cbuf_append_str(&r->name.b, &r->name.end, &r->name.size, str, strlen(str));
+    // Comment from a FASTQ header, see seq_sprint_ubam()
+    if(co && (str = bam_aux2Z(co)) != NULL) {
+      cbuf_append_char(&r->name.b, &r->name.end, &r->name.size, ' ');
+      cbuf_append_str(&r->name.b, &r->name.end, &r->name.size, str, strlen(str));
     }
   }
-  else
-  {
-    for(i = 0; i < qlen; i++)
-    {
-      int8_t c = bam_seqi(bamseq, i);
-      r->seq.b[i] = seq_nt16_str[c];
-      r->qual.b[i] = (char)(33 + bamqual[i]);
+
+  if(sf->skip & SEQ_SKIP_SEQ) r->seq.end = qlen;
+  else {
+    const uint8_t *bamseq = bam_get_seq(b);
+    size_t i, j;
+    cbuf_capacity(&r->seq.b, &r->seq.size, qlen);
+    if(bam_is_rev(b)) {
+      for(i = 0, j = qlen - 1; i < qlen; i++, j--)
+        r->seq.b[i] = seq_nt16_str[seq_comp_table[bam_seqi(bamseq, j)]];
+    } else {
+      for(i = 0; i < qlen; i++)
+        r->seq.b[i] = seq_nt16_str[bam_seqi(bamseq, i)];
     }
+    r->seq.b[r->seq.end = qlen] = '\0';
   }
 
-  r->seq.end = r->qual.end = qlen;
-  r->seq.b[qlen] = r->qual.b[qlen] = '\0';
-  r->from_sam = true;
+  if(!(sf->skip & SEQ_SKIP_QUAL)) {
+    const uint8_t *bamqual = bam_get_qual(b);
+    size_t i, j;
+    cbuf_capacity(&r->qual.b, &r->qual.size, qlen);
+    if(bam_is_rev(b)) {
+      for(i = 0, j = qlen - 1; i < qlen; i++, j--)
+        r->qual.b[i] = (char)(33 + bamqual[j]);
+    } else {
+      for(i = 0; i < qlen; i++)
+        r->qual.b[i] = (char)(33 + bamqual[i]);
+    }
+    r->qual.b[r->qual.end = qlen] = '\0';
+  }
 
   return 1;
 }
 #endif /* _USESAM */
 
 
-#define _func_read_fastq(_read_fastq,__getc,__ungetc,__readline)               \
+// Fields listed in sf->skip (SEQ_SKIP_*) are skipped in the input rather than
+// copied into the read. With SEQ_SKIP_SEQ only the length is stored (seq.end)
+// Entries rejected by sf->filter are skipped without copying the remaining
+// fields, then the next entry is read.
+#define _func_read_fastq(_read_fastq,__getc,__readline,__skipline,__countline)\
   static inline int _read_fastq(seq_file_t *sf, read_t *r)                     \
   {                                                                            \
+    int c;                                                                     \
+    size_t len, qlen;                                                          \
+    uint8_t skip;                                                              \
+    bool keep;                                                                 \
+                                                                               \
+    next_entry:                                                                \
     seq_read_reset(r);                                                         \
-    int c = __getc(sf);                                                        \
+    skip = _seq_parse_skip(sf);                                                \
+    qlen = 0;                                                                  \
+    /* Skip to the start of the entry. We don't look for the next entry */     \
+    /* after reading one, so complete entries are returned without */          \
+    /* waiting on more input (matters when streaming from a pipe) */           \
+    while((c = __getc(sf)) != -1 && c != '@');                                 \
                                                                                \
     if(c == -1) return 0;                                                      \
-    if(c != '@' || __readline(sf, r->name) == 0) return -1;                    \
-    cbuf_chomp(r->name.b, &r->name.end);                                       \
+    if(skip & SEQ_SKIP_NAME) { if(__skipline(sf) == 0) return -1; }            \
+    else {                                                                     \
+      if(__readline(sf, r->name) == 0) return -1;                              \
+      cbuf_chomp(r->name.b, &r->name.end);                                     \
+    }                                                                          \
+    if(!(keep = _seq_filter_name(sf, r))) skip = _SEQ_SKIP_ALL;                \
                                                                                \
     while((c = __getc(sf)) != '+') {                                           \
       if(c == -1) return -1;                                                   \
       if(c != '\r' && c != '\n') {                                             \
+        if(skip & SEQ_SKIP_SEQ) {                                              \
+          if(__countline(sf, &len) == 0) return -1;                            \
+          r->seq.end += len+1;                                                 \
+          continue;                                                            \
+        }                                                                      \
         cbuf_append_char(&r->seq.b, &r->seq.end, &r->seq.size, (char)c);       \
         if(__readline(sf, r->seq) == 0) return -1;                             \
         cbuf_chomp(r->seq.b, &r->seq.end);                                     \
       }                                                                        \
     }                                                                          \
+    if(keep && !(keep = _seq_filter_len(sf, r->seq.end))) skip = _SEQ_SKIP_ALL;\
     while((c = __getc(sf)) != -1 && c != '\n');                                \
-    if(c == -1) return -1;                                                     \
-    do {                                                                       \
-      if(__readline(sf,r->qual) > 0) cbuf_chomp(r->qual.b, &r->qual.end);      \
-      else return 1;                                                           \
-    } while(r->qual.end < r->seq.end);                                         \
-    while((c = __getc(sf)) != -1 && c != '@');                                 \
-    __ungetc(sf, c);                                                           \
+    if(c == -1) return keep ? -1 : 0;                                          \
+    if(skip & SEQ_SKIP_QUAL) {                                                 \
+      while(qlen < r->seq.end && __countline(sf, &len) > 0) qlen += len;       \
+    }                                                                          \
+    else {                                                                     \
+      do {                                                                     \
+        if(__readline(sf,r->qual) > 0) cbuf_chomp(r->qual.b, &r->qual.end);    \
+        else break;                                                            \
+      } while(r->qual.end < r->seq.end);                                       \
+    }                                                                          \
+    if(!keep) goto next_entry;                                                 \
+    _seq_filter_clear_name(sf, r);                                             \
     return 1;                                                                  \
   }
 
-#define _func_read_fasta(_read_fasta,__getc,__ungetc,__readline)               \
+#define _func_read_fasta(_read_fasta,__getc,__ungetc,__readline,__skipline,__countline)\
   static inline int _read_fasta(seq_file_t *sf, read_t *r)                     \
   {                                                                            \
+    int c;                                                                     \
+    size_t len;                                                                \
+    uint8_t skip;                                                              \
+    bool keep;                                                                 \
+                                                                               \
+    next_entry:                                                                \
     seq_read_reset(r);                                                         \
-    int c = __getc(sf);                                                        \
+    skip = _seq_parse_skip(sf);                                                \
+    c = __getc(sf);                                                            \
                                                                                \
     if(c == -1) return 0;                                                      \
-    if(c != '>' || __readline(sf, r->name) == 0) return -1;                    \
-    cbuf_chomp(r->name.b, &r->name.end);                                       \
+    if(c != '>') return -1;                                                    \
+    if(skip & SEQ_SKIP_NAME) { if(__skipline(sf) == 0) return -1; }            \
+    else {                                                                     \
+      if(__readline(sf, r->name) == 0) return -1;                              \
+      cbuf_chomp(r->name.b, &r->name.end);                                     \
+    }                                                                          \
+    if(!(keep = _seq_filter_name(sf, r))) skip = _SEQ_SKIP_ALL;                \
                                                                                \
-    while((c = __getc(sf)) != '>') {                                           \
-      if(c == -1) return 1;                                                    \
+    while((c = __getc(sf)) != '>' && c != -1) {                                \
       if(c != '\r' && c != '\n') {                                             \
+        /* stop copying once an entry is too long */                           \
+        if(keep && sf->filter.max_len && r->seq.end > sf->filter.max_len) {    \
+          keep = false;                                                        \
+          skip = _SEQ_SKIP_ALL;                                                \
+        }                                                                      \
+        if(skip & SEQ_SKIP_SEQ) {                                              \
+          __countline(sf, &len);                                               \
+          r->seq.end += len+1;                                                 \
+          continue;                                                            \
+        }                                                                      \
         cbuf_append_char(&r->seq.b, &r->seq.end, &r->seq.size, (char)c);       \
-        long nread = (long)__readline(sf, r->seq);                             \
+        __readline(sf, r->seq);                                                \
         cbuf_chomp(r->seq.b, &r->seq.end);                                     \
-        if(nread <= 0) return 1;                                               \
       }                                                                        \
     }                                                                          \
-    __ungetc(sf, c);                                                           \
+    if(c == '>') __ungetc(sf, c);                                              \
+    if(!keep || !_seq_filter_len(sf, r->seq.end)) goto next_entry;             \
+    _seq_filter_clear_name(sf, r);                                             \
     return 1;                                                                  \
   }
 
 
-#define _func_read_plain(_read_plain,__getc,__readline,__skipline)             \
+#define _func_read_plain(_read_plain,__getc,__readline,__skipline,__countline) \
   static inline int _read_plain(seq_file_t *sf, read_t *r)                     \
   {                                                                            \
     int c;                                                                     \
+    size_t len;                                                                \
+                                                                               \
+    next_entry:                                                                \
     seq_read_reset(r);                                                         \
     while((c = __getc(sf)) != -1 && isspace(c)) if(c != '\n') __skipline(sf);  \
     if(c == -1) return 0;                                                      \
-    cbuf_append_char(&r->seq.b, &r->seq.end, &r->seq.size, (char)c);           \
-    __readline(sf, r->seq);                                                    \
-    cbuf_chomp(r->seq.b, &r->seq.end);                                         \
+    /* plain entries have no names, so fail any name filter */                 \
+    if(!_seq_filter_name(sf, r)) { __skipline(sf); goto next_entry; }          \
+    if(sf->skip & SEQ_SKIP_SEQ) {                                              \
+      __countline(sf, &len);                                                   \
+      r->seq.end = len+1;                                                      \
+    }                                                                          \
+    else {                                                                     \
+      cbuf_append_char(&r->seq.b, &r->seq.end, &r->seq.size, (char)c);         \
+      __readline(sf, r->seq);                                                  \
+      cbuf_chomp(r->seq.b, &r->seq.end);                                       \
+    }                                                                          \
+    if(!_seq_filter_len(sf, r->seq.end)) goto next_entry;                      \
     return 1;                                                                  \
   }
 
@@ -312,6 +644,8 @@ static inline int _seq_read_sam(seq_file_t *sf, read_t *r)
   static inline int _read_unknown(seq_file_t *sf, read_t *r)                   \
   {                                                                            \
     int c;                                                                     \
+    /* readfunc may still point here, dispatch once format is known */         \
+    if(sf->format != SEQ_FMT_UNKNOWN) return sf->origreadfunc(sf,r);           \
     seq_read_reset(r);                                                         \
     while((c = __getc(sf)) != -1 && isspace(c)) if(c != '\n') __skipline(sf);  \
     if(c == -1) return 0;                                                      \
@@ -322,6 +656,58 @@ static inline int _seq_read_sam(seq_file_t *sf, read_t *r)
     return sf->origreadfunc(sf,r);                                             \
   }
 
+// Read the next FASTA entry in pieces of at most max_bases. r->name is set on
+// every piece of an entry, r->seq holds only the bases of the current piece.
+// Entries in other formats are read whole with origreadfunc.
+// Name filters are applied, length filters are not.
+#define _func_read_chunk(_read_chunk,__getc,__ungetc,__readline,__skipline,__gets,__fasta)\
+  static inline int _read_chunk(seq_file_t *sf, read_t *r, size_t max_bases,   \
+                                bool *more)                                    \
+  {                                                                            \
+    int c;                                                                     \
+    *more = false;                                                             \
+    while(!sf->in_chunk) {                                                     \
+      while((c = __getc(sf)) != -1 && isspace(c)) if(c != '\n') __skipline(sf);\
+      if(c == -1) { seq_read_reset(r); return 0; }                             \
+      __ungetc(sf, c);                                                         \
+      if(c != '>' || (sf->format != SEQ_FMT_UNKNOWN &&                         \
+                      sf->format != SEQ_FMT_FASTA)) {                          \
+        return sf->origreadfunc(sf, r);                                        \
+      }                                                                        \
+      sf->format = SEQ_FMT_FASTA; sf->origreadfunc = __fasta;                  \
+      seq_read_reset(r);                                                       \
+      __getc(sf); /* '>' */                                                    \
+      if(__readline(sf, r->name) == 0) return -1;                              \
+      cbuf_chomp(r->name.b, &r->name.end);                                     \
+      if(!_seq_filter_name(sf, r)) {                                           \
+        while((c = __getc(sf)) != -1 && c != '>') if(c != '\n') __skipline(sf);\
+        if(c == '>') __ungetc(sf, c);                                          \
+        continue;                                                              \
+      }                                                                        \
+      sf->in_chunk = true;                                                     \
+    }                                                                          \
+    /* Don't keep a buffer much larger than a piece */                         \
+    r->seq.end = r->qual.end = 0;                                              \
+    seq_read_shrink(r, ROUNDUP2POW(max_bases+1));                              \
+    cbuf_capacity(&r->seq.b, &r->seq.size, max_bases);                         \
+    while(r->seq.end < max_bases && (c = __getc(sf)) != -1) {                  \
+      if(c == '>') { __ungetc(sf, c); break; }                                 \
+      if(c == '\r' || c == '\n') continue;                                     \
+      r->seq.b[r->seq.end++] = (char)c;                                        \
+      if(r->seq.end < max_bases &&                                             \
+         __gets(sf, r->seq.b+r->seq.end, max_bases-r->seq.end+1) != NULL) {    \
+        r->seq.end += strlen(r->seq.b+r->seq.end);                             \
+        cbuf_chomp(r->seq.b, &r->seq.end);                                     \
+      }                                                                        \
+    }                                                                          \
+    r->seq.b[r->seq.end] = r->qual.b[0] = '\0';                                \
+    /* Entry continues if next non-newline char is not EOF or '>' */           \
+    while((c = __getc(sf)) == '\r' || c == '\n') {}                            \
+    if(c != -1) __ungetc(sf, c);                                               \
+    sf->in_chunk = *more = (c != -1 && c != '>');                              \
+    return 1;                                                                  \
+  }
+
 #define _SF_SWAP(x,y) do { __typeof(x) _tmp = (x); (x) = (y); (y) = _tmp; } while(0)
 #define _SF_MIN(x,y) ((x) < (y) ? (x) : (y))
 
@@ -337,94 +723,1617 @@ static inline int _seq_read_pop(seq_file_t *sf, read_t *r)
     sf->readfunc = sf->origreadfunc;
     sf->rtail = NULL;
   }
-  r->next = NULL;
-  return 1;
-}
+  r->next = NULL;
+  return 1;
+}
+
+// Add a read onto the read buffer (linked list FIFO)
+static inline void _seq_read_shift(seq_file_t *sf, read_t *r)
+{
+  if(sf->rhead == NULL) {
+    sf->readfunc = _seq_read_pop;
+    sf->rhead = sf->rtail = r;
+  }
+  else {
+    sf->rtail->next = r;
+    sf->rtail = r;
+  }
+  r->next = NULL;
+}
+
+// Load reads until we have at least nbases loaded or we hit EOF
+static inline void _seq_buffer_reads(seq_file_t *sf, size_t nbases)
+{
+  int (*readfunc)(seq_file_t *sf, read_t *r) = sf->origreadfunc;
+
+  // Sum bases already in buffer
+  read_t *r = sf->rhead;
+  size_t currbases = 0;
+  while(r != NULL) { currbases += r->seq.end; r = r->next; }
+
+  while(currbases < nbases) {
+    if((r = seq_read_new()) == NULL) {
+      fprintf(stderr, "[%s:%i] Error out of memory\n", __FILE__, __LINE__);
+      break;
+    }
+    if(readfunc(sf,r) <= 0) { seq_read_free(r); break; }
+    currbases += r->seq.end;
+    _seq_read_shift(sf, r);
+  }
+}
+
+// perform reading on seq_file_t
+
+// getc on seq_file_t
+#define _sf_gzgetc(sf)              gzgetc((sf)->gz_file)
+#define _sf_gzgetc_buf(sf)          gzgetc_buf((sf)->gz_file,&(sf)->in)
+#define _sf_fgetc(sf)               fgetc((sf)->f_file)
+#define _sf_fgetc_buf(sf)           fgetc_buf((sf)->f_file,&(sf)->in)
+#define _sf_fdgetc_buf(sf)          fdgetc_buf((sf)->f_file,&(sf)->in)
+
+// ungetc on seq_file_t
+#define _sf_gzungetc(sf,c)          gzungetc(c,(sf)->gz_file)
+#define _sf_gzungetc_buf(sf,c)      ungetc_buf(c,&(sf)->in)
+#define _sf_fungetc(sf,c)           fungetc(c,(sf)->f_file)
+#define _sf_fungetc_buf(sf,c)       ungetc_buf(c,&(sf)->in)
+#define _sf_fdungetc_buf(sf,c)      ungetc_buf(c,&(sf)->in)
+
+// readline on seq_file_t using buffer into read
+#define _sf_gzreadline(sf,buf)      gzreadline((sf)->gz_file,&(buf).b,&(buf).end,&(buf).size)
+#define _sf_gzreadline_buf(sf,buf)  gzreadline_buf((sf)->gz_file,&(sf)->in,&(buf).b,&(buf).end,&(buf).size)
+#define _sf_freadline(sf,buf)       freadline((sf)->f_file,&(buf).b,&(buf).end,&(buf).size)
+#define _sf_freadline_buf(sf,buf)   freadline_buf((sf)->f_file,&(sf)->in,&(buf).b,&(buf).end,&(buf).size)
+#define _sf_fdreadline_buf(sf,buf)  fdreadline_buf((sf)->f_file,&(sf)->in,&(buf).b,&(buf).end,&(buf).size)
+
+// gets on seq_file_t (read upto len-1 bytes or to end of line into str)
+#define _sf_gzgets(sf,str,len)      gzgets2((sf)->gz_file,str,len)
+#define _sf_gzgets_buf(sf,str,len)  gzgets_buf((sf)->gz_file,&(sf)->in,str,len)
+#define _sf_fgets(sf,str,len)       fgets2((sf)->f_file,str,len)
+#define _sf_fgets_buf(sf,str,len)   fgets_buf((sf)->f_file,&(sf)->in,str,len)
+#define _sf_fdgets_buf(sf,str,len)  fdgets_buf((sf)->f_file,&(sf)->in,str,len)
+
+// skipline on seq_file_t
+#define _sf_gzskipline(sf)          gzskipline((sf)->gz_file)
+#define _sf_gzskipline_buf(sf)      gzskipline_buf((sf)->gz_file,&(sf)->in)
+#define _sf_fskipline(sf)           fskipline((sf)->f_file)
+#define _sf_fskipline_buf(sf)       fskipline_buf((sf)->f_file,&(sf)->in)
+#define _sf_fdskipline_buf(sf)      fdskipline_buf((sf)->f_file,&(sf)->in)
+
+// countline on seq_file_t
+#define _sf_gzcountline(sf,len)     gzcountline((sf)->gz_file,len)
+#define _sf_gzcountline_buf(sf,len) gzcountline_buf((sf)->gz_file,&(sf)->in,len)
+#define _sf_fcountline(sf,len)      fcountline((sf)->f_file,len)
+#define _sf_fcountline_buf(sf,len)  fcountline_buf((sf)->f_file,&(sf)->in,len)
+#define _sf_fdcountline_buf(sf,len) fdcountline_buf((sf)->f_file,&(sf)->in,len)
+
+// Read FASTQ
+_func_read_fastq(_seq_read_fastq_f,      _sf_fgetc,      _sf_freadline,      _sf_fskipline,      _sf_fcountline)
+_func_read_fastq(_seq_read_fastq_gz,     _sf_gzgetc,     _sf_gzreadline,     _sf_gzskipline,     _sf_gzcountline)
+_func_read_fastq(_seq_read_fastq_f_buf,  _sf_fgetc_buf,  _sf_freadline_buf,  _sf_fskipline_buf,  _sf_fcountline_buf)
+_func_read_fastq(_seq_read_fastq_gz_buf, _sf_gzgetc_buf, _sf_gzreadline_buf, _sf_gzskipline_buf, _sf_gzcountline_buf)
+_func_read_fastq(_seq_read_fastq_fd_buf, _sf_fdgetc_buf, _sf_fdreadline_buf, _sf_fdskipline_buf, _sf_fdcountline_buf)
+
+// Read FASTA
+_func_read_fasta(_seq_read_fasta_f,      _sf_fgetc,      _sf_fungetc,      _sf_freadline,      _sf_fskipline,      _sf_fcountline)
+_func_read_fasta(_seq_read_fasta_gz,     _sf_gzgetc,     _sf_gzungetc,     _sf_gzreadline,     _sf_gzskipline,     _sf_gzcountline)
+_func_read_fasta(_seq_read_fasta_f_buf,  _sf_fgetc_buf,  _sf_fungetc_buf,  _sf_freadline_buf,  _sf_fskipline_buf,  _sf_fcountline_buf)
+_func_read_fasta(_seq_read_fasta_gz_buf, _sf_gzgetc_buf, _sf_gzungetc_buf, _sf_gzreadline_buf, _sf_gzskipline_buf, _sf_gzcountline_buf)
+_func_read_fasta(_seq_read_fasta_fd_buf, _sf_fdgetc_buf, _sf_fdungetc_buf, _sf_fdreadline_buf, _sf_fdskipline_buf, _sf_fdcountline_buf)
+
+// Read plain
+_func_read_plain(_seq_read_plain_f,      _sf_fgetc,      _sf_freadline,      _sf_fskipline,      _sf_fcountline)
+_func_read_plain(_seq_read_plain_gz,     _sf_gzgetc,     _sf_gzreadline,     _sf_gzskipline,     _sf_gzcountline)
+_func_read_plain(_seq_read_plain_f_buf,  _sf_fgetc_buf,  _sf_freadline_buf,  _sf_fskipline_buf,  _sf_fcountline_buf)
+_func_read_plain(_seq_read_plain_gz_buf, _sf_gzgetc_buf, _sf_gzreadline_buf, _sf_gzskipline_buf, _sf_gzcountline_buf)
+_func_read_plain(_seq_read_plain_fd_buf, _sf_fdgetc_buf, _sf_fdreadline_buf, _sf_fdskipline_buf, _sf_fdcountline_buf)
+
+// Read first entry
+_func_read_unknown(_seq_read_unknown_f,      _sf_fgetc,      _sf_fungetc,      _sf_fskipline,      _seq_read_fastq_f,      _seq_read_fasta_f,      _seq_read_plain_f)
+_func_read_unknown(_seq_read_unknown_gz,     _sf_gzgetc,     _sf_gzungetc,     _sf_gzskipline,     _seq_read_fastq_gz,     _seq_read_fasta_gz,     _seq_read_plain_gz)
+_func_read_unknown(_seq_read_unknown_f_buf,  _sf_fgetc_buf,  _sf_fungetc_buf,  _sf_fskipline_buf,  _seq_read_fastq_f_buf,  _seq_read_fasta_f_buf,  _seq_read_plain_f_buf)
+_func_read_unknown(_seq_read_unknown_gz_buf, _sf_gzgetc_buf, _sf_gzungetc_buf, _sf_gzskipline_buf, _seq_read_fastq_gz_buf, _seq_read_fasta_gz_buf, _seq_read_plain_gz_buf)
+_func_read_unknown(_seq_read_unknown_fd_buf, _sf_fdgetc_buf, _sf_fdungetc_buf, _sf_fdskipline_buf, _seq_read_fastq_fd_buf, _seq_read_fasta_fd_buf, _seq_read_plain_fd_buf)
+
+// Read in pieces
+_func_read_chunk(_seq_read_chunk_f,      _sf_fgetc,      _sf_fungetc,      _sf_freadline,      _sf_fskipline,      _sf_fgets,      _seq_read_fasta_f)
+_func_read_chunk(_seq_read_chunk_gz,     _sf_gzgetc,     _sf_gzungetc,     _sf_gzreadline,     _sf_gzskipline,     _sf_gzgets,     _seq_read_fasta_gz)
+_func_read_chunk(_seq_read_chunk_f_buf,  _sf_fgetc_buf,  _sf_fungetc_buf,  _sf_freadline_buf,  _sf_fskipline_buf,  _sf_fgets_buf,  _seq_read_fasta_f_buf)
+_func_read_chunk(_seq_read_chunk_gz_buf, _sf_gzgetc_buf, _sf_gzungetc_buf, _sf_gzreadline_buf, _sf_gzskipline_buf, _sf_gzgets_buf, _seq_read_fasta_gz_buf)
+_func_read_chunk(_seq_read_chunk_fd_buf, _sf_fdgetc_buf, _sf_fdungetc_buf, _sf_fdreadline_buf, _sf_fdskipline_buf, _sf_fdgets_buf, _seq_read_fasta_fd_buf)
+
+//
+// Native SAM and BAM reading (when not compiled with htslib)
+//
+// BAM is BGZF compressed: a series of gzip blocks of at most 64KB. Blocks are
+// read in batches of SEQ_BGZF_NBLOCKS. If SEQ_BGZF_NTHREADS is defined, a pool
+// of threads (plus the calling thread) decompresses the next batch while the
+// current one is read; otherwise blocks are decompressed on the calling thread.
+// Records are decoded from the input buffer, two bases at a time from each
+// byte with a 256 entry table.
+//
+
+#ifndef _USESAM
+
+// Little-endian integers in BAM
+#define _seq_le16(p) ((uint16_t)((p)[0] | (p)[1] << 8))
+#define _seq_le32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | \
+                      (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+
+// Returns 0 if blk decompressed and matched its CRC, -1 otherwise
+static inline int _seq_bgzf_inflate(_seq_bgzf_block_t *blk)
+{
+  z_stream strm;
+  int status = -1;
+  memset(&strm, 0, sizeof(strm));
+  if(inflateInit2(&strm, -15) != Z_OK) return -1;
+  strm.next_in = blk->cdata;
+  strm.avail_in = (uInt)blk->clen;
+  strm.next_out = (unsigned char*)blk->udata;
+  strm.avail_out = SEQ_BGZF_BLOCK;
+  if(inflate(&strm, Z_FINISH) == Z_STREAM_END && strm.total_out == blk->ulen &&
+     crc32(0L, (unsigned char*)blk->udata, (uInt)blk->ulen) == blk->crc)
+    status = 0;
+  inflateEnd(&strm);
+  return status;
+}
+
+// Read up to SEQ_BGZF_NBLOCKS compressed blocks into `blocks`, setting
+// bz->truncated if a bad or partial block is found.
+// Returns number of blocks read
+static inline size_t _seq_bgzf_fill(seq_bgzf_t *bz, _seq_bgzf_block_t *blocks)
+{
+  _seq_bgzf_block_t *blk;
+  unsigned char h[18];
+  size_t n, len, nblocks = 0;
+
+  while(!bz->truncated && nblocks < SEQ_BGZF_NBLOCKS)
+  {
+    if((n = fread(h, 1, 18, bz->fh)) == 0) break;
+    blk = &blocks[nblocks];
+    if(n < 18 || h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4) ||
+       h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C' ||
+       (len = (size_t)_seq_le16(h+16) + 1) < 26 ||
+       fread(blk->cdata, 1, len - 18, bz->fh) != len - 18) {
+      bz->truncated = true;
+      break;
+    }
+    blk->clen = len - 26;
+    blk->crc = _seq_le32(blk->cdata + blk->clen);
+    blk->ulen = _seq_le32(blk->cdata + blk->clen + 4);
+    if(blk->ulen > SEQ_BGZF_BLOCK) { bz->truncated = true; break; }
+    if(blk->ulen) nblocks++; // drop empty blocks e.g. the eof marker
+  }
+  return nblocks;
+}
+
+#ifdef SEQ_BGZF_NTHREADS
+
+// Decompress one block of the current job. Call with bz->lock held.
+// Returns false if there is nothing left to start.
+static inline bool _seq_bgzf_step(seq_bgzf_t *bz)
+{
+  _seq_bgzf_batch_t *job = bz->job;
+  _seq_bgzf_block_t *blk;
+  if(job == NULL || job->next == job->nblocks) return false;
+  blk = &job->blocks[job->next++];
+  pthread_mutex_unlock(&bz->lock);
+  blk->status = _seq_bgzf_inflate(blk);
+  pthread_mutex_lock(&bz->lock);
+  if(++job->ndone == job->nblocks) pthread_cond_broadcast(&bz->done);
+  return true;
+}
+
+static inline void* _seq_bgzf_work(void *arg)
+{
+  seq_bgzf_t *bz = (seq_bgzf_t*)arg;
+  pthread_mutex_lock(&bz->lock);
+  while(!bz->quit)
+    if(!_seq_bgzf_step(bz)) pthread_cond_wait(&bz->work, &bz->lock);
+  pthread_mutex_unlock(&bz->lock);
+  return NULL;
+}
+
+// Read the next batch and hand it to the workers
+static inline void _seq_bgzf_submit(seq_bgzf_t *bz, _seq_bgzf_batch_t *b)
+{
+  b->nblocks = _seq_bgzf_fill(bz, b->blocks);
+  b->next = b->ndone = 0;
+  pthread_mutex_lock(&bz->lock);
+  bz->job = b;
+  pthread_cond_broadcast(&bz->work);
+  pthread_mutex_unlock(&bz->lock);
+}
+
+// Make the batch being decompressed the one being read, and start
+// decompressing the batch after it. The calling thread helps finish the batch.
+// Returns 0 on success (bz->nblocks == 0 at eof), -1 on error
+static inline int _seq_bgzf_load(seq_bgzf_t *bz)
+{
+  _seq_bgzf_batch_t *b;
+  size_t i;
+
+  if(!bz->started) { _seq_bgzf_submit(bz, &bz->batches[0]); bz->started = true; }
+
+  // Nothing more was submitted after eof or a bad block
+  if((b = bz->job) == NULL) {
+    bz->nblocks = bz->curr = bz->pos = 0;
+    return bz->truncated ? -1 : 0;
+  }
+  pthread_mutex_lock(&bz->lock);
+  while(b->ndone < b->nblocks)
+    if(!_seq_bgzf_step(bz)) pthread_cond_wait(&bz->done, &bz->lock);
+  bz->job = NULL;
+  pthread_mutex_unlock(&bz->lock);
+
+  // Blocks before a bad one are still returned, the error comes after them
+  bz->blocks = b->blocks;
+  bz->nblocks = b->nblocks;
+  bz->curr = bz->pos = 0;
+  if(bz->nblocks == 0) return bz->truncated ? -1 : 0;
+
+  _seq_bgzf_submit(bz, b == &bz->batches[0] ? &bz->batches[1] : &bz->batches[0]);
+
+  for(i = 0; i < bz->nblocks; i++)
+    if(bz->blocks[i].status < 0) return -1;
+  return 0;
+}
+
+#else
+
+// Read and decompress the next batch of blocks
+// Returns 0 on success (bz->nblocks == 0 at eof), -1 on error
+static inline int _seq_bgzf_load(seq_bgzf_t *bz)
+{
+  size_t i;
+  // Blocks before a bad one are still returned, the error comes after them
+  bz->nblocks = _seq_bgzf_fill(bz, bz->blocks);
+  bz->curr = bz->pos = 0;
+  if(bz->nblocks == 0) return bz->truncated ? -1 : 0;
+  for(i = 0; i < bz->nblocks; i++)
+    if(_seq_bgzf_inflate(&bz->blocks[i]) < 0) return -1;
+  return 0;
+}
+
+#endif
+
+#ifdef SEQ_BGZF_NTHREADS
+  #define _SEQ_BGZF_NBATCHES 2
+#else
+  #define _SEQ_BGZF_NBATCHES 1
+#endif
+
+static inline void _seq_bgzf_close(seq_bgzf_t *bz)
+{
+  size_t i;
+#ifdef SEQ_BGZF_NTHREADS
+  pthread_mutex_lock(&bz->lock);
+  bz->quit = true;
+  pthread_cond_broadcast(&bz->work);
+  pthread_mutex_unlock(&bz->lock);
+  for(i = 0; i < bz->nthreads; i++) pthread_join(bz->threads[i], NULL);
+  pthread_mutex_destroy(&bz->lock);
+  pthread_cond_destroy(&bz->work);
+  pthread_cond_destroy(&bz->done);
+  bz->blocks = bz->batches[0].blocks;
+#endif
+  if(bz->fh) fclose(bz->fh);
+  for(i = 0; i < _SEQ_BGZF_NBATCHES*SEQ_BGZF_NBLOCKS && bz->blocks; i++) {
+    free(bz->blocks[i].cdata);
+    free(bz->blocks[i].udata);
+  }
+  free(bz->blocks);
+  free(bz);
+}
+
+// Returns NULL if out of memory, fh is not closed
+static inline seq_bgzf_t* _seq_bgzf_open(FILE *fh)
+{
+  seq_bgzf_t *bz = (seq_bgzf_t*)calloc(1, sizeof(seq_bgzf_t));
+  size_t i, nblocks = _SEQ_BGZF_NBATCHES*SEQ_BGZF_NBLOCKS;
+  if(bz == NULL) return NULL;
+#ifdef SEQ_BGZF_NTHREADS
+  pthread_mutex_init(&bz->lock, NULL);
+  pthread_cond_init(&bz->work, NULL);
+  pthread_cond_init(&bz->done, NULL);
+#endif
+  bz->blocks = (_seq_bgzf_block_t*)calloc(nblocks, sizeof(_seq_bgzf_block_t));
+  if(bz->blocks == NULL) { _seq_bgzf_close(bz); return NULL; }
+#ifdef SEQ_BGZF_NTHREADS
+  bz->batches[0].blocks = bz->blocks;
+  bz->batches[1].blocks = bz->blocks + SEQ_BGZF_NBLOCKS;
+#endif
+  for(i = 0; i < nblocks; i++) {
+    bz->blocks[i].cdata = (unsigned char*)malloc(SEQ_BGZF_BLOCK);
+    bz->blocks[i].udata = (char*)malloc(SEQ_BGZF_BLOCK);
+    if(!bz->blocks[i].cdata || !bz->blocks[i].udata) {
+      _seq_bgzf_close(bz);
+      return NULL;
+    }
+  }
+#ifdef SEQ_BGZF_NTHREADS
+  // The reading thread also decompresses, so one fewer thread is started.
+  // If threads can't be started, the reading thread does all the work.
+  while(bz->nthreads + 1 < SEQ_BGZF_NTHREADS &&
+        pthread_create(&bz->threads[bz->nthreads], NULL, _seq_bgzf_work, bz) == 0)
+    bz->nthreads++;
+#endif
+  bz->fh = fh;
+  return bz;
+}
+
+// Read up to len decompressed bytes. Returns number of bytes read, 0 at eof
+// or on error (bz->status is -1 on error)
+static inline size_t _seq_bgzf_read(seq_bgzf_t *bz, char *buf, size_t len)
+{
+  _seq_bgzf_block_t *blk;
+  size_t n, total = 0;
+
+  while(total < len && bz->status == 0) {
+    if(bz->curr == bz->nblocks) {
+      if(_seq_bgzf_load(bz) < 0) { bz->status = -1; break; }
+      if(bz->nblocks == 0) break;
+    }
+    blk = &bz->blocks[bz->curr];
+    n = blk->ulen - bz->pos < len - total ? blk->ulen - bz->pos : len - total;
+    memcpy(buf + total, blk->udata + bz->pos, n);
+    total += n;
+    if((bz->pos += n) == blk->ulen) { bz->curr++; bz->pos = 0; }
+  }
+  return total;
+}
+
+// Make sure at least `need` bytes are in the input buffer
+// Returns false at eof or on error
+static inline bool _seq_bam_fill(seq_file_t *sf, size_t need)
+{
+  StreamBuffer *in = &sf->in;
+  size_t n;
+  while(in->end - in->begin < need) {
+    n = in->end - in->begin;
+    memmove(in->b+1, in->b+in->begin, n);
+    in->begin = 1;
+    in->end = 1+n;
+    if(in->size < need+1) cbuf_capacity(&in->b, &in->size, need+1);
+    if((n = _seq_bgzf_read(sf->bgzf, in->b+in->end, in->size-in->end)) == 0)
+      return false;
+    in->end += n;
+  }
+  return true;
+}
+
+// Move past the BAM header: magic, text and reference names
+// Returns 0 on success, -1 on error
+static inline int _seq_bam_read_header(seq_file_t *sf)
+{
+  StreamBuffer *in = &sf->in;
+  uint32_t i, nref, len;
+
+  if(!_seq_bam_fill(sf, 8) || memcmp(in->b+in->begin, "BAM\1", 4) != 0)
+    return -1;
+  len = _seq_le32((unsigned char*)in->b+in->begin+4);
+  in->begin += 8;
+  while(len > 0) { // header text can be long, don't hold it all
+    if(!_seq_bam_fill(sf, 1)) return -1;
+    i = in->end - in->begin < len ? in->end - in->begin : len;
+    in->begin += i;
+    len -= i;
+  }
+  if(!_seq_bam_fill(sf, 4)) return -1;
+  nref = _seq_le32((unsigned char*)in->b+in->begin);
+  in->begin += 4;
+  for(i = 0; i < nref; i++) {
+    if(!_seq_bam_fill(sf, 4)) return -1;
+    len = _seq_le32((unsigned char*)in->b+in->begin);
+    if(!_seq_bam_fill(sf, 8 + (size_t)len)) return -1;
+    in->begin += 8 + len;
+  }
+  return 0;
+}
+
+static const char _seq_bam_pairs[] =
+  "===A=C=M=G=R=S=V=T=W=Y=H=K=D=B=NA=AAACAMAGARASAVATAWAYAHAKADABAN"
+  "C=CACCCMCGCRCSCVCTCWCYCHCKCDCBCNM=MAMCMMMGMRMSMVMTMWMYMHMKMDMBMN"
+  "G=GAGCGMGGGRGSGVGTGWGYGHGKGDGBGNR=RARCRMRGRRRSRVRTRWRYRHRKRDRBRN"
+  "S=SASCSMSGSRSSSVSTSWSYSHSKSDSBSNV=VAVCVMVGVRVSVVVTVWVYVHVKVDVBVN"
+  "T=TATCTMTGTRTSTVTTTWTYTHTKTDTBTNW=WAWCWMWGWRWSWVWTWWWYWHWKWDWBWN"
+  "Y=YAYCYMYGYRYSYVYTYWYYYHYKYDYBYNH=HAHCHMHGHRHSHVHTHWHYHHHKHDHBHN"
+  "K=KAKCKMKGKRKSKVKTKWKYKHKKKDKBKND=DADCDMDGDRDSDVDTDWDYDHDKDDDBDN"
+  "B=BABCBMBGBRBSBVBTBWBYBHBKBDBBBNN=NANCNMNGNRNSNVNTNWNYNHNKNDNBNN";
+
+// Reverse complement of each pair
+static const char _seq_bam_rcpairs[] =
+  "==T=G=K=C=Y=W=B=A=S=R=D=M=H=V=N==TTTGTKTCTYTWTBTATSTRTDTMTHTVTNT"
+  "=GTGGGKGCGYGWGBGAGSGRGDGMGHGVGNG=KTKGKKKCKYKWKBKAKSKRKDKMKHKVKNK"
+  "=CTCGCKCCCYCWCBCACSCRCDCMCHCVCNC=YTYGYKYCYYYWYBYAYSYRYDYMYHYVYNY"
+  "=WTWGWKWCWYWWWBWAWSWRWDWMWHWVWNW=BTBGBKBCBYBWBBBABSBRBDBMBHBVBNB"
+  "=ATAGAKACAYAWABAAASARADAMAHAVANA=STSGSKSCSYSWSBSASSSRSDSMSHSVSNS"
+  "=RTRGRKRCRYRWRBRARSRRRDRMRHRVRNR=DTDGDKDCDYDWDBDADSDRDDDMDHDVDND"
+  "=MTMGMKMCMYMWMBMAMSMRMDMMMHMVMNM=HTHGHKHCHYHWHBHAHSHRHDHMHHHVHNH"
+  "=VTVGVKVCVYVWVBVAVSVRVDVMVHVVVNV=NTNGNKNCNYNWNBNANSNRNDNMNHNVNNN";
+
+// Decode len 4-bit bases into dst, reverse complemented if rev
+static inline void _seq_bam_decode(char *dst, const unsigned char *src,
+                                   size_t len, bool rev)
+{
+  size_t i, nbytes = (len+1)/2;
+  if(!rev) {
+    for(i = 0; i < nbytes; i++) memcpy(dst+2*i, _seq_bam_pairs+2*src[i], 2);
+  }
+  else {
+    // Fill backwards, an odd length leaves the padding base at dst[0]
+    for(i = 0; i < nbytes; i++)
+      memcpy(dst+2*(nbytes-1-i), _seq_bam_rcpairs+2*src[i], 2);
+    if(len & 1) memmove(dst, dst+1, len);
+  }
+  dst[len] = '\0';
+}
+
+// Find the value of a Z (string) tag in the optional fields [p,end)
+// Returns NULL if not found
+static inline const char* _seq_bam_aux_str(const unsigned char *p,
+                                           const unsigned char *end,
+                                           const char tag[2])
+{
+  size_t n;
+  while(p + 3 <= end) {
+    if(p[0] == tag[0] && p[1] == tag[1] && p[2] == 'Z' &&
+       memchr(p+3, 0, end-p-3)) return (const char*)p+3;
+    switch(p[2]) {
+      case 'A': case 'c': case 'C': p += 4; break;
+      case 's': case 'S': p += 5; break;
+      case 'i': case 'I': case 'f': p += 7; break;
+      case 'Z': case 'H':
+        if((p = (const unsigned char*)memchr(p+3, 0, end-p-3)) == NULL)
+          return NULL;
+        p++;
+        break;
+      case 'B':
+        if(p + 8 > end) return NULL;
+        n = strchr("cC", p[3]) ? 1 : (strchr("sS", p[3]) ? 2 : 4);
+        if((size_t)(end-p-8) / n < _seq_le32(p+4)) return NULL;
+        p += 8 + n * _seq_le32(p+4);
+        break;
+      default: return NULL;
+    }
+  }
+  return NULL;
+}
+
+static inline int _seq_read_bam(seq_file_t *sf, read_t *r)
+{
+  StreamBuffer *in = &sf->in;
+  const unsigned char *p, *name, *seq, *qual;
+  const char *comment;
+  size_t bsize, qlen, nlen, i;
+  uint16_t flag;
+  bool rev;
+
+  while(1) {
+    seq_read_reset(r);
+    if(!_seq_bam_fill(sf, 4))
+      return (sf->bgzf->status < 0 || in->begin < in->end) ? -1 : 0;
+    p = (const unsigned char*)in->b + in->begin;
+    bsize = _seq_le32(p);
+    if(bsize < 32 || !_seq_bam_fill(sf, 4+bsize)) return -1;
+    p = (const unsigned char*)in->b + in->begin + 4;
+    in->begin += 4+bsize; // p is valid until the next fill
+
+    nlen = p[8];
+    flag = _seq_le16(p+14);
+    qlen = _seq_le32(p+16);
+    name = p+32;
+    seq = name + nlen + 4*(size_t)_seq_le16(p+12);
+    qual = seq + (qlen+1)/2;
+    if(nlen == 0 || qual + qlen > p + bsize) return -1;
+
+    // Apply filters before decoding anything
+    if((flag & sf->filter.sam_flags_excl) || !_seq_filter_len(sf, qlen) ||
+       (sf->filter.name_prefix &&
+        strncmp((const char*)name, sf->filter.name_prefix,
+                sf->filter_prefix_len) != 0) ||
+       (sf->filter.name_regex &&
+        regexec(sf->filter.name_regex, (const char*)name, 0, NULL, 0) != 0))
+      continue;
+    break;
+  }
+
+  r->from_sam = true;
+  r->flag = flag;
+  rev = (flag & SEQ_SAM_FREVERSE) != 0;
+
+  if(!(sf->skip & SEQ_SKIP_NAME)) {
+    cbuf_append_str(&r->name.b, &r->name.end, &r->name.size,
+                    (char*)name, nlen-1);
+    // Comment from a FASTQ header, see seq_sprint_ubam()
+    if((comment = _seq_bam_aux_str(qual+qlen, p+bsize, "CO")) != NULL) {
+      cbuf_append_char(&r->name.b, &r->name.end, &r->name.size, ' ');
+      cbuf_append_str(&r->name.b, &r->name.end, &r->name.size,
+                      (char*)comment, strlen(comment));
+    }
+  }
+
+  if(sf->skip & SEQ_SKIP_SEQ) r->seq.end = qlen;
+  else {
+    cbuf_capacity(&r->seq.b, &r->seq.size, qlen+1);
+    _seq_bam_decode(r->seq.b, seq, qlen, rev);
+    r->seq.end = qlen;
+  }
+
+  // 0xff means no quality scores
+  if(!(sf->skip & SEQ_SKIP_QUAL) && qlen && qual[0] != 0xff) {
+    cbuf_capacity(&r->qual.b, &r->qual.size, qlen);
+    for(i = 0; i < qlen; i++)
+      r->qual.b[rev ? qlen-1-i : i] = (char)(33 + qual[i]);
+    r->qual.b[r->qual.end = qlen] = '\0';
+  }
+
+  return 1;
+}
+
+// Read a SAM line: QNAME FLAG RNAME POS MAPQ CIGAR RNEXT PNEXT TLEN SEQ QUAL
+// The line is read into r->name, then SEQ and QUAL are copied out
+#define _func_read_sam(_read_sam,__readline)                                   \
+  static inline int _read_sam(seq_file_t *sf, read_t *r)                       \
+  {                                                                            \
+    char *line, *fields[11], *comment;                                         \
+    size_t i, n, seqlen, quallen;                                              \
+    uint16_t flag;                                                             \
+                                                                               \
+    next_entry:                                                                \
+    seq_read_reset(r);                                                         \
+    do {                                                                       \
+      r->name.end = 0;                                                         \
+      if(__readline(sf, r->name) == 0) return 0;                               \
+      cbuf_chomp(r->name.b, &r->name.end);                                     \
+    } while(r->name.end == 0 || r->name.b[0] == '@');                          \
+                                                                               \
+    line = r->name.b;                                                          \
+    for(fields[0] = line, n = 1; n < 11; n++) {                                \
+      if((fields[n] = strchr(fields[n-1], '\t')) == NULL) return -1;           \
+      *(fields[n]++) = '\0';                                                   \
+    }                                                                          \
+    flag = (uint16_t)strtoul(fields[1], NULL, 10);                             \
+    seqlen = fields[10] - fields[9] - 1;                                       \
+    for(quallen = 0; fields[10][quallen] && fields[10][quallen] != '\t'; quallen++) {}\
+    if(seqlen == 1 && fields[9][0] == '*') seqlen = 0;                         \
+    if(quallen == 1 && fields[10][0] == '*') quallen = 0;                      \
+                                                                               \
+    if((flag & sf->filter.sam_flags_excl) || !_seq_filter_len(sf, seqlen) ||   \
+       !_seq_filter_name(sf, r)) goto next_entry;                              \
+                                                                               \
+    r->from_sam = true;                                                        \
+    r->flag = flag;                                                            \
+    if(sf->skip & SEQ_SKIP_SEQ) r->seq.end = seqlen;                           \
+    else {                                                                     \
+      cbuf_capacity(&r->seq.b, &r->seq.size, seqlen);                          \
+      memcpy(r->seq.b, fields[9], seqlen);                                     \
+      r->seq.b[r->seq.end = seqlen] = '\0';                                    \
+    }                                                                          \
+    if(!(sf->skip & SEQ_SKIP_QUAL)) {                                          \
+      cbuf_capacity(&r->qual.b, &r->qual.size, quallen);                       \
+      memcpy(r->qual.b, fields[10], quallen);                                  \
+      r->qual.b[r->qual.end = quallen] = '\0';                                 \
+    }                                                                          \
+    r->name.end = strlen(line);                                                \
+    /* Comment from a FASTQ header, see seq_sprint_ubam() */                   \
+    if((comment = strstr(fields[10]+quallen, "\tCO:Z:")) != NULL) {            \
+      n = strcspn(comment += 6, "\t");                                         \
+      line[r->name.end++] = ' ';                                               \
+      memmove(line+r->name.end, comment, n);                                   \
+      line[r->name.end += n] = '\0';                                           \
+    }                                                                          \
+    /* Stored reverse complemented, give the read as sequenced */              \
+    if(flag & SEQ_SAM_FREVERSE) {                                              \
+      if(r->seq.b[0]) seq_read_reverse_complement(r);                          \
+      else if(r->qual.end > 1)                                                 \
+        for(i = 0, n = r->qual.end-1; i < n; i++, n--)                         \
+          _SF_SWAP(r->qual.b[i], r->qual.b[n]);                                \
+    }                                                                          \
+    _seq_filter_clear_name(sf, r);                                             \
+    return 1;                                                                  \
+  }
+
+_func_read_sam(_seq_read_sam_f_buf, _sf_freadline_buf)
+
+#undef _seq_le16
+#undef _seq_le32
+
+#endif /* !_USESAM */
+
+//
+// Columnar container (.sqc), a binary format that is fast to read again.
+// Reads are stored in blocks, each block as SEQ_SQC_NCOLS zlib compressed
+// columns. Only the columns needed for the fields being read are loaded (see
+// seq_skip_fields()). Little-endian layout:
+//
+//   "SQC\1"
+//   blocks: compressed columns, one after another
+//   index:  per block u64 offset, u32 nreads, u32 clen and ulen per column
+//   footer: u64 index offset, u32 nblocks, "SQC\1"
+//
+// Columns:
+//   lengths: varint sequence length and quality length per read
+//   names:   nul terminated
+//   bases:   2-bit A,C,G,T, four per byte from the low bits, reads end to end
+//   runs:    other characters (N etc), varint gap and length then the char
+//   case:    lower case bases, varint gap and length
+//   quality: quality scores end to end
+// Run positions count bases from the start of the block, gaps from the end
+// of the previous run.
+//
+
+#define SEQ_SQC_BLOCK_READS (1<<16)
+#define SEQ_SQC_BLOCK_BASES (1<<22)
+#define _SEQ_SQC_INDEX_ENTRY (12 + 8 * SEQ_SQC_NCOLS)
+
+enum { _SQC_LENS, _SQC_NAMES, _SQC_BASES, _SQC_RUNS, _SQC_CASE, _SQC_QUAL };
+
+// Base to 2-bit code, 4 for anything but a,c,g,t
+static const uint8_t _seq_sqc_codes[256] = {
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
+// 2-bit byte to four bases
+static const char _seq_sqc_quads[] =
+  "AAAACAAAGAAATAAAACAACCAAGCAATCAAAGAACGAAGGAATGAAATAACTAAGTAATTAA"
+  "AACACACAGACATACAACCACCCAGCCATCCAAGCACGCAGGCATGCAATCACTCAGTCATTCA"
+  "AAGACAGAGAGATAGAACGACCGAGCGATCGAAGGACGGAGGGATGGAATGACTGAGTGATTGA"
+  "AATACATAGATATATAACTACCTAGCTATCTAAGTACGTAGGTATGTAATTACTTAGTTATTTA"
+  "AAACCAACGAACTAACACACCCACGCACTCACAGACCGACGGACTGACATACCTACGTACTTAC"
+  "AACCCACCGACCTACCACCCCCCCGCCCTCCCAGCCCGCCGGCCTGCCATCCCTCCGTCCTTCC"
+  "AAGCCAGCGAGCTAGCACGCCCGCGCGCTCGCAGGCCGGCGGGCTGGCATGCCTGCGTGCTTGC"
+  "AATCCATCGATCTATCACTCCCTCGCTCTCTCAGTCCGTCGGTCTGTCATTCCTTCGTTCTTTC"
+  "AAAGCAAGGAAGTAAGACAGCCAGGCAGTCAGAGAGCGAGGGAGTGAGATAGCTAGGTAGTTAG"
+  "AACGCACGGACGTACGACCGCCCGGCCGTCCGAGCGCGCGGGCGTGCGATCGCTCGGTCGTTCG"
+  "AAGGCAGGGAGGTAGGACGGCCGGGCGGTCGGAGGGCGGGGGGGTGGGATGGCTGGGTGGTTGG"
+  "AATGCATGGATGTATGACTGCCTGGCTGTCTGAGTGCGTGGGTGTGTGATTGCTTGGTTGTTTG"
+  "AAATCAATGAATTAATACATCCATGCATTCATAGATCGATGGATTGATATATCTATGTATTTAT"
+  "AACTCACTGACTTACTACCTCCCTGCCTTCCTAGCTCGCTGGCTTGCTATCTCTCTGTCTTTCT"
+  "AAGTCAGTGAGTTAGTACGTCCGTGCGTTCGTAGGTCGGTGGGTTGGTATGTCTGTGTGTTTGT"
+  "AATTCATTGATTTATTACTTCCTTGCTTTCTTAGTTCGTTGGTTTGTTATTTCTTTGTTTTTTT";
+
+static inline void _seq_put_le16(unsigned char *p, uint16_t x)
+{
+  p[0] = (unsigned char)x; p[1] = (unsigned char)(x >> 8);
+}
+
+static inline void _seq_put_le32(unsigned char *p, uint32_t x)
+{
+  p[0] = (unsigned char)x;         p[1] = (unsigned char)(x >> 8);
+  p[2] = (unsigned char)(x >> 16); p[3] = (unsigned char)(x >> 24);
+}
+
+static inline void _seq_put_le64(unsigned char *p, uint64_t x)
+{
+  _seq_put_le32(p, (uint32_t)x);
+  _seq_put_le32(p+4, (uint32_t)(x >> 32));
+}
+
+static inline uint32_t _seq_get_le32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+         (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t _seq_get_le64(const unsigned char *p)
+{
+  return _seq_get_le32(p) | (uint64_t)_seq_get_le32(p+4) << 32;
+}
+
+static inline void _seq_sqc_put_varint(StreamBuffer *buf, size_t x)
+{
+  for(; x >= 128; x >>= 7) sputc_buf(buf, (int)(x & 127) | 128);
+  sputc_buf(buf, (int)x);
+}
+
+// Returns false if the varint runs past the end of buf
+static inline bool _seq_sqc_get_varint(const StreamBuffer *buf, size_t *pos,
+                                       size_t *x)
+{
+  const unsigned char *p = (const unsigned char*)buf->b;
+  unsigned shift = 0;
+  for(*x = 0; *pos < buf->end && shift < 64; shift += 7) {
+    *x |= (size_t)(p[*pos] & 127) << shift;
+    if(!(p[(*pos)++] & 128)) return true;
+  }
+  return false;
+}
+
+// Load the next run from a run column. Sets run->len = 0 at the end
+static inline void _seq_sqc_next_run(const StreamBuffer *col, size_t *pos,
+                                     _seq_sqc_run_t *run, bool has_char)
+{
+  size_t gap, len;
+  if(!_seq_sqc_get_varint(col, pos, &gap) ||
+     !_seq_sqc_get_varint(col, pos, &len) ||
+     (has_char && *pos >= col->end)) { run->len = 0; return; }
+  run->start += run->len + gap;
+  run->len = len;
+  if(has_char) run->c = col->b[(*pos)++];
+}
+
+// Read and decompress column c of the current block
+// Returns 0 on success, -1 on error
+static inline int _seq_sqc_load_col(seq_sqc_t *q, int c)
+{
+  const _seq_sqc_block_t *blk = &q->blocks[q->next-1];
+  uint64_t off = blk->offset;
+  uLongf ulen = blk->ulen[c];
+  int i;
+
+  q->loaded[c] = true;
+  q->cols[c].end = 0;
+  if(blk->ulen[c] == 0) return 0;
+  for(i = 0; i < c; i++) off += blk->clen[i];
+  cbuf_capacity(&q->tmp.b, &q->tmp.size, blk->clen[c]);
+  cbuf_capacity(&q->cols[c].b, &q->cols[c].size, blk->ulen[c]);
+  if(fseeko(q->fh, (off_t)off, SEEK_SET) != 0 ||
+     fread(q->tmp.b, 1, blk->clen[c], q->fh) != blk->clen[c] ||
+     uncompress((Bytef*)q->cols[c].b, &ulen, (Bytef*)q->tmp.b,
+                blk->clen[c]) != Z_OK || ulen != blk->ulen[c]) return -1;
+  q->cols[c].end = ulen;
+  return 0;
+}
+
+// Move to the next block, only the lengths column is loaded here
+// Returns 0 on success, -1 on error
+static inline int _seq_sqc_next_block(seq_file_t *sf)
+{
+  seq_sqc_t *q = sf->sqc;
+  const _seq_sqc_block_t *blk = &q->blocks[q->next++];
+  memset(q->loaded, 0, sizeof(q->loaded));
+  q->i = q->namei = 0;
+  q->nreads = blk->nreads;
+  q->lenpos = q->namepos = q->base = q->qualpos = q->excpos = q->maskpos = 0;
+  memset(&q->exc, 0, sizeof(q->exc));
+  memset(&q->mask, 0, sizeof(q->mask));
+  // Quality scores mean FASTQ, otherwise FASTA unless there are no names
+  if(blk->ulen[_SQC_QUAL]) sf->format = SEQ_FMT_FASTQ;
+  else if(sf->format == SEQ_FMT_UNKNOWN)
+    sf->format = blk->ulen[_SQC_NAMES] > blk->nreads ? SEQ_FMT_FASTA
+                                                      : SEQ_FMT_PLAIN;
+  return _seq_sqc_load_col(q, _SQC_LENS);
+}
+
+// Apply runs in [start,start+len) to dst
+// Returns 0 on success, -1 on error
+static inline int _seq_sqc_apply_runs(seq_sqc_t *q, int c, char *dst,
+                                       size_t start, size_t len)
+{
+  _seq_sqc_run_t *run = c == _SQC_RUNS ? &q->exc : &q->mask;
+  size_t *pos = c == _SQC_RUNS ? &q->excpos : &q->maskpos;
+  size_t a, b, i, end = start + len;
+
+  if(!q->loaded[c]) {
+    if(_seq_sqc_load_col(q, c) < 0) return -1;
+    _seq_sqc_next_run(&q->cols[c], pos, run, c == _SQC_RUNS);
+  }
+
+  // Skip runs in reads that were not decoded
+  while(run->len && run->start + run->len <= start)
+    _seq_sqc_next_run(&q->cols[c], pos, run, c == _SQC_RUNS);
+
+  while(run->len && run->start < end) {
+    a = run->start > start ? run->start : start;
+    b = run->start + run->len < end ? run->start + run->len : end;
+    if(c == _SQC_RUNS) memset(dst + a - start, run->c, b - a);
+    else for(i = a; i < b; i++) dst[i-start] = (char)tolower(dst[i-start]);
+    if(run->start + run->len > end) break;
+    _seq_sqc_next_run(&q->cols[c], pos, run, c == _SQC_RUNS);
+  }
+  return 0;
+}
+
+static inline int _seq_read_sqc(seq_file_t *sf, read_t *r)
+{
+  seq_sqc_t *q = sf->sqc;
+  const StreamBuffer *names;
+  const unsigned char *bases;
+  const char *name, *end;
+  size_t slen, qlen, start, qpos, i, p;
+  uint8_t skip = _seq_parse_skip(sf);
+
+  while(1) {
+    seq_read_reset(r);
+    if(q->i == q->nreads) {
+      if(q->next == q->end) return 0;
+      if(_seq_sqc_next_block(sf) < 0) return -1;
+      continue;
+    }
+
+    if(!_seq_sqc_get_varint(&q->cols[_SQC_LENS], &q->lenpos, &slen) ||
+       !_seq_sqc_get_varint(&q->cols[_SQC_LENS], &q->lenpos, &qlen)) return -1;
+    start = q->base;
+    qpos = q->qualpos;
+    q->base += slen;
+    q->qualpos += qlen;
+    q->i++;
+
+    if(!_seq_filter_len(sf, slen)) continue;
+
+    if(!(skip & SEQ_SKIP_NAME)) {
+      if(!q->loaded[_SQC_NAMES] && _seq_sqc_load_col(q, _SQC_NAMES) < 0)
+        return -1;
+      // Names of reads that were skipped are passed over here
+      names = &q->cols[_SQC_NAMES];
+      do {
+        name = names->b + q->namepos;
+        if(q->namepos >= names->end ||
+           (end = memchr(name, 0, names->end - q->namepos)) == NULL) return -1;
+        q->namepos = end + 1 - names->b;
+      } while(++q->namei < q->i);
+      cbuf_append_str(&r->name.b, &r->name.end, &r->name.size,
+                      (char*)name, strlen(name));
+      if(!_seq_filter_name(sf, r)) continue;
+    }
+
+    if(skip & SEQ_SKIP_SEQ) r->seq.end = slen;
+    else {
+      if(!q->loaded[_SQC_BASES] && _seq_sqc_load_col(q, _SQC_BASES) < 0)
+        return -1;
+      if((start + slen + 3) / 4 > q->cols[_SQC_BASES].end) return -1;
+      bases = (const unsigned char*)q->cols[_SQC_BASES].b;
+      cbuf_capacity(&r->seq.b, &r->seq.size, slen);
+      for(i = 0, p = start; i < slen && (p & 3); i++, p++)
+        r->seq.b[i] = "ACGT"[(bases[p>>2] >> ((p&3)*2)) & 3];
+      for(; i + 4 <= slen; i += 4, p += 4)
+        memcpy(r->seq.b + i, _seq_sqc_quads + 4*bases[p>>2], 4);
+      for(; i < slen; i++, p++)
+        r->seq.b[i] = "ACGT"[(bases[p>>2] >> ((p&3)*2)) & 3];
+      if(_seq_sqc_apply_runs(q, _SQC_RUNS, r->seq.b, start, slen) < 0 ||
+         _seq_sqc_apply_runs(q, _SQC_CASE, r->seq.b, start, slen) < 0)
+        return -1;
+      r->seq.b[r->seq.end = slen] = '\0';
+    }
+
+    if(!(skip & SEQ_SKIP_QUAL) && qlen) {
+      if(!q->loaded[_SQC_QUAL] && _seq_sqc_load_col(q, _SQC_QUAL) < 0)
+        return -1;
+      if(qpos + qlen > q->cols[_SQC_QUAL].end) return -1;
+      cbuf_capacity(&r->qual.b, &r->qual.size, qlen);
+      memcpy(r->qual.b, q->cols[_SQC_QUAL].b + qpos, qlen);
+      r->qual.b[r->qual.end = qlen] = '\0';
+    }
+
+    _seq_filter_clear_name(sf, r);
+    return 1;
+  }
+}
+
+static inline void _seq_sqc_close(seq_sqc_t *q)
+{
+  int c;
+  if(q->fh) fclose(q->fh);
+  for(c = 0; c < SEQ_SQC_NCOLS; c++) free(q->cols[c].b);
+  free(q->tmp.b);
+  free(q->blocks);
+  free(q);
+}
+
+// Open path if it is a columnar container
+// Returns 1 on success, 0 if it is not a container, -1 on error
+static inline int _seq_sqc_open(seq_file_t *sf, const char *path)
+{
+  unsigned char buf[_SEQ_SQC_INDEX_ENTRY];
+  struct stat st;
+  seq_sqc_t *q;
+  uint64_t idx, off;
+  size_t i;
+  int c;
+
+  // Don't read from pipes to check the magic
+  if(stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 20)
+    return 0;
+  if((q = (seq_sqc_t*)calloc(1, sizeof(seq_sqc_t))) == NULL) return -1;
+  if((q->fh = fopen(path, "rb")) == NULL ||
+     fread(buf, 1, 4, q->fh) != 4 || memcmp(buf, "SQC\1", 4) != 0) {
+    _seq_sqc_close(q);
+    return 0;
+  }
+
+  if(fseeko(q->fh, -16, SEEK_END) != 0 || fread(buf, 1, 16, q->fh) != 16 ||
+     memcmp(buf+12, "SQC\1", 4) != 0) goto error;
+  idx = _seq_get_le64(buf);
+  q->nblocks = q->end = _seq_get_le32(buf+8);
+  if(idx + (uint64_t)q->nblocks * _SEQ_SQC_INDEX_ENTRY + 16 !=
+     (uint64_t)st.st_size || fseeko(q->fh, (off_t)idx, SEEK_SET) != 0 ||
+     (q->blocks = (_seq_sqc_block_t*)calloc(q->nblocks ? q->nblocks : 1,
+                                            sizeof(_seq_sqc_block_t))) == NULL)
+    goto error;
+
+  for(i = 0; i < q->nblocks; i++) {
+    if(fread(buf, 1, _SEQ_SQC_INDEX_ENTRY, q->fh) != _SEQ_SQC_INDEX_ENTRY)
+      goto error;
+    q->blocks[i].offset = off = _seq_get_le64(buf);
+    q->blocks[i].nreads = _seq_get_le32(buf+8);
+    for(c = 0; c < SEQ_SQC_NCOLS; c++) {
+      q->blocks[i].clen[c] = _seq_get_le32(buf+12+8*c);
+      q->blocks[i].ulen[c] = _seq_get_le32(buf+16+8*c);
+      off += q->blocks[i].clen[c];
+    }
+    if(off > idx) goto error;
+  }
+
+  sf->sqc = q;
+  sf->readfunc = sf->origreadfunc = _seq_read_sqc;
+  return 1;
+
+  error:
+  fprintf(stderr, "[%s:%i] Error: bad container index: %s\n",
+          __FILE__, __LINE__, path);
+  _seq_sqc_close(q);
+  return -1;
+}
+
+// Only read blocks [start,end) of a container
+static inline void _seq_sqc_set_blocks(seq_sqc_t *q, size_t start, size_t end)
+{
+  q->next = start;
+  q->end = end;
+  q->i = q->nreads = 0;
+}
+
+/*
+ Write a columnar container, which seq_open() reads like any other file.
+ Writing is sequential so fh can be a pipe, but reading needs a file.
+
+ seq_sqc_writer_open(w,fh)
+ seq_sqc_write(w,r)
+ seq_sqc_writer_close(w) - writes the index, fh is not closed
+*/
+
+typedef struct
+{
+  FILE *fh;
+  StreamBuffer cols[SEQ_SQC_NCOLS], tmp, index;
+  size_t nreads, nbases; // in the current block
+  size_t excend, maskend; // end of the last run written
+  _seq_sqc_run_t exc, mask; // runs not yet written
+  uint64_t offset; // bytes written
+  size_t nblocks;
+  int status; // 0 ok, -1 on write error
+} seq_sqc_writer_t;
+
+// Returns 0 on success, -1 on error
+static inline int seq_sqc_writer_open(seq_sqc_writer_t *w, FILE *fh)
+{
+  memset(w, 0, sizeof(seq_sqc_writer_t));
+  w->fh = fh;
+  w->offset = 4;
+  return fwrite("SQC\1", 1, 4, fh) == 4 ? 0 : -1;
+}
+
+static inline void _seq_sqc_put_run(StreamBuffer *col, _seq_sqc_run_t *run,
+                                    size_t *prev_end, bool has_char)
+{
+  if(run->len == 0) return;
+  _seq_sqc_put_varint(col, run->start - *prev_end);
+  _seq_sqc_put_varint(col, run->len);
+  if(has_char) sputc_buf(col, run->c);
+  *prev_end = run->start + run->len;
+  run->len = 0;
+}
+
+// Extend the current run with base p, or start a new one
+static inline void _seq_sqc_add_run(StreamBuffer *col, _seq_sqc_run_t *run,
+                                    size_t *prev_end, size_t p, char c,
+                                    bool has_char)
+{
+  if(run->len && p == run->start + run->len && run->c == c) { run->len++; return; }
+  _seq_sqc_put_run(col, run, prev_end, has_char);
+  run->start = p;
+  run->len = 1;
+  run->c = c;
+}
+
+// Compress and write the current block
+static inline void _seq_sqc_flush(seq_sqc_writer_t *w)
+{
+  unsigned char entry[_SEQ_SQC_INDEX_ENTRY];
+  uLongf clen;
+  int c;
+
+  if(w->nreads == 0) return;
+  _seq_sqc_put_run(&w->cols[_SQC_RUNS], &w->exc, &w->excend, true);
+  _seq_sqc_put_run(&w->cols[_SQC_CASE], &w->mask, &w->maskend, false);
+
+  _seq_put_le64(entry, w->offset);
+  _seq_put_le32(entry+8, (uint32_t)w->nreads);
+  for(c = 0; c < SEQ_SQC_NCOLS; c++) {
+    clen = 0;
+    if(w->cols[c].end) {
+      clen = compressBound(w->cols[c].end);
+      cbuf_capacity(&w->tmp.b, &w->tmp.size, clen);
+      if(compress2((Bytef*)w->tmp.b, &clen, (Bytef*)w->cols[c].b,
+                   w->cols[c].end, Z_DEFAULT_COMPRESSION) != Z_OK ||
+         fwrite(w->tmp.b, 1, clen, w->fh) != clen) w->status = -1;
+    }
+    _seq_put_le32(entry+12+8*c, (uint32_t)clen);
+    _seq_put_le32(entry+16+8*c, (uint32_t)w->cols[c].end);
+    w->offset += clen;
+    w->cols[c].end = 0;
+  }
+  swrite_buf(&w->index, entry, sizeof(entry));
+  w->nblocks++;
+  w->nreads = w->nbases = w->excend = w->maskend = 0;
+}
+
+// Returns 0 on success, -1 on write error
+static inline int seq_sqc_write(seq_sqc_writer_t *w, const read_t *r)
+{
+  const char *s = r->seq.b;
+  unsigned char *bases;
+  size_t i, p, nbytes;
+  uint8_t code;
+
+  _seq_sqc_put_varint(&w->cols[_SQC_LENS], r->seq.end);
+  _seq_sqc_put_varint(&w->cols[_SQC_LENS], r->qual.end);
+  swrite_buf(&w->cols[_SQC_NAMES], r->name.b, r->name.end);
+  sputc_buf(&w->cols[_SQC_NAMES], '\0');
+  swrite_buf(&w->cols[_SQC_QUAL], r->qual.b, r->qual.end);
+
+  // Reads are packed end to end, so a read can start part way into a byte
+  nbytes = (w->nbases + r->seq.end + 3) / 4;
+  cbuf_capacity(&w->cols[_SQC_BASES].b, &w->cols[_SQC_BASES].size, nbytes);
+  bases = (unsigned char*)w->cols[_SQC_BASES].b;
+  if(nbytes > w->cols[_SQC_BASES].end)
+    memset(bases + w->cols[_SQC_BASES].end, 0,
+           nbytes - w->cols[_SQC_BASES].end);
+  w->cols[_SQC_BASES].end = nbytes;
+
+  for(i = 0, p = w->nbases; i < r->seq.end; i++, p++) {
+    if((code = _seq_sqc_codes[(uint8_t)s[i]]) > 3) {
+      _seq_sqc_add_run(&w->cols[_SQC_RUNS], &w->exc, &w->excend, p,
+                       s[i] >= 'a' && s[i] <= 'z' ? s[i] - 'a' + 'A' : s[i],
+                       true);
+      code = 0;
+    }
+    if(s[i] >= 'a' && s[i] <= 'z')
+      _seq_sqc_add_run(&w->cols[_SQC_CASE], &w->mask, &w->maskend, p, 0, false);
+    bases[p>>2] |= (unsigned char)(code << ((p&3)*2));
+  }
+
+  w->nbases += r->seq.end;
+  if(++w->nreads >= SEQ_SQC_BLOCK_READS || w->nbases >= SEQ_SQC_BLOCK_BASES)
+    _seq_sqc_flush(w);
+  return w->status;
+}
+
+// Write the last block and the index
+// Returns 0 on success, -1 on error
+static inline int seq_sqc_writer_close(seq_sqc_writer_t *w)
+{
+  unsigned char footer[16];
+  int c;
+
+  _seq_sqc_flush(w);
+  _seq_put_le64(footer, w->offset);
+  _seq_put_le32(footer+8, (uint32_t)w->nblocks);
+  memcpy(footer+12, "SQC\1", 4);
+  if((w->index.end &&
+      fwrite(w->index.b, 1, w->index.end, w->fh) != w->index.end) ||
+     fwrite(footer, 1, 16, w->fh) != 16 || fflush(w->fh) != 0) w->status = -1;
+
+  for(c = 0; c < SEQ_SQC_NCOLS; c++) free(w->cols[c].b);
+  free(w->tmp.b);
+  free(w->index.b);
+  memset(w->cols, 0, sizeof(w->cols));
+  w->tmp.b = w->index.b = NULL;
+  return w->status;
+}
+
+/*
+ UCSC .2bit: a header, an index of names and record offsets, then a record
+ per sequence: length, N blocks, soft-mask (lower case) blocks and bases
+ packed four to a byte (T,C,A,G = 0..3, first base in the high bits).
+ Integers are 32-bit in the byte order of the signature. Version 1 files
+ have 64-bit record offsets.
+
+ The file is mapped into memory. seq_read() returns each sequence in turn and
+ seq_twobit_fetch() gets a region of one without touching the rest.
+
+ seq_twobit_count(sf)
+ seq_twobit_find(sf,name)
+ seq_twobit_length(sf,i)
+ seq_twobit_fetch(sf,i,start,end,r)
+*/
+
+#define SEQ_TWOBIT_SIG 0x1A412743
+
+// 2-bit byte to four bases
+static const char _seq_twobit_quads[] =
+  "TTTTTTTCTTTATTTGTTCTTTCCTTCATTCGTTATTTACTTAATTAGTTGTTTGCTTGATTGG"
+  "TCTTTCTCTCTATCTGTCCTTCCCTCCATCCGTCATTCACTCAATCAGTCGTTCGCTCGATCGG"
+  "TATTTATCTATATATGTACTTACCTACATACGTAATTAACTAAATAAGTAGTTAGCTAGATAGG"
+  "TGTTTGTCTGTATGTGTGCTTGCCTGCATGCGTGATTGACTGAATGAGTGGTTGGCTGGATGGG"
+  "CTTTCTTCCTTACTTGCTCTCTCCCTCACTCGCTATCTACCTAACTAGCTGTCTGCCTGACTGG"
+  "CCTTCCTCCCTACCTGCCCTCCCCCCCACCCGCCATCCACCCAACCAGCCGTCCGCCCGACCGG"
+  "CATTCATCCATACATGCACTCACCCACACACGCAATCAACCAAACAAGCAGTCAGCCAGACAGG"
+  "CGTTCGTCCGTACGTGCGCTCGCCCGCACGCGCGATCGACCGAACGAGCGGTCGGCCGGACGGG"
+  "ATTTATTCATTAATTGATCTATCCATCAATCGATATATACATAAATAGATGTATGCATGAATGG"
+  "ACTTACTCACTAACTGACCTACCCACCAACCGACATACACACAAACAGACGTACGCACGAACGG"
+  "AATTAATCAATAAATGAACTAACCAACAAACGAAATAAACAAAAAAAGAAGTAAGCAAGAAAGG"
+  "AGTTAGTCAGTAAGTGAGCTAGCCAGCAAGCGAGATAGACAGAAAGAGAGGTAGGCAGGAAGGG"
+  "GTTTGTTCGTTAGTTGGTCTGTCCGTCAGTCGGTATGTACGTAAGTAGGTGTGTGCGTGAGTGG"
+  "GCTTGCTCGCTAGCTGGCCTGCCCGCCAGCCGGCATGCACGCAAGCAGGCGTGCGCGCGAGCGG"
+  "GATTGATCGATAGATGGACTGACCGACAGACGGAATGAACGAAAGAAGGAGTGAGCGAGAGAGG"
+  "GGTTGGTCGGTAGGTGGGCTGGCCGGCAGGCGGGATGGACGGAAGGAGGGGTGGGCGGGAGGGG";
+
+typedef struct
+{
+  uint32_t len, nblocks, nmask;
+  const unsigned char *nstarts, *nsizes, *mstarts, *msizes, *dna;
+} _seq_twobit_rec_t;
+
+static inline uint32_t _seq_twobit_u32(const seq_twobit_t *t,
+                                       const unsigned char *p)
+{
+  if(!t->swap) return _seq_get_le32(p);
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+         (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+static inline uint64_t _seq_twobit_u64(const seq_twobit_t *t,
+                                       const unsigned char *p)
+{
+  if(!t->swap) return _seq_get_le64(p);
+  return (uint64_t)_seq_twobit_u32(t, p) << 32 | _seq_twobit_u32(t, p+4);
+}
+
+// Find the parts of record i
+// Returns 0 on success, -1 if it runs past the end of the file
+static inline int _seq_twobit_rec(const seq_twobit_t *t, size_t i,
+                                  _seq_twobit_rec_t *rec)
+{
+  uint64_t off = t->seqs[i].offset;
+
+  if(off + 8 > t->size) return -1;
+  rec->len = _seq_twobit_u32(t, t->data + off);
+  rec->nblocks = _seq_twobit_u32(t, t->data + off + 4);
+  rec->nstarts = t->data + off + 8;
+  off += 8 + 8 * (uint64_t)rec->nblocks;
+  if(off + 4 > t->size) return -1;
+  rec->nsizes = rec->nstarts + 4 * (size_t)rec->nblocks;
+
+  rec->nmask = _seq_twobit_u32(t, t->data + off);
+  rec->mstarts = t->data + off + 4;
+  off += 4 + 8 * (uint64_t)rec->nmask + 4; // mask blocks and a reserved word
+  if(off + (rec->len + 3ULL) / 4 > t->size) return -1;
+  rec->msizes = rec->mstarts + 4 * (size_t)rec->nmask;
+  rec->dna = t->data + off;
+  return 0;
+}
+
+// Set dst[0..end-start) from the blocks overlapping [start,end): 'N' for N
+// blocks, lower case for mask blocks. Blocks are sorted and don't overlap.
+static inline void _seq_twobit_blocks(const seq_twobit_t *t,
+                                      const unsigned char *starts,
+                                      const unsigned char *sizes, size_t n,
+                                      bool mask, char *dst,
+                                      size_t start, size_t end)
+{
+  size_t lo = 0, hi = n, mid, a, b, i;
+
+  // First block ending after start
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if((size_t)_seq_twobit_u32(t, starts + 4*mid) +
+       _seq_twobit_u32(t, sizes + 4*mid) <= start) lo = mid + 1;
+    else hi = mid;
+  }
+
+  for(; lo < n && (a = _seq_twobit_u32(t, starts + 4*lo)) < end; lo++) {
+    b = a + _seq_twobit_u32(t, sizes + 4*lo);
+    if(a < start) a = start;
+    if(b > end) b = end;
+    if(b <= a) continue;
+    if(mask) for(i = a; i < b; i++) dst[i-start] = (char)tolower(dst[i-start]);
+    else memset(dst + a - start, 'N', b - a);
+  }
+}
+
+// Set r->seq to bases [start,end) of a record
+static inline void _seq_twobit_unpack(const seq_twobit_t *t,
+                                      const _seq_twobit_rec_t *rec,
+                                      size_t start, size_t end, read_t *r)
+{
+  const unsigned char *dna = rec->dna;
+  size_t i = 0, p = start, len = end - start;
+  char *s;
+
+  cbuf_capacity(&r->seq.b, &r->seq.size, len);
+  s = r->seq.b;
+  for(; i < len && (p & 3); i++, p++)
+    s[i] = "TCAG"[(dna[p>>2] >> (6 - 2*(p&3))) & 3];
+  for(; i + 4 <= len; i += 4, p += 4)
+    memcpy(s + i, _seq_twobit_quads + 4*dna[p>>2], 4);
+  for(; i < len; i++, p++)
+    s[i] = "TCAG"[(dna[p>>2] >> (6 - 2*(p&3))) & 3];
+
+  _seq_twobit_blocks(t, rec->nstarts, rec->nsizes, rec->nblocks, false,
+                     s, start, end);
+  _seq_twobit_blocks(t, rec->mstarts, rec->msizes, rec->nmask, true,
+                     s, start, end);
+  s[r->seq.end = len] = '\0';
+}
+
+static inline void _seq_twobit_name(const seq_twobit_t *t, size_t i,
+                                    read_t *r)
+{
+  r->name.end = 0;
+  cbuf_append_str(&r->name.b, &r->name.end, &r->name.size,
+                  (char*)t->seqs[i].name, t->seqs[i].namelen);
+}
+
+static inline int _seq_read_twobit(seq_file_t *sf, read_t *r)
+{
+  seq_twobit_t *t = sf->twobit;
+  _seq_twobit_rec_t rec;
+  uint8_t skip = _seq_parse_skip(sf);
+  size_t i;
+
+  while(1) {
+    seq_read_reset(r);
+    if(t->next == t->end) return 0;
+    i = t->next++;
+    t->pos = 0;
+    if(_seq_twobit_rec(t, i, &rec) < 0) return -1;
+    if(!_seq_filter_len(sf, rec.len)) continue;
+
+    if(!(skip & SEQ_SKIP_NAME)) {
+      _seq_twobit_name(t, i, r);
+      if(!_seq_filter_name(sf, r)) continue;
+    }
+
+    if(skip & SEQ_SKIP_SEQ) r->seq.end = rec.len;
+    else _seq_twobit_unpack(t, &rec, 0, rec.len, r);
+
+    _seq_filter_clear_name(sf, r);
+    return 1;
+  }
+}
+
+// seq_read_chunk(): pieces are unpacked straight from the mapping
+static inline int _seq_read_chunk_twobit(seq_file_t *sf, read_t *r,
+                                         size_t max_bases, bool *more)
+{
+  seq_twobit_t *t = sf->twobit;
+  _seq_twobit_rec_t rec;
+  uint8_t skip = sf->skip;
+  size_t end;
+  int s;
+
+  if(!sf->in_chunk) {
+    // Next sequence that passes the filters
+    sf->skip |= SEQ_SKIP_SEQ;
+    s = _seq_read_twobit(sf, r);
+    sf->skip = skip;
+    if(s <= 0) return s;
+  }
+  else {
+    seq_read_reset(r);
+    if(!(skip & SEQ_SKIP_NAME)) _seq_twobit_name(t, t->next-1, r);
+  }
+
+  if(_seq_twobit_rec(t, t->next-1, &rec) < 0) return -1;
+  end = rec.len - t->pos > max_bases ? t->pos + max_bases : rec.len;
+  if(skip & SEQ_SKIP_SEQ) r->seq.end = end - t->pos;
+  else _seq_twobit_unpack(t, &rec, t->pos, end, r);
+  t->pos = end;
+  *more = sf->in_chunk = (end < rec.len);
+  return 1;
+}
+
+static inline int _seq_twobit_namecmp(const char *a, size_t alen,
+                                      const char *b, size_t blen)
+{
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  return c ? c : (alen > blen) - (alen < blen);
+}
+
+static inline int _seq_twobit_entry_cmp(const void *aa, const void *bb)
+{
+  const _seq_twobit_entry_t *a = (const _seq_twobit_entry_t*)aa;
+  const _seq_twobit_entry_t *b = (const _seq_twobit_entry_t*)bb;
+  return _seq_twobit_namecmp(a->name, a->namelen, b->name, b->namelen);
+}
+
+// Number of sequences in a .2bit file, 0 if sf is not one
+static inline size_t seq_twobit_count(const seq_file_t *sf)
+{
+  return sf->twobit ? sf->twobit->nseqs : 0;
+}
+
+// Index of sequence `name` in a .2bit file, -1 if there isn't one
+static inline long seq_twobit_find(const seq_file_t *sf, const char *name)
+{
+  const seq_twobit_t *t = sf->twobit;
+  size_t lo = 0, hi, mid, len = strlen(name);
+  int c;
+
+  if(t == NULL) return -1;
+  for(hi = t->nseqs; lo < hi; ) {
+    mid = lo + (hi - lo) / 2;
+    c = _seq_twobit_namecmp(t->byname[mid].name, t->byname[mid].namelen,
+                            name, len);
+    if(c == 0) return (long)t->byname[mid].idx;
+    if(c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return -1;
+}
+
+// Length of sequence i of a .2bit file, 0 if there is no sequence i
+static inline size_t seq_twobit_length(const seq_file_t *sf, size_t i)
+{
+  _seq_twobit_rec_t rec;
+  if(sf->twobit == NULL || i >= sf->twobit->nseqs ||
+     _seq_twobit_rec(sf->twobit, i, &rec) < 0) return 0;
+  return rec.len;
+}
+
+/**
+ * Set r to bases [start,end) of sequence i of a .2bit file, named as the
+ * sequence. end is cut to the sequence length. Only the bytes and blocks
+ * covering the region are read.
+ * Returns 1 on success, 0 if the region is empty, -1 on error
+ */
+static inline int seq_twobit_fetch(const seq_file_t *sf, size_t i,
+                                   size_t start, size_t end, read_t *r)
+{
+  const seq_twobit_t *t = sf->twobit;
+  _seq_twobit_rec_t rec;
+
+  if(t == NULL || i >= t->nseqs || _seq_twobit_rec(t, i, &rec) < 0)
+    return -1;
+  seq_read_reset(r);
+  _seq_twobit_name(t, i, r);
+  if(end > rec.len) end = rec.len;
+  if(start > end) start = end;
+  _seq_twobit_unpack(t, &rec, start, end, r);
+  return end > start;
+}
+
+static inline void _seq_twobit_close(seq_twobit_t *t)
+{
+  if(t->data) munmap((void*)t->data, t->size);
+  free(t->seqs);
+  free(t->byname);
+  free(t);
+}
+
+// Map path into memory if it is a .2bit file
+// Returns 1 on success, 0 if it is not .2bit, -1 on error
+static inline int _seq_twobit_open(seq_file_t *sf, const char *path)
+{
+  unsigned char sig[4];
+  struct stat st;
+  seq_twobit_t *t;
+  _seq_twobit_entry_t *e;
+  void *data;
+  uint32_t version;
+  size_t i, pos, offlen;
+  int fd;
+
+  // Don't read from pipes to check the signature
+  if(stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < 16)
+    return 0;
+  if((fd = open(path, O_RDONLY)) < 0) return 0;
+  if(pread(fd, sig, 4, 0) != 4 || (memcmp(sig, "\x43\x27\x41\x1a", 4) != 0 &&
+                                     memcmp(sig, "\x1a\x41\x27\x43", 4) != 0)) {
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED) {
+    fprintf(stderr, "[%s:%i] Error: cannot map .2bit file: %s\n",
+            __FILE__, __LINE__, path);
+    return -1;
+  }
 
-// Add a read onto the read buffer (linked list FIFO)
-static inline void _seq_read_shift(seq_file_t *sf, read_t *r)
-{
-  if(sf->rhead == NULL) {
-    sf->readfunc = _seq_read_pop;
-    sf->rhead = sf->rtail = r;
+  if((t = (seq_twobit_t*)calloc(1, sizeof(seq_twobit_t))) == NULL) {
+    munmap(data, (size_t)st.st_size);
+    return -1;
   }
-  else {
-    sf->rtail->next = r;
-    sf->rtail = r;
+  t->data = (const unsigned char*)data;
+  t->size = (size_t)st.st_size;
+  t->swap = (_seq_get_le32(sig) != SEQ_TWOBIT_SIG);
+  version = _seq_twobit_u32(t, t->data + 4);
+  t->nseqs = t->end = _seq_twobit_u32(t, t->data + 8);
+  offlen = version ? 8 : 4;
+
+  // Each index entry is at least a length byte and an offset
+  if(version > 1 || (uint64_t)t->nseqs * (1 + offlen) > t->size - 16 ||
+     (t->seqs = (_seq_twobit_entry_t*)calloc(t->nseqs ? t->nseqs : 1,
+                                 sizeof(_seq_twobit_entry_t))) == NULL ||
+     (t->byname = (_seq_twobit_entry_t*)calloc(t->nseqs ? t->nseqs : 1,
+                                 sizeof(_seq_twobit_entry_t))) == NULL)
+    goto error;
+
+  for(i = 0, pos = 16; i < t->nseqs; i++) {
+    e = &t->seqs[i];
+    if(pos + 1 > t->size || pos + 1 + t->data[pos] + offlen > t->size)
+      goto error;
+    e->namelen = t->data[pos];
+    e->name = (const char*)t->data + pos + 1;
+    e->idx = i;
+    pos += 1 + e->namelen;
+    e->offset = offlen == 8 ? _seq_twobit_u64(t, t->data + pos)
+                            : _seq_twobit_u32(t, t->data + pos);
+    if(e->offset >= t->size) goto error;
+    pos += offlen;
   }
-  r->next = NULL;
+
+  // Sorted copy of the index for seq_twobit_find()
+  memcpy(t->byname, t->seqs, t->nseqs * sizeof(_seq_twobit_entry_t));
+  qsort(t->byname, t->nseqs, sizeof(_seq_twobit_entry_t),
+        _seq_twobit_entry_cmp);
+
+  sf->twobit = t;
+  sf->format = SEQ_FMT_FASTA;
+  sf->readfunc = sf->origreadfunc = _seq_read_twobit;
+  sf->chunkfunc = _seq_read_chunk_twobit;
+  return 1;
+
+  error:
+  fprintf(stderr, "[%s:%i] Error: bad .2bit index: %s\n",
+          __FILE__, __LINE__, path);
+  _seq_twobit_close(t);
+  return -1;
 }
 
-// Load reads until we have at least nbases loaded or we hit EOF
-static inline void _seq_buffer_reads(seq_file_t *sf, size_t nbases)
+// Only read sequences [start,end) of a .2bit file
+static inline void _seq_twobit_set_seqs(seq_twobit_t *t, size_t start,
+                                        size_t end)
 {
-  int (*readfunc)(seq_file_t *sf, read_t *r) = sf->origreadfunc;
+  t->next = start;
+  t->end = end;
+  t->pos = 0;
+}
 
-  // Sum bases already in buffer
-  read_t *r = sf->rhead;
-  size_t currbases = 0;
-  while(r != NULL) { currbases += r->seq.end; r = r->next; }
+/*
+ Write a UCSC .2bit file. Names are cut at the first whitespace. Bases other
+ than a,c,g,t are stored as N, lower case bases as soft-masked. The index
+ comes before the sequences, so records are kept in memory (a quarter of a
+ byte per base, plus blocks) until the writer is closed. Files over 4GB are
+ written as version 1 (64-bit offsets).
+
+ seq_twobit_writer_open(w,fh)
+ seq_twobit_write(w,r)
+ seq_twobit_writer_close(w) - writes the file, fh is not closed
+*/
 
-  while(currbases < nbases) {
-    if((r = seq_read_new()) == NULL) {
-      fprintf(stderr, "[%s:%i] Error out of memory\n", __FILE__, __LINE__);
-      break;
-    }
-    if(readfunc(sf,r) <= 0) { seq_read_free(r); break; }
-    currbases += r->seq.end;
-    _seq_read_shift(sf, r);
-  }
-}
+typedef struct
+{
+  FILE *fh;
+  StreamBuffer names, offsets, recs; // index names, record offsets, records
+  StreamBuffer blocks[4]; // N starts, N sizes, mask starts, mask sizes
+  size_t nseqs;
+} seq_twobit_writer_t;
 
-// perform reading on seq_file_t
+static inline void seq_twobit_writer_open(seq_twobit_writer_t *w, FILE *fh)
+{
+  memset(w, 0, sizeof(seq_twobit_writer_t));
+  w->fh = fh;
+}
 
-// getc on seq_file_t
-#define _sf_gzgetc(sf)              gzgetc((sf)->gz_file)
-#define _sf_gzgetc_buf(sf)          gzgetc_buf((sf)->gz_file,&(sf)->in)
-#define _sf_fgetc(sf)               fgetc((sf)->f_file)
-#define _sf_fgetc_buf(sf)           fgetc_buf((sf)->f_file,&(sf)->in)
+static inline void _seq_twobit_put_u32(StreamBuffer *buf, uint32_t x)
+{
+  unsigned char b[4];
+  _seq_put_le32(b, x);
+  swrite_buf(buf, b, 4);
+}
 
-// ungetc on seq_file_t
-#define _sf_gzungetc(sf,c)          gzungetc(c,(sf)->gz_file)
-#define _sf_gzungetc_buf(sf,c)      ungetc_buf(c,&(sf)->in)
-#define _sf_fungetc(sf,c)           fungetc(c,(sf)->f_file)
-#define _sf_fungetc_buf(sf,c)       ungetc_buf(c,&(sf)->in)
+#define _seq_twobit_in_block(k,c) \
+  ((k) ? ((c) >= 'a' && (c) <= 'z') : _seq_sqc_codes[(uint8_t)(c)] > 3)
 
-// readline on seq_file_t using buffer into read
-#define _sf_gzreadline(sf,buf)      gzreadline((sf)->gz_file,&(buf).b,&(buf).end,&(buf).size)
-#define _sf_gzreadline_buf(sf,buf)  gzreadline_buf((sf)->gz_file,&(sf)->in,&(buf).b,&(buf).end,&(buf).size)
-#define _sf_freadline(sf,buf)       freadline((sf)->f_file,&(buf).b,&(buf).end,&(buf).size)
-#define _sf_freadline_buf(sf,buf)   freadline_buf((sf)->f_file,&(sf)->in,&(buf).b,&(buf).end,&(buf).size)
+// Returns 0 on success, -1 if the name (to the first whitespace) is longer
+// than 255 characters or the sequence is 4G bases or more
+static inline int seq_twobit_write(seq_twobit_writer_t *w, const read_t *r)
+{
+  const char *s = r->seq.b;
+  size_t i, j, len = r->seq.end, namelen, nbytes, nblocks[2] = {0, 0};
+  unsigned char off[8], *dna;
+  int k;
+
+  for(namelen = 0; namelen < r->name.end &&
+                   !isspace((int)(unsigned char)r->name.b[namelen]); namelen++) {}
+  if(namelen > 255 || len > UINT32_MAX || w->nseqs == UINT32_MAX) return -1;
+
+  sputc_buf(&w->names, (char)namelen);
+  swrite_buf(&w->names, r->name.b, namelen);
+  _seq_put_le64(off, w->recs.end);
+  swrite_buf(&w->offsets, off, 8);
+  w->nseqs++;
+
+  // Runs of N (k=0) and lower case (k=1) bases
+  for(k = 0; k < 4; k++) w->blocks[k].end = 0;
+  for(k = 0; k < 2; k++) {
+    for(i = 0; i < len; i = j) {
+      if(!_seq_twobit_in_block(k, s[i])) { j = i + 1; continue; }
+      for(j = i + 1; j < len && _seq_twobit_in_block(k, s[j]); j++) {}
+      _seq_twobit_put_u32(&w->blocks[2*k], (uint32_t)i);
+      _seq_twobit_put_u32(&w->blocks[2*k+1], (uint32_t)(j - i));
+      nblocks[k]++;
+    }
+  }
 
-// skipline on seq_file_t
-#define _sf_gzskipline(sf)          gzskipline((sf)->gz_file)
-#define _sf_gzskipline_buf(sf)      gzskipline_buf((sf)->gz_file,&(sf)->in)
-#define _sf_fskipline(sf)           fskipline((sf)->f_file)
-#define _sf_fskipline_buf(sf)       fskipline_buf((sf)->f_file,&(sf)->in)
+  _seq_twobit_put_u32(&w->recs, (uint32_t)len);
+  for(k = 0; k < 2; k++) {
+    _seq_twobit_put_u32(&w->recs, (uint32_t)nblocks[k]);
+    if(nblocks[k] == 0) continue;
+    swrite_buf(&w->recs, w->blocks[2*k].b, w->blocks[2*k].end);
+    swrite_buf(&w->recs, w->blocks[2*k+1].b, w->blocks[2*k+1].end);
+  }
+  _seq_twobit_put_u32(&w->recs, 0); // reserved
+
+  // N is stored as T (0)
+  nbytes = (len + 3) / 4;
+  cbuf_capacity(&w->recs.b, &w->recs.size, w->recs.end + nbytes);
+  dna = (unsigned char*)w->recs.b + w->recs.end;
+  memset(dna, 0, nbytes);
+  for(i = 0; i < len; i++)
+    dna[i>>2] |= (unsigned char)("\2\1\3\0\0"[_seq_sqc_codes[(uint8_t)s[i]]]
+                                 << (6 - 2*(i&3)));
+  w->recs.end += nbytes;
+  return 0;
+}
 
-// Read FASTQ
-_func_read_fastq(_seq_read_fastq_f,      _sf_fgetc,      _sf_fungetc,      _sf_freadline)
-_func_read_fastq(_seq_read_fastq_gz,     _sf_gzgetc,     _sf_gzungetc,     _sf_gzreadline)
-_func_read_fastq(_seq_read_fastq_f_buf,  _sf_fgetc_buf,  _sf_fungetc_buf,  _sf_freadline_buf)
-_func_read_fastq(_seq_read_fastq_gz_buf, _sf_gzgetc_buf, _sf_gzungetc_buf, _sf_gzreadline_buf)
+#undef _seq_twobit_in_block
 
-// Read FASTA
-_func_read_fasta(_seq_read_fasta_f,      _sf_fgetc,      _sf_fungetc,      _sf_freadline)
-_func_read_fasta(_seq_read_fasta_gz,     _sf_gzgetc,     _sf_gzungetc,     _sf_gzreadline)
-_func_read_fasta(_seq_read_fasta_f_buf,  _sf_fgetc_buf,  _sf_fungetc_buf,  _sf_freadline_buf)
-_func_read_fasta(_seq_read_fasta_gz_buf, _sf_gzgetc_buf, _sf_gzungetc_buf, _sf_gzreadline_buf)
+// Write the header, index and records
+// Returns 0 on success, -1 on write error
+static inline int seq_twobit_writer_close(seq_twobit_writer_t *w)
+{
+  unsigned char hdr[16], off[8];
+  const unsigned char *name = (const unsigned char*)w->names.b;
+  uint64_t start = 16 + w->names.end + 4 * (uint64_t)w->nseqs;
+  size_t i, offlen = 4;
+  int k, status = 0;
+
+  if(start + w->recs.end > UINT32_MAX) { offlen = 8; start += 4 * w->nseqs; }
+
+  _seq_put_le32(hdr, SEQ_TWOBIT_SIG);
+  _seq_put_le32(hdr+4, offlen == 8); // version
+  _seq_put_le32(hdr+8, (uint32_t)w->nseqs);
+  _seq_put_le32(hdr+12, 0);
+  if(fwrite(hdr, 1, 16, w->fh) != 16) status = -1;
+
+  for(i = 0; i < w->nseqs && status == 0; i++) {
+    _seq_put_le64(off, start +
+                       _seq_get_le64((unsigned char*)w->offsets.b + 8*i));
+    if(fwrite(name, 1, 1 + (size_t)name[0], w->fh) != 1 + (size_t)name[0] ||
+       fwrite(off, 1, offlen, w->fh) != offlen) status = -1;
+    name += 1 + name[0];
+  }
 
-// Read plain
-_func_read_plain(_seq_read_plain_f,      _sf_fgetc,      _sf_freadline,      _sf_fskipline)
-_func_read_plain(_seq_read_plain_gz,     _sf_gzgetc,     _sf_gzreadline,     _sf_gzskipline)
-_func_read_plain(_seq_read_plain_f_buf,  _sf_fgetc_buf,  _sf_freadline_buf,  _sf_fskipline_buf)
-_func_read_plain(_seq_read_plain_gz_buf, _sf_gzgetc_buf, _sf_gzreadline_buf, _sf_gzskipline_buf)
+  if((status == 0 && w->recs.end &&
+      fwrite(w->recs.b, 1, w->recs.end, w->fh) != w->recs.end) ||
+     fflush(w->fh) != 0) status = -1;
 
-// Read first entry
-_func_read_unknown(_seq_read_unknown_f,      _sf_fgetc,      _sf_fungetc,      _sf_fskipline,  _seq_read_fastq_f,      _seq_read_fasta_f,      _seq_read_plain_f)
-_func_read_unknown(_seq_read_unknown_gz,     _sf_gzgetc,     _sf_gzungetc,     _sf_gzskipline, _seq_read_fastq_gz,     _seq_read_fasta_gz,     _seq_read_plain_gz)
-_func_read_unknown(_seq_read_unknown_f_buf,  _sf_fgetc_buf,  _sf_fungetc_buf,  _sf_fskipline,  _seq_read_fastq_f_buf,  _seq_read_fasta_f_buf,  _seq_read_plain_f_buf)
-_func_read_unknown(_seq_read_unknown_gz_buf, _sf_gzgetc_buf, _sf_gzungetc_buf, _sf_gzskipline, _seq_read_fastq_gz_buf, _seq_read_fasta_gz_buf, _seq_read_plain_gz_buf)
+  free(w->names.b);
+  free(w->offsets.b);
+  free(w->recs.b);
+  for(k = 0; k < 4; k++) free(w->blocks[k].b);
+  memset(w, 0, sizeof(seq_twobit_writer_t));
+  return status;
+}
 
 // Returns 1 on success 0 if out of memory
 static inline char _seq_setup(seq_file_t *sf, bool use_zlib, size_t buf_size)
@@ -432,13 +2341,40 @@ static inline char _seq_setup(seq_file_t *sf, bool use_zlib, size_t buf_size)
   if(buf_size) {
     if(!strm_buf_alloc(&sf->in, buf_size)) { free(sf); return 0; }
     sf->origreadfunc = use_zlib ? _seq_read_unknown_gz_buf : _seq_read_unknown_f_buf;
+    sf->chunkfunc = use_zlib ? _seq_read_chunk_gz_buf : _seq_read_chunk_f_buf;
+  }
+  else {
+    sf->origreadfunc = use_zlib ? _seq_read_unknown_gz : _seq_read_unknown_f;
+    sf->chunkfunc = use_zlib ? _seq_read_chunk_gz : _seq_read_chunk_f;
   }
-  else sf->origreadfunc = use_zlib ? _seq_read_unknown_gz : _seq_read_unknown_f;
   sf->readfunc = sf->origreadfunc;
   return 1;
 }
 
-#define NUM_SEQ_EXT 29
+#ifndef _USESAM
+// Read SAM or BAM from fh without htslib. BAM is told apart by its first byte
+// (gzip). sf owns fh, even on error.
+// Returns 1 on success, 0 on error
+static inline char _seq_sam_setup(seq_file_t *sf, FILE *fh, size_t buf_size)
+{
+  int c = fgetc(fh);
+  sf->f_file = fh;
+  if(c != EOF && ungetc(c, fh) == EOF) return 0;
+  if(!strm_buf_alloc(&sf->in, buf_size ? buf_size : DEFAULT_BUFSIZE)) return 0;
+  if(c == 31) {
+    if((sf->bgzf = _seq_bgzf_open(fh)) == NULL) return 0;
+    sf->f_file = NULL;
+    sf->format = SEQ_FMT_BAM;
+    sf->readfunc = sf->origreadfunc = _seq_read_bam;
+    return _seq_bam_read_header(sf) == 0;
+  }
+  sf->format = SEQ_FMT_SAM;
+  sf->readfunc = sf->origreadfunc = _seq_read_sam_f_buf;
+  return 1;
+}
+#endif
+
+#define NUM_SEQ_EXT 31
 
 // Guess file type from file path or contents
 static inline seq_format seq_guess_filetype_from_extension(const char *path)
@@ -450,7 +2386,8 @@ static inline seq_format seq_guess_filetype_from_extension(const char *path)
        ".fq", ".fastq", ".fsq", ".fsq.gz", "fsq.gzip", // FASTQ
        ".fqz", ".fqgz", ".fq.gz", ".fq.gzip", ".fastqz", ".fastq.gzip",
        ".txt", ".txtgz", ".txt.gz", ".txt.gzip", // Plain
-       ".sam", ".bam", ".cram"}; // SAM / BAM / CRAM
+       ".sam", ".bam", ".cram", // SAM / BAM / CRAM
+       ".sqc", ".2bit"}; // columnar container, UCSC 2bit
 
   const seq_format types[NUM_SEQ_EXT]
     = {SEQ_FMT_FASTA, SEQ_FMT_FASTA, SEQ_FMT_FASTA, SEQ_FMT_FASTA, SEQ_FMT_FASTA,
@@ -460,7 +2397,8 @@ static inline seq_format seq_guess_filetype_from_extension(const char *path)
        SEQ_FMT_FASTQ, SEQ_FMT_FASTQ, SEQ_FMT_FASTQ, SEQ_FMT_FASTQ, SEQ_FMT_FASTQ,
        SEQ_FMT_FASTQ,
        SEQ_FMT_PLAIN, SEQ_FMT_PLAIN, SEQ_FMT_PLAIN, SEQ_FMT_PLAIN,
-       SEQ_FMT_SAM, SEQ_FMT_BAM, SEQ_FMT_CRAM};
+       SEQ_FMT_SAM, SEQ_FMT_BAM, SEQ_FMT_CRAM, SEQ_FMT_SQC,
+       SEQ_FMT_TWOBIT};
 
   size_t extlens[NUM_SEQ_EXT];
   size_t i;
@@ -480,6 +2418,7 @@ static inline seq_file_t* seq_open2(const char *p, bool ishts,
                                     bool use_zlib, size_t buf_size)
 {
   seq_file_t *sf = calloc(1, sizeof(seq_file_t));
+  int s;
   sf->path = strdup(p);
 
   if(ishts)
@@ -502,11 +2441,18 @@ static inline seq_file_t* seq_open2(const char *p, bool ishts,
         exit(EXIT_FAILURE);
       }
     #else
-      fprintf(stderr, "[%s:%i] Error: not compiled with sam/bam support\n",
-              __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
+      FILE *fh = fopen(p, "r");
+      if(fh == NULL || !_seq_sam_setup(sf, fh, buf_size)) {
+        seq_close(sf);
+        return NULL;
+      }
     #endif
   }
+  else if((s = _seq_sqc_open(sf, p)) != 0 ||
+          (s = _seq_twobit_open(sf, p)) != 0)
+  {
+    if(s < 0) { seq_close(sf); return NULL; }
+  }
   else
   {
     if(( use_zlib && ((sf->gz_file = gzopen(p, "r")) == NULL)) ||
@@ -551,9 +2497,11 @@ static inline seq_file_t* seq_dopen(int fd, char ishts,
         exit(EXIT_FAILURE);
       }
     #else
-      fprintf(stderr, "[%s:%i] Error: not compiled with sam/bam support\n",
-              __FILE__, __LINE__);
-      exit(EXIT_FAILURE);
+      FILE *fh = fdopen(fd, "r");
+      if(fh == NULL || !_seq_sam_setup(sf, fh, buf_size)) {
+        seq_close(sf);
+        return NULL;
+      }
     #endif
   }
   else
@@ -570,6 +2518,28 @@ static inline seq_file_t* seq_dopen(int fd, char ishts,
   return sf;
 }
 
+// Open a file descriptor for low-latency streaming (e.g. from a pipe or
+// terminal). Input is read with read(2), which returns partial fills, and each
+// entry is returned as soon as it is complete in the buffer rather than once
+// the buffer is full. FASTA entries are complete once the next '>' or EOF is
+// seen. Uncompressed input only; use seq_dopen for batch reading.
+// Returns NULL on error, in which case fd will not have been closed
+static inline seq_file_t* seq_dopen_stream(int fd, size_t buf_size)
+{
+  seq_file_t *sf = calloc(1, sizeof(seq_file_t));
+  sf->path = strdup("-");
+
+  if(!strm_buf_alloc(&sf->in, buf_size ? buf_size : DEFAULT_BUFSIZE) ||
+     (sf->f_file = fdopen(fd, "r")) == NULL) {
+    seq_close(sf);
+    return NULL;
+  }
+
+  sf->readfunc = sf->origreadfunc = _seq_read_unknown_fd_buf;
+  sf->chunkfunc = _seq_read_chunk_fd_buf;
+  return sf;
+}
+
 static inline seq_file_t* seq_open(const char *p)
 {
   assert(p != NULL);
@@ -584,6 +2554,15 @@ static inline seq_file_t* seq_open(const char *p)
 // returns 0 on success, -1 on failure
 static inline int seq_seek_start(seq_file_t *sf)
 {
+  if(sf->sqc != NULL) {
+    _seq_sqc_set_blocks(sf->sqc, 0, sf->sqc->nblocks);
+    return 0;
+  }
+  if(sf->twobit != NULL) {
+    _seq_twobit_set_seqs(sf->twobit, 0, sf->twobit->nseqs);
+    sf->in_chunk = false;
+    return 0;
+  }
   strm_buf_reset(&sf->in);
   if((sf->f_file  != NULL &&  fseek(sf->f_file,  0, SEEK_SET) != 0) ||
      (sf->gz_file != NULL && gzseek(sf->gz_file, 0, SEEK_SET) != 0))
@@ -613,7 +2592,11 @@ static inline void seq_close(seq_file_t *sf)
   #ifdef _USESAM
     if(sf->hts_file != NULL)  hts_close(sf->hts_file);
     bam_hdr_destroy(sf->bam_hdr);
+  #else
+    if(sf->bgzf != NULL) _seq_bgzf_close(sf->bgzf);
   #endif
+  if(sf->sqc != NULL) _seq_sqc_close(sf->sqc);
+  if(sf->twobit != NULL) _seq_twobit_close(sf->twobit);
   strm_buf_dealloc(&sf->in);
   free(sf->path);
   read_t *r = sf->rhead, *tmpr;
@@ -631,6 +2614,439 @@ static inline seq_file_t* seq_reopen(seq_file_t *sf)
   return sf;
 }
 
+//
+// Shards: read the entries of one of n byte ranges of a file
+//
+// An entry belongs to the range holding the newline just before it (the
+// first entry belongs to range 0), so n readers cover each entry once.
+// Entry starts are found from the current line and the lines after it:
+// FASTA '>', FASTQ '@' with a '+' line two lines down (sequence on one line),
+// plain any line not starting with whitespace.
+//
+// BGZF (blocked gzip, as written by bgzip) is split by compressed offset at
+// block boundaries; a range reads the blocks starting within it.
+//
+
+#define _seq_shard_getc(sf) ((sf)->gz_file ? gzgetc_buf((sf)->gz_file,&(sf)->in) \
+                                           : fgetc_buf((sf)->f_file,&(sf)->in))
+#define _seq_shard_tell(sf) ((sf)->gz_file ? gztell_buf((sf)->gz_file,&(sf)->in) \
+                                           : ftell_buf((sf)->f_file,&(sf)->in))
+#define _seq_shard_seek(sf,off) ((sf)->gz_file \
+  ? gzseek_buf((sf)->gz_file,off,SEEK_SET,&(sf)->in) < 0 \
+  : fseek_buf((sf)->f_file,off,SEEK_SET,&(sf)->in) != 0)
+
+// Returns the last char read: '\n' or -1 at eof
+static inline int _seq_shard_skipline(seq_file_t *sf)
+{
+  int c;
+  while((c = _seq_shard_getc(sf)) != -1 && c != '\n') {}
+  return c;
+}
+
+// Move to the first entry after the next newline
+// Returns 0 on success, -1 on error
+static inline int _seq_shard_resync(seq_file_t *sf)
+{
+  off_t pos, next;
+  int c;
+
+  if(_seq_shard_skipline(sf) < 0) return 0;
+
+  while(1)
+  {
+    pos = _seq_shard_tell(sf);
+    if((c = _seq_shard_getc(sf)) == -1) return 0;
+    if(c == '\n') continue;
+
+    if(sf->format == SEQ_FMT_FASTQ) {
+      if(c == '@') {
+        // Header, then sequence, then '+'
+        if(_seq_shard_skipline(sf) < 0) return 0;
+        next = _seq_shard_tell(sf);
+        if(_seq_shard_skipline(sf) < 0) return 0;
+        if((c = _seq_shard_getc(sf)) == -1) return 0;
+        if(_seq_shard_seek(sf, c == '+' ? pos : next)) return -1;
+        if(c == '+') return 0;
+        continue;
+      }
+    }
+    else if(sf->format == SEQ_FMT_FASTA ? c == '>' : !isspace(c)) {
+      ungetc_buf(c, &sf->in);
+      return 0;
+    }
+
+    if(_seq_shard_skipline(sf) < 0) return 0;
+  }
+}
+
+// Read an entry if it starts at or before sf->shard_end
+static inline int _seq_read_shard(seq_file_t *sf, read_t *r)
+{
+  int c;
+  while((c = _seq_shard_getc(sf)) == '\n' || c == '\r') {}
+  if(c == -1) return 0;
+  ungetc_buf(c, &sf->in);
+  if(_seq_shard_tell(sf) > sf->shard_end) return 0;
+  return sf->shardfunc(sf, r);
+}
+
+// Returns length of the BGZF block at `off`, or 0 if there isn't one
+static inline size_t _seq_bgzf_block_len(int fd, off_t off)
+{
+  unsigned char h[18];
+  if(pread(fd, h, 18, off) != 18 ||
+     h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4) ||
+     h[10] != 6 || h[11] != 0 || h[12] != 'B' || h[13] != 'C' ||
+     h[14] != 2 || h[15] != 0) return 0;
+  return (size_t)(h[16] | h[17] << 8) + 1;
+}
+
+// Offset of the first BGZF block at or after `off`, or fsize if none.
+// A header is only taken if another block (or the end of file) follows it.
+static inline off_t _seq_bgzf_next_block(int fd, off_t off, off_t fsize)
+{
+  unsigned char buf[4096];
+  ssize_t i, n;
+  size_t len;
+
+  for(; off < fsize; off += n > 3 ? n - 3 : n) {
+    if((n = pread(fd, buf, sizeof(buf), off)) <= 0) break;
+    for(i = 0; i + 3 < n; i++) {
+      if(buf[i] == 31 && buf[i+1] == 139 && buf[i+2] == 8 && (buf[i+3] & 4) &&
+         (len = _seq_bgzf_block_len(fd, off+i)) > 0 &&
+         (off+i+(off_t)len == fsize ||
+          _seq_bgzf_block_len(fd, off+i+len) > 0)) return off+i;
+    }
+    if(n <= 3) break;
+  }
+  return fsize;
+}
+
+// Sum of uncompressed lengths of blocks from `start` up to `end`
+static inline off_t _seq_bgzf_isize(int fd, off_t start, off_t end)
+{
+  unsigned char t[4];
+  off_t total = 0;
+  size_t len;
+  while(start < end && (len = _seq_bgzf_block_len(fd, start)) > 0 &&
+        pread(fd, t, 4, start+len-4) == 4) {
+    total += t[0] | t[1] << 8 | t[2] << 16 | (off_t)t[3] << 24;
+    start += len;
+  }
+  return total;
+}
+
+// A sequence goes to the shard holding the middle of its bases, so shards are
+// runs of whole sequences with about the same number of bases
+static inline void _seq_twobit_shard(seq_twobit_t *t, size_t i, size_t n)
+{
+  _seq_twobit_rec_t rec;
+  uint64_t total = 0, sum = 0, k;
+  size_t j, start = t->nseqs, end = t->nseqs;
+
+  for(j = 0; j < t->nseqs; j++)
+    if(_seq_twobit_rec(t, j, &rec) == 0) total += rec.len;
+
+  for(j = 0; j < t->nseqs; j++) {
+    if(_seq_twobit_rec(t, j, &rec) < 0) rec.len = 0;
+    k = total ? (sum + rec.len / 2) * n / total : (uint64_t)j * n / t->nseqs;
+    sum += rec.len;
+    if(k > n - 1) k = n - 1;
+    if(k == i && start == t->nseqs) start = j;
+    if(k > i) { end = j; break; }
+  }
+  _seq_twobit_set_seqs(t, start < end ? start : end, end);
+}
+
+/**
+ * Open the i-th of n shards of a FASTA/FASTQ/plain file, uncompressed or
+ * BGZF. Reads return the entries belonging to byte range
+ * [fsize*i/n, fsize*(i+1)/n), so n processes (i = 0..n-1) read every entry
+ * exactly once between them. Filters and skipped fields work as usual.
+ * .sqc files are split by block and .2bit files by sequence instead.
+ * Returns NULL on error, including gzip files that are not BGZF and SAM/BAM
+ * files (by extension, or BAM by its magic bytes).
+ */
+static inline seq_file_t* seq_open_shard(const char *path, size_t i, size_t n)
+{
+  seq_file_t *sf;
+  unsigned char magic[2];
+  char bam[4];
+  off_t fsize, start, end;
+  seq_format fmt = seq_guess_filetype_from_extension(path);
+  bool bgzf;
+  gzFile gz;
+  read_t r;
+  int fd, s;
+
+  if(i >= n || strcmp(path, "-") == 0) return NULL;
+
+  if(fmt == SEQ_FMT_SAM || fmt == SEQ_FMT_BAM || fmt == SEQ_FMT_CRAM) {
+    fprintf(stderr, "[%s:%i] Error: cannot shard SAM/BAM/CRAM: %s\n",
+            __FILE__, __LINE__, path);
+    return NULL;
+  }
+
+  if((fd = open(path, O_RDONLY)) < 0) return NULL;
+  if((fsize = lseek(fd, 0, SEEK_END)) < 0) { close(fd); return NULL; }
+  bgzf = (pread(fd, magic, 2, 0) == 2 && magic[0] == 31 && magic[1] == 139);
+  if(bgzf && _seq_bgzf_block_len(fd, 0) == 0) {
+    fprintf(stderr, "[%s:%i] Error: gzip file is not BGZF, cannot shard: %s\n",
+            __FILE__, __LINE__, path);
+    close(fd);
+    return NULL;
+  }
+  // BAM without a .bam extension
+  if(bgzf && (gz = gzopen(path, "r")) != NULL) {
+    s = gzread(gz, bam, 4);
+    gzclose(gz);
+    if(s == 4 && memcmp(bam, "BAM\1", 4) == 0) {
+      fprintf(stderr, "[%s:%i] Error: cannot shard SAM/BAM/CRAM: %s\n",
+              __FILE__, __LINE__, path);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  // Split evenly without overflow
+  start = fsize / n * i + fsize % n * i / n;
+  end = fsize / n * (i+1) + fsize % n * (i+1) / n;
+
+  if((sf = seq_open2(path, false, bgzf, DEFAULT_BUFSIZE)) != NULL && sf->sqc) {
+    // Containers are split by blocks, using the index
+    close(fd);
+    _seq_sqc_set_blocks(sf->sqc, sf->sqc->nblocks / n * i +
+                                 sf->sqc->nblocks % n * i / n,
+                        sf->sqc->nblocks / n * (i+1) +
+                        sf->sqc->nblocks % n * (i+1) / n);
+    return sf;
+  }
+  if(sf != NULL && sf->twobit) {
+    // .2bit files are split into runs of whole sequences of about equal bases
+    close(fd);
+    _seq_twobit_shard(sf->twobit, i, n);
+    return sf;
+  }
+
+  // Read the first entry to find the format
+  if(sf == NULL || seq_read_alloc(&r) == NULL) {
+    if(sf) seq_close(sf);
+    close(fd);
+    return NULL;
+  }
+  s = seq_read(sf, &r);
+  seq_read_dealloc(&r);
+  if(s <= 0) { close(fd); return sf; }
+
+  if(bgzf) {
+    start = _seq_bgzf_next_block(fd, start, fsize);
+    end = _seq_bgzf_isize(fd, start, _seq_bgzf_next_block(fd, end, fsize));
+    gzclose(sf->gz_file);
+    if(lseek(fd, start, SEEK_SET) < 0 ||
+       (sf->gz_file = gzdopen(fd, "r")) == NULL) {
+      close(fd);
+      seq_close(sf);
+      return NULL;
+    }
+    sf->in.begin = sf->in.end = 1;
+  }
+  else {
+    close(fd);
+    if(_seq_shard_seek(sf, start)) { seq_close(sf); return NULL; }
+  }
+
+  if(i > 0 && _seq_shard_resync(sf) < 0) { seq_close(sf); return NULL; }
+
+  sf->shard_end = end;
+  sf->shardfunc = sf->origreadfunc;
+  sf->readfunc = sf->origreadfunc = _seq_read_shard;
+  sf->chunkfunc = NULL;
+  return sf;
+}
+
+// Seek to `off` and move to the first entry after the newline at or after it
+// Returns 0 on success, -1 on error
+static inline int _seq_tail_start(seq_file_t *sf, off_t off)
+{
+  if(_seq_shard_seek(sf, off)) return -1;
+  return off > 0 ? _seq_shard_resync(sf) : 0;
+}
+
+// Move back from the end of a .2bit file until n sequences pass the filters
+static inline int _seq_twobit_tail(seq_file_t *sf, size_t n)
+{
+  seq_twobit_t *t = sf->twobit;
+  size_t j = t->end, start = t->next, end = t->end, k = 0;
+  read_t r;
+  int s = 0;
+
+  if(seq_read_alloc(&r) == NULL) return -1;
+  while(k < n && j > start) {
+    _seq_twobit_set_seqs(t, j - 1, j);
+    if((s = seq_skip_read(sf, &r)) < 0) break;
+    k += s;
+    j--;
+  }
+  seq_read_dealloc(&r);
+  _seq_twobit_set_seqs(t, j, end);
+  sf->in_chunk = false;
+  return s < 0 ? -1 : 0;
+}
+
+/**
+ * Move to the last n entries of an uncompressed file, without reading the
+ * whole file. Entries are found in a window at the end of the file, starting
+ * at the first line that looks like an entry (as seq_open_shard()), and the
+ * window grows until it holds n entries. Filters are applied when counting.
+ * A truncated last entry is counted and returned as seq_read() would, e.g. a
+ * FASTQ record cut short in its quality scores. .2bit files are read from
+ * their index.
+ * Returns 0 on success, -1 if the file can't seek (stdin, gzip, SAM/BAM)
+ */
+static inline int seq_seek_tail(seq_file_t *sf, size_t n)
+{
+  struct stat st;
+  off_t off, window = 1<<16;
+  size_t k;
+  read_t r;
+
+  if(sf->twobit != NULL && sf->rhead == NULL) return _seq_twobit_tail(sf, n);
+
+  if(sf->in.b == NULL || sf->rhead != NULL || sf->shardfunc != NULL ||
+     sf->bgzf != NULL || (sf->format & (SEQ_FMT_SAM|SEQ_FMT_BAM)) ||
+     (sf->f_file == NULL && sf->gz_file == NULL) ||
+     strcmp(sf->path, "-") == 0 || stat(sf->path, &st) != 0 ||
+     (sf->gz_file != NULL && !gzdirect(sf->gz_file))) return -1;
+
+  if(seq_read_alloc(&r) == NULL) return -1;
+
+  // Read the first entry to find the format
+  if(sf->format == SEQ_FMT_UNKNOWN && seq_skip_read(sf, &r) <= 0) {
+    seq_read_dealloc(&r);
+    return 0;
+  }
+
+  while(1) {
+    off = window < st.st_size ? st.st_size - window : 0;
+    if(_seq_tail_start(sf, off) < 0) goto error;
+    for(k = 0; seq_skip_read(sf, &r) > 0; k++) {}
+    if(k >= n || off == 0) break;
+    window *= 4;
+  }
+
+  if(_seq_tail_start(sf, off) < 0) goto error;
+  for(; k > n; k--) seq_skip_read(sf, &r);
+  seq_read_dealloc(&r);
+  return 0;
+
+  error:
+  seq_read_dealloc(&r);
+  return -1;
+}
+
+#undef _seq_shard_getc
+#undef _seq_shard_tell
+#undef _seq_shard_seek
+
+// Move unread bytes to the start of the input buffer and fill the rest
+// Returns number of bytes added
+static inline size_t _seq_count_fill(seq_file_t *sf)
+{
+  StreamBuffer *in = &sf->in;
+  size_t n = in->end - in->begin, space;
+  memmove(in->b+1, in->b+in->begin, n);
+  in->begin = 1;
+  in->end = 1+n;
+  space = in->size - in->end;
+  n = sf->gz_file ? gzread2(sf->gz_file, in->b+in->end, space)
+                  : fread2(sf->f_file, in->b+in->end, space);
+  in->end += n;
+  return n;
+}
+
+// Length of line [start,nl) excluding any '\r'
+#define _seq_count_len(start,nl) ((size_t)((nl)-(start)) - ((nl) > (start) && (nl)[-1] == '\r'))
+
+// Find a four line FASTQ record at p, ending before e
+// Returns 1 and sets *slen, *next if found, 0 if incomplete, -1 if not a
+// four line record
+static inline int _seq_count_fastq4(const char *p, const char *e,
+                                    size_t *slen, const char **next)
+{
+  const char *l1, *l2, *l3, *l4;
+  if(p == e) return 0;
+  if(*p != '@') return -1;
+  if((l1 = (const char*)memchr(p,    '\n', e-p))    == NULL ||
+     (l2 = (const char*)memchr(l1+1, '\n', e-l1-1)) == NULL || l2+1 == e)
+    return 0;
+  if(l2[1] != '+') return -1;
+  if((l3 = (const char*)memchr(l2+1, '\n', e-l2-1)) == NULL ||
+     (l4 = (const char*)memchr(l3+1, '\n', e-l3-1)) == NULL)
+    return 0;
+  if((*slen = _seq_count_len(l1+1, l2)) != _seq_count_len(l3+1, l4)) return -1;
+  *next = l4+1;
+  return 1;
+}
+
+#undef _seq_count_len
+
+/**
+ * Count the remaining reads and bases in a file, adding to *nreads, *nbases.
+ * Four line FASTQ records are counted from newline positions in the input
+ * buffer (memchr); anything else (FASTA, multi-line FASTQ, filters) is
+ * skipped through the parser without copying.
+ * Returns 0 on success, -1 on error
+ */
+static inline int seq_count(seq_file_t *sf, size_t *nreads, size_t *nbases)
+{
+  StreamBuffer *in = &sf->in;
+  const char *p;
+  size_t slen;
+  bool fast;
+  read_t r;
+  int s = 1, f;
+
+  if(seq_read_alloc(&r) == NULL) return -1;
+
+  fast = (in->b != NULL && sf->rhead == NULL && sf->shardfunc == NULL &&
+          !sf->filter.min_len && !sf->filter.max_len &&
+          !_seq_filter_on_name(sf));
+
+  // Read the first entry with the parser to find the format
+  if(sf->format == SEQ_FMT_UNKNOWN && (s = seq_skip_read(sf, &r)) > 0) {
+    (*nreads)++;
+    *nbases += r.seq.end;
+  }
+
+  while(s > 0)
+  {
+    if(fast && seq_is_fastq(sf))
+    {
+      p = in->b + in->begin;
+      while((f = _seq_count_fastq4(p, in->b + in->end, &slen, &p)) > 0) {
+        (*nreads)++;
+        *nbases += slen;
+      }
+      in->begin = p - in->b;
+
+      // Refill unless the buffer is already full
+      if(f == 0 && (in->begin > 1 || in->end < in->size)) {
+        if(_seq_count_fill(sf) > 0) continue;
+        if(in->begin == in->end) break;
+      }
+    }
+
+    // One entry with the parser
+    if((s = seq_skip_read(sf, &r)) > 0) {
+      (*nreads)++;
+      *nbases += r.seq.end;
+    }
+  }
+
+  seq_read_dealloc(&r);
+  return s < 0 ? -1 : 0;
+}
+
 // Get min/max qual scores by reading sequences into buffer and reporting min/max
 // Returns 0 if no qual scores, 1 on success, -1 if read error
 static inline int seq_get_qual_limits(seq_file_t *sf, int *minq, int *maxq)
@@ -801,6 +3217,26 @@ static inline int seq_read_names_cmp(const char *aa, const char *bb)
 
 #undef SNAME_END
 
+// Length of a read name up to the first whitespace, excluding any /1 or /2
+// mate suffix. Mates have the same name key.
+static inline size_t seq_read_name_keylen(const char *name)
+{
+  size_t len;
+  for(len = 0; name[len] && !isspace((unsigned char)name[len]); len++) {}
+  if(len > 2 && name[len-2] == '/' && (name[len-1] == '1' || name[len-1] == '2'))
+    len -= 2;
+  return len;
+}
+
+// FNV-1a hash of a read name key
+static inline uint64_t seq_read_name_hash(const char *key, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for(i = 0; i < len; i++) { h ^= (unsigned char)key[i]; h *= 1099511628211ULL; }
+  return h;
+}
+
 // Formally, FASTA/Q entry names stop at the first space character
 // Truncates read name and returns new length
 static inline size_t seq_read_truncate_name(read_t *r)
@@ -848,6 +3284,7 @@ static inline void seq_read_to_lowercase(read_t *r)
 
 _seq_print_fasta(seq_print_fasta,FILE*,fputs2,fputc2)
 _seq_print_fasta(seq_gzprint_fasta,gzFile,gzputs2,gzputc2)
+_seq_print_fasta(seq_sprint_fasta,StreamBuffer*,sputs_buf,sputc_buf)
 
 // These functions return -1 on error or 0 otherwise
 #define _seq_print_fastq(fname,ftype,_puts,_putc)                              \
@@ -878,6 +3315,109 @@ _seq_print_fasta(seq_gzprint_fasta,gzFile,gzputs2,gzputc2)
 
 _seq_print_fastq(seq_print_fastq,FILE*,fputs2,fputc2)
 _seq_print_fastq(seq_gzprint_fastq,gzFile,gzputs2,gzputc2)
+_seq_print_fastq(seq_sprint_fastq,StreamBuffer*,sputs_buf,sputc_buf)
+
+//
+// Unaligned BAM (uBAM) output. Records are appended uncompressed, compress
+// them into BGZF blocks with seq_bgzf_writer_t in seq_writer.h
+//
+
+// ASCII base to 4-bit BAM code (=ACMGRSVTWYHKDBN), anything else is N
+static const uint8_t _seq_bam_nt16[256] = {
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,  0, 15, 15,
+  15,  1, 14,  2, 13, 15, 15,  4, 11, 15, 15, 12, 15,  3, 15, 15,
+  15, 15,  5,  6,  8, 15,  7,  9, 15, 10, 15, 15, 15, 15, 15, 15,
+  15,  1, 14,  2, 13, 15, 15,  4, 11, 15, 15, 12, 15,  3, 15, 15,
+  15, 15,  5,  6,  8, 15,  7,  9, 15, 10, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+  15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+};
+
+// Append a BAM header with no reference sequences
+static inline void seq_sprint_ubam_header(StreamBuffer *out)
+{
+  static const char text[] = "@HD\tVN:1.6\tSO:unsorted\n";
+  unsigned char hdr[8] = {'B','A','M',1};
+  _seq_put_le32(hdr+4, sizeof(text)-1);
+  swrite_buf(out, hdr, 8);
+  swrite_buf(out, text, sizeof(text)-1);
+  memset(hdr, 0, 4); // no references
+  swrite_buf(out, hdr, 4);
+}
+
+// Append an unmapped BAM record. SEQ_SAM_FUNMAP is added to `flag`.
+// The name up to the first whitespace is the QNAME and the rest is stored in
+// a CO tag, which the readers add back. Bases are stored in upper case.
+// Quality scores are padded with '.' to the sequence length, as
+// seq_sprint_fastq(), or stored as missing if there are none.
+// Returns -1 if the name is too long for BAM (254 chars), 0 otherwise
+static inline int seq_sprint_ubam(const read_t *r, StreamBuffer *out,
+                                  uint16_t flag)
+{
+  const char *name = r->name.b, *seq = r->seq.b, *qual = r->qual.b;
+  size_t i, nlen, clen = 0, bsize;
+  size_t slen = r->seq.end, qlimit = _SF_MIN(r->qual.end, slen);
+  unsigned char *p;
+
+  for(nlen = 0; nlen < r->name.end && !isspace(name[nlen]); nlen++) {}
+  if(nlen < r->name.end) clen = r->name.end - nlen - 1;
+  if(nlen > 254) return -1;
+
+  bsize = 32 + (nlen ? nlen : 1) + 1 + (slen+1)/2 + slen +
+          (clen ? 3+clen+1 : 0);
+  cbuf_capacity(&out->b, &out->size, out->end + 4 + bsize);
+  p = (unsigned char*)out->b + out->end;
+
+  _seq_put_le32(p, (uint32_t)bsize);
+  _seq_put_le32(p+4, (uint32_t)-1); // refID
+  _seq_put_le32(p+8, (uint32_t)-1); // pos
+  p[12] = (unsigned char)((nlen ? nlen : 1) + 1);
+  p[13] = 0; // mapq
+  _seq_put_le16(p+14, 4680); // bin of an unmapped read
+  _seq_put_le16(p+16, 0); // no cigar
+  _seq_put_le16(p+18, flag | SEQ_SAM_FUNMAP);
+  _seq_put_le32(p+20, (uint32_t)slen);
+  _seq_put_le32(p+24, (uint32_t)-1); // mate refID
+  _seq_put_le32(p+28, (uint32_t)-1); // mate pos
+  _seq_put_le32(p+32, 0); // tlen
+  p += 36;
+
+  if(nlen) memcpy(p, name, nlen);
+  else p[nlen++] = '*';
+  p[nlen] = '\0';
+  p += nlen + 1;
+
+  for(i = 0; i+1 < slen; i += 2)
+    *p++ = (unsigned char)(_seq_bam_nt16[(uint8_t)seq[i]] << 4 |
+                           _seq_bam_nt16[(uint8_t)seq[i+1]]);
+  if(i < slen) *p++ = (unsigned char)(_seq_bam_nt16[(uint8_t)seq[i]] << 4);
+
+  if(qlimit == 0) { memset(p, 0xff, slen); p += slen; }
+  else {
+    for(i = 0; i < qlimit; i++)
+      *p++ = (unsigned char)(qual[i] > 33 ? qual[i]-33 : 0);
+    for(; i < slen; i++) *p++ = '.' - 33;
+  }
+
+  if(clen) {
+    memcpy(p, "COZ", 3);
+    memcpy(p+3, name + r->name.end - clen, clen);
+    p[3+clen] = '\0';
+  }
+
+  out->end += 4 + bsize;
+  out->b[out->end] = '\0';
+  return 0;
+}
 
 #undef DEFAULT_BUFSIZE
 #undef _SF_SWAP
@@ -886,18 +3426,32 @@ _seq_print_fastq(seq_gzprint_fastq,gzFile,gzputs2,gzputc2)
 #undef _sf_gzgetc_buf
 #undef _sf_fgetc
 #undef _sf_fgetc_buf
+#undef _sf_fdgetc_buf
 #undef _sf_gzungetc
 #undef _sf_gzungetc_buf
 #undef _sf_fungetc
 #undef _sf_fungetc_buf
+#undef _sf_fdungetc_buf
 #undef _sf_gzreadline
 #undef _sf_gzreadline_buf
 #undef _sf_freadline
 #undef _sf_freadline_buf
+#undef _sf_fdreadline_buf
+#undef _sf_gzgets
+#undef _sf_gzgets_buf
+#undef _sf_fgets
+#undef _sf_fgets_buf
+#undef _sf_fdgets_buf
 #undef _sf_gzskipline
 #undef _sf_gzskipline_buf
 #undef _sf_fskipline
 #undef _sf_fskipline_buf
+#undef _sf_fdskipline_buf
+#undef _sf_gzcountline
+#undef _sf_gzcountline_buf
+#undef _sf_fcountline
+#undef _sf_fcountline_buf
+#undef _sf_fdcountline_buf
 #undef _seq_print_wrap
 #undef _seq_print_fasta
 #undef _seq_print_fastq
@@ -913,6 +3467,8 @@ _seq_print_fastq(seq_gzprint_fastq,gzFile,gzputs2,gzputc2)
 // seq_open(path)
 // seq_open2(path,ishts,use_gzip,buffer_size)
 // seq_dopen(fileno(fh),use_gzip,buffer_size)
+// seq_dopen_stream(fileno(fh),buffer_size)
+// seq_open_shard(path,i,n)
 // seq_close(seq_file_t *sf)
 
 #endif
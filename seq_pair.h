@@ -0,0 +1,168 @@
+/*
+ seq_pair.h
+ project: seq_file
+ url: https://github.com/noporpoise/seq_file
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef _SEQ_PAIR_HEADER
+#define _SEQ_PAIR_HEADER
+
+#include "seq_file.h"
+#include "seq_prefetch.h"
+
+/*
+ Read paired-end reads from two files, or one interleaved file. Each input
+ is read ahead on its own thread. Mate names are compared by name key (see
+ seq_read_name_keylen()): lengths, then bytes with memcmp.
+
+ seq_pair_open(pr,path1,path2,check_names)
+ seq_pair_open_sf(pr,sf1,sf2,check_names)
+ seq_pair_read(pr,r1,r2)
+ seq_pair_read_batch(pr,r1,r2,n,&status)
+ seq_pair_close(pr)
+*/
+
+#define SEQ_PAIR_NAME_MISMATCH -2
+// With pr->uneven, once one input ends the other's reads are returned alone
+#define SEQ_PAIR_ONLY1 -3 /* only r1 is set, the second input has ended */
+#define SEQ_PAIR_ONLY2 -4 /* only r2 is set, the first input has ended */
+
+typedef struct
+{
+  seq_file_t *sf1, *sf2; // sf2 is NULL when reading an interleaved file
+  seq_prefetch_t pf1, pf2;
+  bool check_names;
+  bool uneven; // set to read on after one input ends, see SEQ_PAIR_ONLY1
+  size_t npairs; // pairs returned so far
+  size_t nrec1, nrec2; // records read from each side, 1-based ordinal of last
+} seq_pair_reader_t;
+
+// Open already opened files. Do not set a filter on either file, as that
+// would take reads out of step. Pass sf2 = NULL for an interleaved file.
+// Returns 0 on success, -1 on error
+static inline int seq_pair_open_sf(seq_pair_reader_t *pr,
+                                   seq_file_t *sf1, seq_file_t *sf2,
+                                   bool check_names)
+{
+  memset(pr, 0, sizeof(seq_pair_reader_t));
+  pr->sf1 = sf1;
+  pr->sf2 = sf2;
+  pr->check_names = check_names;
+  if(seq_prefetch_start(&pr->pf1, sf1, 0, 0) < 0) return -1;
+  if(sf2 && seq_prefetch_start(&pr->pf2, sf2, 0, 0) < 0) {
+    seq_prefetch_stop(&pr->pf1);
+    return -1;
+  }
+  return 0;
+}
+
+// Pass path2 = NULL to read pairs from an interleaved file
+// Returns 0 on success, -1 on error
+static inline int seq_pair_open(seq_pair_reader_t *pr,
+                                const char *path1, const char *path2,
+                                bool check_names)
+{
+  seq_file_t *sf1, *sf2 = NULL;
+  if((sf1 = seq_open(path1)) == NULL) return -1;
+  if(path2 && (sf2 = seq_open(path2)) == NULL) { seq_close(sf1); return -1; }
+  if(seq_pair_open_sf(pr, sf1, sf2, check_names) < 0) {
+    seq_close(sf1);
+    if(sf2) seq_close(sf2);
+    return -1;
+  }
+  return 0;
+}
+
+// Returns 1 if mates have the same name key
+static inline int seq_pair_names_match(const read_t *r1, const read_t *r2)
+{
+  size_t len1 = seq_read_name_keylen(r1->name.b);
+  size_t len2 = seq_read_name_keylen(r2->name.b);
+  return len1 == len2 && memcmp(r1->name.b, r2->name.b, len1) == 0;
+}
+
+// Returns 1 on success, 0 at the end of both inputs, -1 on a read error or
+// if one side has more reads than the other, SEQ_PAIR_NAME_MISMATCH if mate
+// names differ (r1 and r2 are still set, reading can continue). If
+// pr->uneven is set, reads left on one side give SEQ_PAIR_ONLY1/2 instead.
+// Pairs with mismatching names are not counted in pr->npairs.
+// On error, pr->nrec1 and pr->nrec2 give the ordinals of the last records.
+static inline int seq_pair_read(seq_pair_reader_t *pr, read_t *r1, read_t *r2)
+{
+  seq_prefetch_t *pf2 = pr->sf2 ? &pr->pf2 : &pr->pf1;
+  const char *path2 = pr->sf2 ? pr->sf2->path : pr->sf1->path;
+  int s1, s2;
+
+  if((s1 = seq_prefetch_read(&pr->pf1, r1)) > 0) {
+    if(pr->sf2) pr->nrec1++;
+    else pr->nrec1 = pr->nrec2 + 1;
+  }
+  if(s1 < 0) {
+    fprintf(stderr, "[%s:%i] Error reading %s after record %zu\n",
+            __FILE__, __LINE__, pr->sf1->path, pr->nrec1);
+    return -1;
+  }
+  if(s1 == 0 && !pr->sf2) return 0;
+
+  if((s2 = seq_prefetch_read(pf2, r2)) > 0) {
+    if(pr->sf2) pr->nrec2++;
+    else pr->nrec2 = pr->nrec1 + 1;
+  }
+  if(s2 < 0) {
+    fprintf(stderr, "[%s:%i] Error reading %s after record %zu\n",
+            __FILE__, __LINE__, path2, pr->nrec2);
+    return -1;
+  }
+
+  if(s1 == 0 && s2 == 0) return 0;
+  if((s1 == 0 || s2 == 0) && pr->uneven) return s1 ? SEQ_PAIR_ONLY1 : SEQ_PAIR_ONLY2;
+  if(s1 == 0 || s2 == 0) {
+    if(pr->sf2) {
+      fprintf(stderr, "[%s:%i] Error: %s ended after %zu records, "
+                      "%s has more\n", __FILE__, __LINE__,
+              s1 ? path2 : pr->sf1->path, s1 ? pr->nrec2 : pr->nrec1,
+              s1 ? pr->sf1->path : path2);
+    } else {
+      fprintf(stderr, "[%s:%i] Error: odd number of records (%zu) in %s\n",
+              __FILE__, __LINE__, pr->nrec1, pr->sf1->path);
+    }
+    return -1;
+  }
+
+  if(pr->check_names && !seq_pair_names_match(r1, r2))
+    return SEQ_PAIR_NAME_MISMATCH;
+
+  pr->npairs++;
+  return 1;
+}
+
+// Read up to n pairs into r1[0..n-1] and r2[0..n-1]
+// Returns number of pairs read. `status` is set to the return value of the
+// last seq_pair_read(): 1 if more pairs may follow.
+// A pair with mismatching names is not counted and ends the batch.
+static inline size_t seq_pair_read_batch(seq_pair_reader_t *pr,
+                                         read_t *r1, read_t *r2, size_t n,
+                                         int *status)
+{
+  size_t i;
+  int s = 1;
+  for(i = 0; i < n && (s = seq_pair_read(pr, &r1[i], &r2[i])) > 0; i++) {}
+  *status = s;
+  return i;
+}
+
+// Stop reading threads and close files
+static inline void seq_pair_close(seq_pair_reader_t *pr)
+{
+  seq_prefetch_stop(&pr->pf1);
+  seq_close(pr->sf1);
+  if(pr->sf2) {
+    seq_prefetch_stop(&pr->pf2);
+    seq_close(pr->sf2);
+  }
+  memset(pr, 0, sizeof(seq_pair_reader_t));
+}
+
+#endif
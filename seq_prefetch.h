@@ -0,0 +1,163 @@
+/*
+ seq_prefetch.h
+ project: seq_file
+ url: https://github.com/noporpoise/seq_file
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef _SEQ_PREFETCH_HEADER
+#define _SEQ_PREFETCH_HEADER
+
+#include <pthread.h>
+#include "seq_file.h"
+#include "seq_queue.h"
+
+/*
+ Read a file on a background thread. Reads are parsed (and decompressed)
+ ahead into a small pool of batches, so waiting on one input doesn't stall
+ reading others.
+
+ seq_prefetch_start(pf,sf,batch_reads,nbatches)
+ seq_prefetch_read(pf,r)
+ seq_prefetch_stop(pf)
+*/
+
+#define SEQ_PREFETCH_NREADS  1024
+#define SEQ_PREFETCH_NBATCH     4
+#define SEQ_PREFETCH_NBYTES (1UL<<22)
+
+typedef struct
+{
+  read_t *reads;
+  size_t nreads;
+  int status; // status of the last seq_read(): 1 more to come, 0 eof, -1 error
+} seq_batch_t;
+
+typedef struct
+{
+  seq_file_t *sf;
+  size_t batch_reads, nbatches;
+  seq_batch_t *batches;
+  seq_queue_t empty, full;
+  pthread_t thread;
+  seq_batch_t *curr; // batch being consumed
+  size_t pos;
+} seq_prefetch_t;
+
+static inline void* _seq_prefetch_thread(void *arg)
+{
+  seq_prefetch_t *pf = (seq_prefetch_t*)arg;
+  seq_batch_t *b;
+  size_t nbytes;
+  read_t *r;
+  int s = 1;
+
+  while(s > 0 && (b = (seq_batch_t*)seq_queue_pop(&pf->empty)) != NULL)
+  {
+    for(b->nreads = nbytes = 0;
+        b->nreads < pf->batch_reads && nbytes < SEQ_PREFETCH_NBYTES;
+        b->nreads++)
+    {
+      r = &b->reads[b->nreads];
+      if((s = seq_read(pf->sf, r)) <= 0) break;
+      nbytes += r->name.end + r->seq.end + r->qual.end;
+    }
+    b->status = s;
+    if(seq_queue_push(&pf->full, b) < 0) break;
+  }
+
+  return NULL;
+}
+
+// Start reading `sf` on a new thread. Pass 0 to use default sizes.
+// Returns 0 on success, -1 on error
+static inline int seq_prefetch_start(seq_prefetch_t *pf, seq_file_t *sf,
+                                     size_t batch_reads, size_t nbatches)
+{
+  size_t i, j;
+  memset(pf, 0, sizeof(seq_prefetch_t));
+  pf->sf = sf;
+  pf->batch_reads = batch_reads ? batch_reads : SEQ_PREFETCH_NREADS;
+  pf->nbatches = nbatches ? nbatches : SEQ_PREFETCH_NBATCH;
+
+  pf->batches = (seq_batch_t*)calloc(pf->nbatches, sizeof(seq_batch_t));
+  if(pf->batches == NULL) return -1;
+
+  if(seq_queue_alloc(&pf->empty, pf->nbatches) < 0) {
+    free(pf->batches);
+    return -1;
+  }
+  if(seq_queue_alloc(&pf->full, pf->nbatches) < 0) {
+    seq_queue_dealloc(&pf->empty);
+    free(pf->batches);
+    return -1;
+  }
+
+  for(i = 0; i < pf->nbatches; i++) {
+    pf->batches[i].reads = (read_t*)calloc(pf->batch_reads, sizeof(read_t));
+    if(pf->batches[i].reads == NULL) goto nomem;
+    for(j = 0; j < pf->batch_reads; j++)
+      if(seq_read_alloc(&pf->batches[i].reads[j]) == NULL) goto nomem;
+    seq_queue_push(&pf->empty, &pf->batches[i]);
+  }
+
+  if(pthread_create(&pf->thread, NULL, _seq_prefetch_thread, pf) != 0)
+    goto nomem;
+
+  return 0;
+
+  nomem:
+  for(i = 0; i < pf->nbatches && pf->batches[i].reads; i++) {
+    for(j = 0; j < pf->batch_reads; j++)
+      seq_read_dealloc(&pf->batches[i].reads[j]);
+    free(pf->batches[i].reads);
+  }
+  free(pf->batches);
+  seq_queue_dealloc(&pf->empty);
+  seq_queue_dealloc(&pf->full);
+  return -1;
+}
+
+// Swaps the next read into `r`
+// Returns 1 on success, 0 on eof, -1 on error
+static inline int seq_prefetch_read(seq_prefetch_t *pf, read_t *r)
+{
+  read_t tmp;
+
+  while(pf->curr == NULL || pf->pos == pf->curr->nreads)
+  {
+    if(pf->curr) {
+      if(pf->curr->status <= 0) return pf->curr->status;
+      seq_queue_push(&pf->empty, pf->curr);
+    }
+    pf->pos = 0;
+    if((pf->curr = (seq_batch_t*)seq_queue_pop(&pf->full)) == NULL) return -1;
+  }
+
+  tmp = pf->curr->reads[pf->pos];
+  pf->curr->reads[pf->pos++] = *r;
+  *r = tmp;
+  return 1;
+}
+
+// Stop the reading thread and free memory. Does not close pf->sf
+static inline void seq_prefetch_stop(seq_prefetch_t *pf)
+{
+  size_t i, j;
+  seq_queue_close(&pf->empty);
+  seq_queue_close(&pf->full);
+  pthread_join(pf->thread, NULL);
+
+  for(i = 0; i < pf->nbatches; i++) {
+    for(j = 0; j < pf->batch_reads; j++)
+      seq_read_dealloc(&pf->batches[i].reads[j]);
+    free(pf->batches[i].reads);
+  }
+  free(pf->batches);
+  seq_queue_dealloc(&pf->empty);
+  seq_queue_dealloc(&pf->full);
+  memset(pf, 0, sizeof(seq_prefetch_t));
+}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ seq_queue.h
+ project: seq_file
+ url: https://github.com/noporpoise/seq_file
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef _SEQ_QUEUE_HEADER
+#define _SEQ_QUEUE_HEADER
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ Bounded blocking queue of pointers, for passing work between threads.
+ push() blocks while the queue is full, pop() blocks while it is empty.
+ Once closed, pop() drains what is left then returns NULL.
+
+ seq_queue_alloc(q,capacity)
+ seq_queue_dealloc(q)
+ seq_queue_push(q,ptr)
+ seq_queue_pop(q)
+ seq_queue_close(q)
+*/
+
+typedef struct
+{
+  void **data;
+  size_t capacity, head, n;
+  bool closed;
+  pthread_mutex_t lock;
+  pthread_cond_t nonempty, nonfull;
+} seq_queue_t;
+
+// Returns 0 on success, -1 on error
+static inline int seq_queue_alloc(seq_queue_t *q, size_t capacity)
+{
+  q->capacity = capacity ? capacity : 1;
+  q->head = q->n = 0;
+  q->closed = false;
+  if((q->data = malloc(q->capacity * sizeof(void*))) == NULL) return -1;
+  if(pthread_mutex_init(&q->lock, NULL) != 0) { free(q->data); return -1; }
+  pthread_cond_init(&q->nonempty, NULL);
+  pthread_cond_init(&q->nonfull, NULL);
+  return 0;
+}
+
+static inline void seq_queue_dealloc(seq_queue_t *q)
+{
+  pthread_cond_destroy(&q->nonempty);
+  pthread_cond_destroy(&q->nonfull);
+  pthread_mutex_destroy(&q->lock);
+  free(q->data);
+  q->data = NULL;
+}
+
+// Returns 0 on success, -1 if the queue has been closed
+static inline int seq_queue_push(seq_queue_t *q, void *ptr)
+{
+  pthread_mutex_lock(&q->lock);
+  while(q->n == q->capacity && !q->closed)
+    pthread_cond_wait(&q->nonfull, &q->lock);
+  if(q->closed) { pthread_mutex_unlock(&q->lock); return -1; }
+  q->data[(q->head + q->n) % q->capacity] = ptr;
+  q->n++;
+  pthread_cond_signal(&q->nonempty);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
+
+// Returns NULL once the queue is closed and empty
+static inline void* seq_queue_pop(seq_queue_t *q)
+{
+  void *ptr = NULL;
+  pthread_mutex_lock(&q->lock);
+  while(q->n == 0 && !q->closed)
+    pthread_cond_wait(&q->nonempty, &q->lock);
+  if(q->n) {
+    ptr = q->data[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->n--;
+    pthread_cond_signal(&q->nonfull);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return ptr;
+}
+
+// Wake up all waiting threads; no more items can be pushed
+static inline void seq_queue_close(seq_queue_t *q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->closed = true;
+  pthread_cond_broadcast(&q->nonempty);
+  pthread_cond_broadcast(&q->nonfull);
+  pthread_mutex_unlock(&q->lock);
+}
+
+#endif
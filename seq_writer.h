@@ -0,0 +1,587 @@
+/*
+ seq_writer.h
+ project: seq_file
+ url: https://github.com/noporpoise/seq_file
+ author: Isaac Turner <turner.isaac@gmail.com>
+ license: Public Domain
+*/
+
+#ifndef _SEQ_WRITER_HEADER
+#define _SEQ_WRITER_HEADER
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <zlib.h>
+#include "stream_buffer.h"
+#include "seq_queue.h"
+
+/*
+ Write an output file on a background thread. The caller fills a buffer,
+ which is handed to the writing thread once it is full, so writing and gzip
+ compression happen off the calling thread.
+
+ seq_writer_open(w,path,gzip,nbufs,buf_size)
+ seq_writer_buf(w)    - buffer to append to e.g. with seq_sprint_fastq()
+ seq_writer_update(w) - call after appending, hands on the buffer once full
+ seq_writer_flush(w)  - hand on the buffer now
+ seq_writer_close(w)
+*/
+
+typedef struct
+{
+  char *path;
+  bool gzip;
+  FILE *fh;
+  gzFile gz;
+  StreamBuffer *bufs, *curr;
+  size_t nbufs, buf_size;
+  seq_queue_t full, empty;
+  pthread_t thread;
+  int status; // 0 ok, -1 on write error
+  // Stats: uncompressed bytes written and time the writing thread was busy
+  size_t nbytes;
+  double secs;
+} seq_writer_t;
+
+static inline void* _seq_writer_thread(void *arg)
+{
+  seq_writer_t *w = (seq_writer_t*)arg;
+  StreamBuffer *buf;
+  struct timespec t0, t1;
+  size_t len;
+  int s;
+
+  while((buf = (StreamBuffer*)seq_queue_pop(&w->full)) != NULL) {
+    if(w->status == 0) {
+      len = buf->end;
+      clock_gettime(CLOCK_MONOTONIC, &t0);
+      s = w->gzip ? strm_buf_gzflush(w->gz, buf) : strm_buf_flush(w->fh, buf);
+      clock_gettime(CLOCK_MONOTONIC, &t1);
+      w->secs += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+      w->nbytes += len;
+      if(s < 0) w->status = -1;
+    }
+    buf->end = 0;
+    seq_queue_push(&w->empty, buf);
+  }
+
+  return NULL;
+}
+
+// Open path for writing, with nbufs buffers of buf_size bytes
+// Returns 0 on success, -1 on error
+static inline int seq_writer_open(seq_writer_t *w, const char *path, bool gzip,
+                                  size_t nbufs, size_t buf_size)
+{
+  size_t i;
+  memset(w, 0, sizeof(seq_writer_t));
+  w->gzip = gzip;
+  w->nbufs = nbufs < 2 ? 2 : nbufs;
+  w->buf_size = buf_size;
+
+  if((w->path = strdup(path)) == NULL) return -1;
+  if(( gzip && (w->gz = gzopen(path, "w")) == NULL) ||
+     (!gzip && (w->fh = fopen(path, "w")) == NULL)) {
+    free(w->path);
+    return -1;
+  }
+
+  w->bufs = (StreamBuffer*)calloc(w->nbufs, sizeof(StreamBuffer));
+  if(w->bufs == NULL ||
+     seq_queue_alloc(&w->full, w->nbufs) < 0 ||
+     seq_queue_alloc(&w->empty, w->nbufs) < 0) {
+    fprintf(stderr, "[%s:%i] Error out of memory\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  for(i = 0; i < w->nbufs; i++) {
+    cbuf_capacity(&w->bufs[i].b, &w->bufs[i].size, buf_size);
+    if(i) seq_queue_push(&w->empty, &w->bufs[i]);
+  }
+  w->curr = &w->bufs[0];
+
+  if(pthread_create(&w->thread, NULL, _seq_writer_thread, w) != 0) {
+    fprintf(stderr, "[%s:%i] Error: cannot create thread\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  return 0;
+}
+
+static inline StreamBuffer* seq_writer_buf(seq_writer_t *w)
+{
+  return w->curr;
+}
+
+// Hand the current buffer to the writing thread and get an empty one
+static inline void seq_writer_flush(seq_writer_t *w)
+{
+  if(w->curr->end) {
+    seq_queue_push(&w->full, w->curr);
+    w->curr = (StreamBuffer*)seq_queue_pop(&w->empty);
+  }
+}
+
+static inline void seq_writer_update(seq_writer_t *w)
+{
+  if(w->curr->end >= w->buf_size) seq_writer_flush(w);
+}
+
+// Write remaining data and close the file
+// Returns 0 on success, -1 on error
+static inline int seq_writer_close(seq_writer_t *w)
+{
+  size_t i;
+  int status;
+
+  seq_writer_flush(w);
+  seq_queue_close(&w->full);
+  pthread_join(w->thread, NULL);
+
+  status = w->status;
+  if(( w->gzip && gzclose(w->gz) != Z_OK) ||
+     (!w->gzip && fclose(w->fh) != 0)) status = -1;
+
+  for(i = 0; i < w->nbufs; i++) free(w->bufs[i].b);
+  free(w->bufs);
+  free(w->path);
+  seq_queue_dealloc(&w->full);
+  seq_queue_dealloc(&w->empty);
+  w->bufs = w->curr = NULL;
+  w->path = NULL;
+  w->fh = NULL;
+  w->gz = NULL;
+  return status;
+}
+
+/*
+ Write many output files from a fixed pool of threads rather than a thread
+ per file. Each open file takes a buffer to append to from a shared list of
+ empty buffers. A full buffer is queued on its file and the file is queued for
+ the pool. Only one thread writes a given file at a time, so its buffers are
+ written in order.
+
+ seq_writer_pool_open(p,nthreads,nbufs,buf_size) - nbufs should be at least
+                             the number of files open at once plus nthreads
+ seq_pool_writer_open(p,w,path,gzip)
+ seq_pool_writer_buf(w)    - buffer to append to e.g. with seq_sprint_fastq()
+ seq_pool_writer_update(w) - call after appending, hands on the buffer once full
+ seq_pool_writer_close(w)  - waits for the file to be written, then closes it
+ seq_writer_pool_close(p)
+*/
+
+typedef struct _seq_pool_buf_t
+{
+  StreamBuffer sbuf;
+  struct _seq_pool_buf_t *next;
+} _seq_pool_buf_t;
+
+typedef struct
+{
+  size_t nthreads, buf_size, nbufs, max_bufs;
+  pthread_t *threads;
+  seq_queue_t todo; // files with buffers to write
+  _seq_pool_buf_t *empty; // free list
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // a buffer was freed or a file was written
+} seq_writer_pool_t;
+
+typedef struct
+{
+  seq_writer_pool_t *pool;
+  bool gzip;
+  FILE *fh;
+  gzFile gz;
+  _seq_pool_buf_t *curr, *head, *tail; // filling, and full ones in order
+  bool queued; // waiting on or being written by the pool
+  int status; // 0 ok, -1 on write error
+} seq_pool_writer_t;
+
+static inline void* _seq_writer_pool_thread(void *arg)
+{
+  seq_writer_pool_t *p = (seq_writer_pool_t*)arg;
+  seq_pool_writer_t *w;
+  _seq_pool_buf_t *buf;
+  int s;
+
+  while((w = (seq_pool_writer_t*)seq_queue_pop(&p->todo)) != NULL) {
+    pthread_mutex_lock(&p->lock);
+    while((buf = w->head) != NULL) {
+      if((w->head = buf->next) == NULL) w->tail = NULL;
+      pthread_mutex_unlock(&p->lock);
+      if(w->status == 0) {
+        s = w->gzip ? strm_buf_gzflush(w->gz, &buf->sbuf)
+                    : strm_buf_flush(w->fh, &buf->sbuf);
+        if(s < 0) w->status = -1;
+      }
+      buf->sbuf.end = 0;
+      pthread_mutex_lock(&p->lock);
+      buf->next = p->empty;
+      p->empty = buf;
+      pthread_cond_broadcast(&p->cond);
+    }
+    w->queued = false;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  return NULL;
+}
+
+// Returns 0 on success, -1 on error
+static inline int seq_writer_pool_open(seq_writer_pool_t *p, size_t nthreads,
+                                       size_t nbufs, size_t buf_size)
+{
+  size_t i;
+  memset(p, 0, sizeof(seq_writer_pool_t));
+  p->nthreads = nthreads ? nthreads : 1;
+  p->max_bufs = nbufs < p->nthreads + 1 ? p->nthreads + 1 : nbufs;
+  p->buf_size = buf_size;
+
+  p->threads = (pthread_t*)malloc(p->nthreads * sizeof(pthread_t));
+  if(p->threads == NULL || seq_queue_alloc(&p->todo, p->max_bufs) < 0) {
+    free(p->threads);
+    return -1;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+
+  for(i = 0; i < p->nthreads; i++) {
+    if(pthread_create(&p->threads[i], NULL, _seq_writer_pool_thread, p) != 0) {
+      fprintf(stderr, "[%s:%i] Error: cannot create thread\n", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+    }
+  }
+  return 0;
+}
+
+// Wait for all files to be written, stop the threads and free buffers
+static inline void seq_writer_pool_close(seq_writer_pool_t *p)
+{
+  _seq_pool_buf_t *buf;
+  size_t i;
+
+  seq_queue_close(&p->todo);
+  for(i = 0; i < p->nthreads; i++) pthread_join(p->threads[i], NULL);
+
+  while((buf = p->empty) != NULL) {
+    p->empty = buf->next;
+    free(buf->sbuf.b);
+    free(buf);
+  }
+  seq_queue_dealloc(&p->todo);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  free(p->threads);
+  p->threads = NULL;
+}
+
+// Returns 0 on success, -1 on error
+static inline int seq_pool_writer_open(seq_writer_pool_t *p,
+                                       seq_pool_writer_t *w,
+                                       const char *path, bool gzip)
+{
+  memset(w, 0, sizeof(seq_pool_writer_t));
+  w->pool = p;
+  w->gzip = gzip;
+  if(( gzip && (w->gz = gzopen(path, "w")) == NULL) ||
+     (!gzip && (w->fh = fopen(path, "w")) == NULL)) return -1;
+  return 0;
+}
+
+// Take an empty buffer, allocating one if under the limit, else waiting
+static inline _seq_pool_buf_t* _seq_writer_pool_get(seq_writer_pool_t *p)
+{
+  _seq_pool_buf_t *buf;
+  pthread_mutex_lock(&p->lock);
+  while(p->empty == NULL && p->nbufs == p->max_bufs)
+    pthread_cond_wait(&p->cond, &p->lock);
+  if((buf = p->empty) != NULL) p->empty = buf->next;
+  else p->nbufs++;
+  pthread_mutex_unlock(&p->lock);
+
+  if(buf == NULL) {
+    if((buf = (_seq_pool_buf_t*)calloc(1, sizeof(_seq_pool_buf_t))) == NULL) {
+      fprintf(stderr, "[%s:%i] Error out of memory\n", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+    }
+    cbuf_capacity(&buf->sbuf.b, &buf->sbuf.size, p->buf_size);
+  }
+  return buf;
+}
+
+static inline StreamBuffer* seq_pool_writer_buf(seq_pool_writer_t *w)
+{
+  if(w->curr == NULL) w->curr = _seq_writer_pool_get(w->pool);
+  return &w->curr->sbuf;
+}
+
+// Queue the current buffer to be written
+static inline void seq_pool_writer_flush(seq_pool_writer_t *w)
+{
+  seq_writer_pool_t *p = w->pool;
+  _seq_pool_buf_t *buf = w->curr;
+  bool queue;
+
+  if(buf == NULL) return;
+  w->curr = NULL;
+  pthread_mutex_lock(&p->lock);
+  if(buf->sbuf.end == 0) {
+    buf->next = p->empty;
+    p->empty = buf;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    return;
+  }
+  buf->next = NULL;
+  if(w->tail) w->tail->next = buf;
+  else w->head = buf;
+  w->tail = buf;
+  queue = !w->queued;
+  w->queued = true;
+  pthread_mutex_unlock(&p->lock);
+  if(queue) seq_queue_push(&p->todo, w);
+}
+
+static inline void seq_pool_writer_update(seq_pool_writer_t *w)
+{
+  if(w->curr && w->curr->sbuf.end >= w->pool->buf_size)
+    seq_pool_writer_flush(w);
+}
+
+// Write remaining data and close the file
+// Returns 0 on success, -1 on error
+static inline int seq_pool_writer_close(seq_pool_writer_t *w)
+{
+  seq_writer_pool_t *p = w->pool;
+  int status;
+
+  seq_pool_writer_flush(w);
+  pthread_mutex_lock(&p->lock);
+  while(w->queued) pthread_cond_wait(&p->cond, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+
+  status = w->status;
+  if(( w->gzip && gzclose(w->gz) != Z_OK) ||
+     (!w->gzip && fclose(w->fh) != 0)) status = -1;
+  w->fh = NULL;
+  w->gz = NULL;
+  return status;
+}
+
+/*
+ Write BGZF (as used by BAM) to an open file. The caller fills a buffer,
+ which is cut into blocks of SEQ_BGZF_WRITE_SIZE bytes. Blocks are compressed
+ on a pool of threads and written in order by the calling thread.
+
+ seq_bgzf_writer_open(bw,fh,nthreads,level) - level is zlib's e.g. -1 default
+ seq_bgzf_writer_buf(bw)    - buffer to append to e.g. with seq_sprint_ubam()
+ seq_bgzf_writer_update(bw) - call after appending, hands on full blocks
+ seq_bgzf_writer_close(bw)  - writes the end of file block, fh is not closed
+*/
+
+// Uncompressed bytes per block, leaves room in a 64K block if it won't compress
+#define SEQ_BGZF_WRITE_SIZE 0xff00
+#define _SEQ_BGZF_MAX_BLOCK (1<<16)
+
+typedef struct
+{
+  StreamBuffer data; // uncompressed
+  unsigned char *out; // whole block, header to footer
+  size_t outlen;
+  bool done;
+  int status;
+} _seq_bgzf_wjob_t;
+
+typedef struct
+{
+  FILE *fh;
+  int level;
+  StreamBuffer buf; // caller appends here
+  _seq_bgzf_wjob_t *jobs; // ring of blocks in file order
+  size_t njobs, head, n;
+  seq_queue_t todo;
+  pthread_t *threads;
+  size_t nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int status; // 0 ok, -1 on write error
+} seq_bgzf_writer_t;
+
+// Returns 0 on success, -1 on error
+static inline int _seq_bgzf_deflate(_seq_bgzf_wjob_t *job, int level)
+{
+  static const unsigned char hdr[16] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255,
+                                        6, 0, 'B', 'C', 2, 0};
+  unsigned char *p = job->out;
+  size_t clen, len = job->data.end;
+  uint32_t crc;
+  z_stream strm;
+  int s;
+
+  memset(&strm, 0, sizeof(strm));
+  if(deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return -1;
+  strm.next_in = (unsigned char*)job->data.b;
+  strm.avail_in = (uInt)len;
+  strm.next_out = p + 18;
+  strm.avail_out = _SEQ_BGZF_MAX_BLOCK - 26;
+  s = deflate(&strm, Z_FINISH);
+  clen = strm.total_out;
+  deflateEnd(&strm);
+  // Store the block if compressing made it too big
+  if(s != Z_STREAM_END) return level ? _seq_bgzf_deflate(job, 0) : -1;
+
+  crc = (uint32_t)crc32(0L, (unsigned char*)job->data.b, (uInt)len);
+  memcpy(p, hdr, 16);
+  p[16] = (unsigned char)(clen + 25);
+  p[17] = (unsigned char)((clen + 25) >> 8);
+  p += 18 + clen;
+  p[0] = (unsigned char)crc;         p[1] = (unsigned char)(crc >> 8);
+  p[2] = (unsigned char)(crc >> 16); p[3] = (unsigned char)(crc >> 24);
+  p[4] = (unsigned char)len;         p[5] = (unsigned char)(len >> 8);
+  p[6] = p[7] = 0;
+  job->outlen = clen + 26;
+  return 0;
+}
+
+static inline void* _seq_bgzf_writer_thread(void *arg)
+{
+  seq_bgzf_writer_t *bw = (seq_bgzf_writer_t*)arg;
+  _seq_bgzf_wjob_t *job;
+  int s;
+
+  while((job = (_seq_bgzf_wjob_t*)seq_queue_pop(&bw->todo)) != NULL) {
+    s = _seq_bgzf_deflate(job, bw->level);
+    pthread_mutex_lock(&bw->lock);
+    job->status = s;
+    job->done = true;
+    pthread_cond_broadcast(&bw->done);
+    pthread_mutex_unlock(&bw->lock);
+  }
+
+  return NULL;
+}
+
+// Returns 0 on success, -1 on error
+static inline int seq_bgzf_writer_open(seq_bgzf_writer_t *bw, FILE *fh,
+                                       size_t nthreads, int level)
+{
+  size_t i;
+  memset(bw, 0, sizeof(seq_bgzf_writer_t));
+  bw->fh = fh;
+  bw->level = level;
+  bw->nthreads = nthreads ? nthreads : 1;
+  bw->njobs = 4 * bw->nthreads;
+
+  bw->jobs = (_seq_bgzf_wjob_t*)calloc(bw->njobs, sizeof(_seq_bgzf_wjob_t));
+  bw->threads = (pthread_t*)malloc(bw->nthreads * sizeof(pthread_t));
+  if(bw->jobs == NULL || bw->threads == NULL ||
+     seq_queue_alloc(&bw->todo, bw->njobs) < 0) {
+    fprintf(stderr, "[%s:%i] Error out of memory\n", __FILE__, __LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  cbuf_capacity(&bw->buf.b, &bw->buf.size, 2 * SEQ_BGZF_WRITE_SIZE);
+  for(i = 0; i < bw->njobs; i++) {
+    cbuf_capacity(&bw->jobs[i].data.b, &bw->jobs[i].data.size,
+                  SEQ_BGZF_WRITE_SIZE);
+    if((bw->jobs[i].out = (unsigned char*)malloc(_SEQ_BGZF_MAX_BLOCK)) == NULL) {
+      fprintf(stderr, "[%s:%i] Error out of memory\n", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_mutex_init(&bw->lock, NULL);
+  pthread_cond_init(&bw->done, NULL);
+
+  for(i = 0; i < bw->nthreads; i++) {
+    if(pthread_create(&bw->threads[i], NULL, _seq_bgzf_writer_thread, bw) != 0) {
+      fprintf(stderr, "[%s:%i] Error: cannot create thread\n", __FILE__, __LINE__);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return 0;
+}
+
+static inline StreamBuffer* seq_bgzf_writer_buf(seq_bgzf_writer_t *bw)
+{
+  return &bw->buf;
+}
+
+// Wait for the oldest block to be compressed and write it
+static inline void _seq_bgzf_writer_pop(seq_bgzf_writer_t *bw)
+{
+  _seq_bgzf_wjob_t *job = &bw->jobs[bw->head];
+  pthread_mutex_lock(&bw->lock);
+  while(!job->done) pthread_cond_wait(&bw->done, &bw->lock);
+  pthread_mutex_unlock(&bw->lock);
+  if(job->status < 0 ||
+     fwrite(job->out, 1, job->outlen, bw->fh) != job->outlen) bw->status = -1;
+  bw->head = (bw->head + 1) % bw->njobs;
+  bw->n--;
+}
+
+// Compress len bytes from ptr as the next block
+static inline void _seq_bgzf_writer_submit(seq_bgzf_writer_t *bw,
+                                           const char *ptr, size_t len)
+{
+  _seq_bgzf_wjob_t *job;
+  if(bw->n == bw->njobs) _seq_bgzf_writer_pop(bw);
+  job = &bw->jobs[(bw->head + bw->n) % bw->njobs];
+  memcpy(job->data.b, ptr, len);
+  job->data.end = len;
+  job->done = false;
+  bw->n++;
+  seq_queue_push(&bw->todo, job);
+}
+
+static inline void seq_bgzf_writer_update(seq_bgzf_writer_t *bw)
+{
+  size_t i;
+  for(i = 0; bw->buf.end - i >= SEQ_BGZF_WRITE_SIZE; i += SEQ_BGZF_WRITE_SIZE)
+    _seq_bgzf_writer_submit(bw, bw->buf.b + i, SEQ_BGZF_WRITE_SIZE);
+  if(i) {
+    memmove(bw->buf.b, bw->buf.b + i, bw->buf.end - i);
+    bw->buf.end -= i;
+  }
+}
+
+// Write remaining data and the end of file block
+// Returns 0 on success, -1 on error
+static inline int seq_bgzf_writer_close(seq_bgzf_writer_t *bw)
+{
+  static const unsigned char eof[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0,
+                                        'B', 'C', 2, 0, 27, 0, 3, 0,
+                                        0, 0, 0, 0, 0, 0, 0, 0};
+  size_t i;
+
+  seq_bgzf_writer_update(bw);
+  if(bw->buf.end) _seq_bgzf_writer_submit(bw, bw->buf.b, bw->buf.end);
+  while(bw->n) _seq_bgzf_writer_pop(bw);
+  if(fwrite(eof, 1, sizeof(eof), bw->fh) != sizeof(eof) || fflush(bw->fh) != 0)
+    bw->status = -1;
+
+  seq_queue_close(&bw->todo);
+  for(i = 0; i < bw->nthreads; i++) pthread_join(bw->threads[i], NULL);
+
+  for(i = 0; i < bw->njobs; i++) {
+    free(bw->jobs[i].data.b);
+    free(bw->jobs[i].out);
+  }
+  free(bw->jobs);
+  free(bw->threads);
+  free(bw->buf.b);
+  seq_queue_dealloc(&bw->todo);
+  pthread_mutex_destroy(&bw->lock);
+  pthread_cond_destroy(&bw->done);
+  bw->jobs = NULL;
+  bw->threads = NULL;
+  bw->buf.b = NULL;
+  return bw->status;
+}
+
+#endif
@@ -15,6 +15,8 @@
 #include <string.h>
 #include <zlib.h>
 #include <limits.h>
+#include <errno.h>
+#include <unistd.h> // read()
 
 /*
    Generic string buffer functions
@@ -130,6 +132,10 @@ gzgets2(gz,buf,len)
 fgets2(f,buf,len)
 gzreadline(gz,out)
 freadline(f,out)
+gzskipline(gz)
+fskipline(f)
+gzcountline(gz,len)
+fcountline(f,len)
 */
 
 #define ferror2(fh) ferror(fh)
@@ -156,6 +162,18 @@ static inline size_t gzread2(gzFile gz, void *ptr, size_t len)
   return nread;
 }
 
+// Read whatever is available on the underlying file descriptor, bypassing
+// stdio. Unlike fread, this returns as soon as any bytes arrive, so a pipe or
+// terminal does not block until `len` bytes have been written to it.
+// Returns 0 at EOF or on error (check errno)
+static inline size_t fdread2(FILE *fh, void *ptr, size_t len)
+{
+  ssize_t n;
+  if(len > INT_MAX) len = INT_MAX;
+  do { n = read(fileno(fh), ptr, len); } while(n < 0 && errno == EINTR);
+  return n < 0 ? 0 : (size_t)n;
+}
+
 // TODO: these should support len > 2^32 by looping fgets/gzgets
 #define gzgets2(gz,buf,len) gzgets(gz,buf,(int)(len))
 #define fgets2(fh,buf,len) fgets(buf,(int)(len),fh)
@@ -202,16 +220,45 @@ _func_readline(freadline,FILE*,fgets2)
 _func_skipline(gzskipline,gzFile,gzgetc)
 _func_skipline(fskipline,FILE*,fgetc)
 
+// Define countline: skip a line, setting *len to its length excluding the
+// end of line (\n or \r\n). Returns number of bytes skipped, 0 at EOF
+#define _func_countline(fname,ftype,readc) \
+  static inline size_t fname(ftype file, size_t *len)                          \
+  {                                                                            \
+    int c, last = 0;                                                           \
+    size_t skipped_bytes = 0;                                                  \
+    while((c = readc(file)) != -1) {                                           \
+      skipped_bytes++;                                                         \
+      if(c == '\n') break;                                                     \
+      last = c;                                                                \
+    }                                                                          \
+    *len = skipped_bytes - (c == '\n') - (last == '\r');                       \
+    return skipped_bytes;                                                      \
+  }
+
+_func_countline(gzcountline,gzFile,gzgetc)
+_func_countline(fcountline,FILE*,fgetc)
+
 /* Buffered */
 
 /*
 fgetc_buf(f,in)
 gzgetc_buf(gz,in)
+fdgetc_buf(f,in)
 ungetc_buf(c,in)
 fread_buf(f,ptr,len,in)
 gzread_buf(f,ptr,len,in)
 gzreadline_buf(gz,in,out)
 freadline_buf(f,in,out)
+fdreadline_buf(f,in,out)
+gzskipline_buf(gz,in)
+fskipline_buf(f,in)
+gzcountline_buf(gz,in,len)
+fcountline_buf(f,in,len)
+
+The fd* versions fill the buffer with whatever is available (see fdread2)
+rather than blocking until the buffer is full. Use them for low-latency
+streaming from pipes and terminals.
 */
 
 // __read is either gzread2 or fread2
@@ -239,6 +286,7 @@ freadline_buf(f,in,out)
 
 _func_getc_buf(fgetc_buf,FILE*,fread2)
 _func_getc_buf(gzgetc_buf,gzFile,gzread2)
+_func_getc_buf(fdgetc_buf,FILE*,fdread2)
 
 // Define ungetc for buffers
 // returns c if successful, otherwise -1
@@ -289,6 +337,7 @@ static inline int ungetc_buf(int c, StreamBuffer *in)
 
 _func_read_buf(gzread_buf,gzFile,gzread2)
 _func_read_buf(fread_buf,FILE*,fread2)
+_func_read_buf(fdread_buf,FILE*,fdread2)
 
 // Define readline for gzFile and FILE (buffered)
 // Check ferror/gzerror on return for error
@@ -316,6 +365,7 @@ _func_read_buf(fread_buf,FILE*,fread2)
 
 _func_readline_buf(gzreadline_buf,gzFile,gzread2)
 _func_readline_buf(freadline_buf,FILE*,fread2)
+_func_readline_buf(fdreadline_buf,FILE*,fdread2)
 
 // Define buffered skipline
 // Check ferror/gzerror on return for error
@@ -323,13 +373,18 @@ _func_readline_buf(freadline_buf,FILE*,fread2)
   static inline size_t fname(ftype file, StreamBuffer *in)                     \
   {                                                                            \
     if(in->begin >= in->end) { _READ_BUFFER(file,in,__read); }                 \
-    size_t offset, skipped_bytes = 0;                                          \
+    size_t skipped_bytes = 0;                                                  \
+    char *nl;                                                                  \
     while(in->end > in->begin)                                                 \
     {                                                                          \
-      for(offset = in->begin; offset < in->end && in->b[offset++] != '\n'; )   \
-      skipped_bytes += offset - in->begin;                                     \
-      in->begin = offset;                                                      \
-      if(in->b[offset-1] == '\n') break;                                       \
+      nl = memchr(in->b+in->begin, '\n', in->end-in->begin);                   \
+      if(nl != NULL) {                                                         \
+        skipped_bytes += (size_t)(nl - (in->b+in->begin)) + 1;                 \
+        in->begin = (size_t)(nl - in->b) + 1;                                  \
+        break;                                                                 \
+      }                                                                        \
+      skipped_bytes += in->end - in->begin;                                    \
+      in->begin = in->end;                                                     \
       _READ_BUFFER(file,in,__read);                                            \
     }                                                                          \
     return skipped_bytes;                                                      \
@@ -337,6 +392,39 @@ _func_readline_buf(freadline_buf,FILE*,fread2)
 
 _func_skipline_buf(gzskipline_buf,gzFile,gzread2)
 _func_skipline_buf(fskipline_buf,FILE*,fread2)
+_func_skipline_buf(fdskipline_buf,FILE*,fdread2)
+
+// Define buffered countline (see countline above)
+// Check ferror/gzerror on return for error
+#define _func_countline_buf(fname,ftype,__read)                                \
+  static inline size_t fname(ftype file, StreamBuffer *in, size_t *len)        \
+  {                                                                            \
+    if(in->begin >= in->end) { _READ_BUFFER(file,in,__read); }                 \
+    size_t n, skipped_bytes = 0;                                               \
+    char *nl, last = 0;                                                        \
+    while(in->end > in->begin)                                                 \
+    {                                                                          \
+      nl = memchr(in->b+in->begin, '\n', in->end-in->begin);                   \
+      if(nl != NULL) {                                                         \
+        n = (size_t)(nl - (in->b+in->begin));                                  \
+        if(n) last = nl[-1];                                                   \
+        skipped_bytes += n+1;                                                  \
+        in->begin += n+1;                                                      \
+        *len = skipped_bytes - 1 - (last == '\r');                             \
+        return skipped_bytes;                                                  \
+      }                                                                        \
+      skipped_bytes += in->end - in->begin;                                    \
+      last = in->b[in->end-1];                                                 \
+      in->begin = in->end;                                                     \
+      _READ_BUFFER(file,in,__read);                                            \
+    }                                                                          \
+    *len = skipped_bytes - (last == '\r');                                     \
+    return skipped_bytes;                                                      \
+  }
+
+_func_countline_buf(gzcountline_buf,gzFile,gzread2)
+_func_countline_buf(fcountline_buf,FILE*,fread2)
+_func_countline_buf(fdcountline_buf,FILE*,fdread2)
 
 // Define buffered gzgets_buf, fgets_buf
 
@@ -369,6 +457,7 @@ _func_skipline_buf(fskipline_buf,FILE*,fread2)
 
 _func_gets_buf(gzgets_buf,gzFile,gzread2)
 _func_gets_buf(fgets_buf,FILE*,fread2)
+_func_gets_buf(fdgets_buf,FILE*,fdread2)
 
 
 // Buffered ftell/gztell, fseek/gzseek
@@ -391,11 +480,12 @@ static inline long fseek_buf(FILE *fh, off_t offset, int whence,
   return x;
 }
 
+// Returns the new offset like gzseek, or -1 on error
 static inline long gzseek_buf(gzFile gz, off_t offset, int whence,
                               StreamBuffer *strm)
 {
-  int x = gzseek(gz, offset, whence);
-  if(x == 0) { strm->begin = strm->end = 1; }
+  z_off_t x = gzseek(gz, offset, whence);
+  if(x >= 0) { strm->begin = strm->end = 1; }
   return x;
 }
 
@@ -432,9 +522,66 @@ fprintf_buf(fh,buf,fmt,...)
 gzprintf_buf(gz,buf,fmt,...)
 fwrite_buf(fh,buf,ptr,len)
 gzwrite_buf(gz,buf,ptr,len)
+
+// Write out buffer contents (e.g. from sputc_buf() etc. below) and empty it
 strm_buf_flush(fh,buf)
 strm_buf_gzflush(gz,buf)
 */
 
+// Returns 0 on success, -1 on error
+static inline int strm_buf_flush(FILE *fh, StreamBuffer *strm)
+{
+  if(strm->end && fwrite(strm->b, 1, strm->end, fh) != strm->end) return -1;
+  strm->end = 0;
+  return 0;
+}
+
+// Returns 0 on success, -1 on error
+static inline int strm_buf_gzflush(gzFile gz, StreamBuffer *strm)
+{
+  size_t n, i = 0;
+  for(; i < strm->end; i += n) {
+    n = strm->end - i < INT_MAX ? strm->end - i : INT_MAX;
+    if(gzwrite(gz, strm->b + i, (unsigned)n) != (int)n) return -1;
+  }
+  strm->end = 0;
+  return 0;
+}
+
+/*
+ Output (in memory)
+ Append to strm->b[strm->end..], growing the buffer as needed.
+ The buffer is kept nul terminated. Set strm->end = 0 to reuse.
+
+sputc_buf(buf,c)
+sputs_buf(buf,str)
+swrite_buf(buf,ptr,len)
+*/
+
+// Returns number of bytes written
+static inline size_t swrite_buf(StreamBuffer *strm, const void *ptr, size_t len)
+{
+  cbuf_capacity(&strm->b, &strm->size, strm->end+len);
+  memcpy(strm->b+strm->end, ptr, len);
+  strm->end += len;
+  strm->b[strm->end] = '\0';
+  return len;
+}
+
+// Returns c
+static inline int sputc_buf(StreamBuffer *strm, int c)
+{
+  cbuf_capacity(&strm->b, &strm->size, strm->end+1);
+  strm->b[strm->end++] = (char)c;
+  strm->b[strm->end] = '\0';
+  return c;
+}
+
+// Returns number of bytes written
+static inline size_t sputs_buf(StreamBuffer *strm, const char *str)
+{
+  return swrite_buf(strm, str, strlen(str));
+}
+
 
 #endif
@@ -17,10 +17,21 @@ Jan 2014, Public Domain
 #include <ctype.h> // toupper() tolower() isprint()
 
 #include <time.h>
+#include <math.h>
 #include <sys/time.h> // for seeding random
 #include <unistd.h> // getpid()
+#include <errno.h>
+#include <pthread.h>
+
+// Decompress BAM input on this many threads
+#define SEQ_BGZF_NTHREADS 4
 
 #include "seq_file.h"
+#include "seq_queue.h"
+#include "seq_prefetch.h"
+#include "seq_pair.h"
+#include "seq_dedup.h"
+#include "seq_writer.h"
 
 #define OPS_UPPERCASE       1 /* Convert to uppercase */
 #define OPS_LOWERCASE       2 /* Convert to lowercase */
@@ -33,13 +44,18 @@ Jan 2014, Public Domain
 
 const char usage[] = "  Read and manipulate dna sequence.\n"
 #ifdef _USESAM
-"  Compiled with SAM/BAM support.\n"
+"  Compiled with htslib (CRAM support).\n"
 #endif
 "\n"
 "  -h,--help        show this help text\n"
 "  -F,--fasta       print in FASTA format\n"
 "  -Q,--fastq       print in FASTQ format\n"
 "  -P,--plain       print in plain format\n"
+"  --bam            print unaligned BAM, compressed on multiple threads\n"
+"  --sqc            print a columnar container (.sqc), which is faster to read\n"
+"                   again and can be read for only names or sequence\n"
+"  --2bit           print UCSC .2bit, which can be read a region at a time.\n"
+"                   Sequences are held in memory until the end\n"
 "  -w,--wrap <n>    wrap lines by <n> characters [default: 0 (off)]\n"
 "  -u,--uppercase   convert sequence to uppercase\n"
 "  -l,--lowercase   convert sequence to lowercase\n"
@@ -50,14 +66,74 @@ const char usage[] = "  Read and manipulate dna sequence.\n"
 "  -i,--interleave  interleave input files\n"
 "  -m,--mask        mask lowercase bases\n"
 "  -n,--rand <n>    print <n> random bases AFTER reading files\n"
+"  --seed <n>       seed for -n,--rand and --sample, to give reproducible output\n"
 "  -N,--names       print read names only\n"
 "  -L,--lengths     print read names and lengths (implies -N)\n"
 "  -s,--stat        probe and print file info, summarise read lengths\n"
 "  -S,--fast-stat   probe and print file info only\n"
+"  --count          print <file> <reads> <bases> for each file\n"
 "  -M,--rename <f>  read names from <f>, one per line\n"
+"  --rename-pattern <s> name reads from a pattern where %n is the read number\n"
+"                   (1,2,3,..), %p the pair number (1,1,2,2,..), %% gives %\n"
+"  -t,--threads <n> use <n> threads to transform and print reads [default: 1]\n"
+"  --min-len <n>    only take reads of at least <n> bases\n"
+"  --max-len <n>    only take reads of at most <n> bases\n"
+"  --name-prefix <s> only take reads whose name starts with <s>\n"
+"  --repair         pair up mates from two inputs that are out of order,\n"
+"                   print interleaved, unpaired reads at the end\n"
+"  --dedup          drop reads whose sequence was seen before, or pairs with\n"
+"                   -i and two inputs. With -k a read matches its revcmp\n"
+"  --sample <x>     keep a fraction of reads e.g. 0.01 (contains '.'), or a\n"
+"                   number of reads e.g. 1000. With -i reads from each input\n"
+"                   are kept or dropped together\n"
+"  --sort <by>      sort reads by name, seq or len, using temporary files if\n"
+"                   they don't fit in --mem; -t sorts on multiple threads\n"
+"  --mem <m>        memory limit for --repair,--dedup,--sort e.g. 500M, 2G\n"
+"                   [default: 1G]\n"
+"  --tile <l>[:<s>] print every <l> base window of each sequence, every <s>\n"
+"                   bases [default s: 1], named <name>:<start>-<end>\n"
+"  --split <m>:<n>  write reads to files <prefix>0.fq, <prefix>1.fq, ..\n"
+"                   starting a new file every <n> reads (reads:<n>) or bytes\n"
+"                   (bytes:<n> e.g. 1G), or over <n> files round-robin (rr:<n>\n"
+"                   or just <n>) or by read name (hash:<n>, keeps mates\n"
+"                   together). With -i reads from each input stay together;\n"
+"                   -t writes and compresses files on <n> threads\n"
+"  --split-prefix <p> path prefix for --split files [default: split.]\n"
+"  --gzip           gzip --split files\n"
+"  --shard <i>/<n>  only read entries starting in the i-th of n equal byte\n"
+"                   ranges of each file (i = 0..n-1). Uncompressed or BGZF\n"
+"                   FASTA/FASTQ/plain, .sqc or .2bit; not SAM/BAM\n"
+"  --tail <n>       only read the last <n> reads of each file, found from the\n"
+"                   end of the file. Uncompressed files only\n"
+"  --region <name>[:<start>-<end>] only print sequence <name>, or bases\n"
+"                   <start>-<end> of it (1-based, inclusive), of each .2bit\n"
+"                   file, without reading the rest of the file\n"
 "\n"
 "  Written by Isaac Turner <turner.isaac@gmail.com>\n";
 
+// Long options without a short version
+#define OPT_MIN_LEN     256
+#define OPT_MAX_LEN     257
+#define OPT_NAME_PREFIX 258
+#define OPT_REPAIR      259
+#define OPT_MEM         260
+#define OPT_SEED        261
+#define OPT_TILE        262
+#define OPT_RENAME_PAT  263
+#define OPT_DEDUP       264
+#define OPT_SORT        265
+#define OPT_SAMPLE      266
+#define OPT_COUNT       267
+#define OPT_SPLIT       268
+#define OPT_SPLIT_PREFIX 269
+#define OPT_GZIP        270
+#define OPT_SHARD       271
+#define OPT_TAIL        272
+#define OPT_BAM         273
+#define OPT_SQC         274
+#define OPT_TWOBIT      275
+#define OPT_REGION      276
+
 static struct option longopts[] =
 {
   {"help",       no_argument,       NULL, 'h'},
@@ -79,18 +155,52 @@ static struct option longopts[] =
   {"stat",       no_argument,       NULL, 's'},
   {"fast-stat",  no_argument,       NULL, 'S'},
   {"rename",     required_argument, NULL, 'M'},
+  {"threads",    required_argument, NULL, 't'},
+  {"min-len",    required_argument, NULL, OPT_MIN_LEN},
+  {"max-len",    required_argument, NULL, OPT_MAX_LEN},
+  {"name-prefix",required_argument, NULL, OPT_NAME_PREFIX},
+  {"repair",     no_argument,       NULL, OPT_REPAIR},
+  {"mem",        required_argument, NULL, OPT_MEM},
+  {"seed",       required_argument, NULL, OPT_SEED},
+  {"tile",       required_argument, NULL, OPT_TILE},
+  {"dedup",      no_argument,       NULL, OPT_DEDUP},
+  {"sort",       required_argument, NULL, OPT_SORT},
+  {"sample",     required_argument, NULL, OPT_SAMPLE},
+  {"count",      no_argument,       NULL, OPT_COUNT},
+  {"split",      required_argument, NULL, OPT_SPLIT},
+  {"split-prefix",required_argument, NULL, OPT_SPLIT_PREFIX},
+  {"gzip",       no_argument,       NULL, OPT_GZIP},
+  {"shard",      required_argument, NULL, OPT_SHARD},
+  {"tail",       required_argument, NULL, OPT_TAIL},
+  {"bam",        no_argument,       NULL, OPT_BAM},
+  {"sqc",        no_argument,       NULL, OPT_SQC},
+  {"2bit",       no_argument,       NULL, OPT_TWOBIT},
+  {"region",     required_argument, NULL, OPT_REGION},
+  {"rename-pattern",required_argument, NULL, OPT_RENAME_PAT},
   {NULL, 0, NULL, 0}
 };
 
-const char shortopts[] = "hFQPw:ulrRCimn:NLsSM:";
+const char shortopts[] = "hFQPw:ulrRCimn:NLsSM:t:";
 const char *cmdstr;
 
 const char bases[] = "ACGT";
 
-#define die(fmt,...) do { \
-  fprintf(stderr, "[%s:%i] Error: %s() "fmt"\n", __FILE__, __LINE__, __func__, __VA_ARGS__); \
-  exit(EXIT_FAILURE); \
-} while(0)
+#define die(...) die_(__func__, __LINE__, __VA_ARGS__)
+
+void die_(const char *func, int line, const char *fmt, ...)
+__attribute__((noreturn))
+__attribute__((format(printf, 3, 4)));
+
+void die_(const char *func, int line, const char *fmt, ...)
+{
+  va_list argptr;
+  fprintf(stderr, "[%s:%i] Error: %s() ", __FILE__, line, func);
+  va_start(argptr, fmt);
+  vfprintf(stderr, fmt, argptr);
+  va_end(argptr);
+  fputc('\n', stderr);
+  exit(EXIT_FAILURE);
+}
 
 #define inpathstr(p) (strcmp(p,"-") == 0 ? "STDIN" : p)
 
@@ -105,239 +215,1977 @@ char parse_entire_size(const char *str, size_t *result)
   return 1;
 }
 
-size_t num_of_digits(size_t num)
+// Parse <len>[:<step>] for --tile, step defaults to 1
+char parse_tile(const char *str, size_t *len, size_t *step)
+{
+  char tmp[32];
+  const char *colon = strchr(str, ':');
+  size_t n = colon ? (size_t)(colon - str) : strlen(str);
+  if(n >= sizeof(tmp)) return 0;
+  memcpy(tmp, str, n);
+  tmp[n] = '\0';
+  *step = 1;
+  return parse_entire_size(tmp, len) && *len &&
+         (!colon || (parse_entire_size(colon+1, step) && *step));
+}
+
+// Parse <i>/<n> for --shard, i < n
+char parse_shard(const char *str, size_t *i, size_t *n)
+{
+  char tmp[32];
+  const char *slash = strchr(str, '/');
+  size_t len = slash ? (size_t)(slash - str) : 0;
+  if(!slash || len >= sizeof(tmp)) return 0;
+  memcpy(tmp, str, len);
+  tmp[len] = '\0';
+  return parse_entire_size(tmp, i) && parse_entire_size(slash+1, n) && *i < *n;
+}
+
+// Parse <name>[:<start>-<end>] for --region, 1-based and inclusive. Cuts str
+// at the colon and sets [start,end) 0-based, or the whole sequence if there
+// are no coordinates.
+char parse_region(char *str, size_t *start, size_t *end)
+{
+  char tmp[32];
+  char *colon = strrchr(str, ':'), *dash;
+  size_t len;
+  *start = 0;
+  *end = SIZE_MAX;
+  if(!colon || (dash = strchr(colon, '-')) == NULL) return *str != '\0';
+  len = dash - colon - 1;
+  if(len >= sizeof(tmp)) return *str != '\0';
+  memcpy(tmp, colon+1, len);
+  tmp[len] = '\0';
+  // A name may contain a colon, only cut it if the rest is a range
+  if(!parse_entire_size(tmp, start) || !parse_entire_size(dash+1, end) ||
+     !*start || *start > *end) {
+    *start = 0;
+    *end = SIZE_MAX;
+    return *str != '\0';
+  }
+  (*start)--;
+  *colon = '\0';
+  return colon > str;
+}
+
+// Parse a size with an optional K,M,G suffix (powers of 1024)
+char parse_mem_size(const char *str, size_t *result)
+{
+  char *end = NULL;
+  if(*str < '0' || *str > '9') return 0;
+  unsigned long tmp = strtoul(str, &end, 10);
+  size_t shift = 0;
+  switch(toupper(*end)) {
+    case 'K': shift = 10; end++; break;
+    case 'M': shift = 20; end++; break;
+    case 'G': shift = 30; end++; break;
+  }
+  if(*end == 'B' || *end == 'b') end++;
+  if(*end != '\0' || tmp > (SIZE_MAX >> shift)) return 0;
+  *result = (size_t)tmp << shift;
+  return 1;
+}
+
+size_t num_of_digits(size_t num)
+{
+  size_t digits = 1;
+  while(1) {
+    if(num < 10) return digits;
+    if(num < 100) return digits+1;
+    if(num < 1000) return digits+2;
+    if(num < 10000) return digits+3;
+    num /= 10000;
+    digits += 4;
+  }
+  return digits;
+}
+
+// result must be long enough for result + 1 ('\0'). Max length required is:
+// strlen('18,446,744,073,709,551,615')+1 = 27
+// returns pointer to result
+char* ulong_to_str(unsigned long num, char* result)
+{
+  unsigned int digits = num_of_digits(num);
+  unsigned int i, num_commas = (digits-1) / 3;
+  char *p = result + digits + num_commas;
+  *(p--) = '\0';
+
+  for(i = 0; i < digits; i++, num /= 10) {
+    if(i > 0 && i % 3 == 0) *(p--) = ',';
+    *(p--) = '0' + (num % 10);
+  }
+
+  return result;
+}
+
+void print_usage(const char *err, ...)
+__attribute__((noreturn))
+__attribute__((format(printf, 1, 2)));
+
+void print_usage(const char *err, ...)
+{
+  if(err != NULL) {
+    fputc('\n', stderr);
+    va_list argptr;
+    fprintf(stderr, "Error: ");
+    va_start(argptr, err);
+    vfprintf(stderr, err, argptr);
+    va_end(argptr);
+    fputc('\n', stderr);
+    fputc('\n', stderr);
+  }
+
+  fprintf(stderr, "Usage: %s [OPTIONS] <file1> [file2] ..\n", cmdstr);
+  fputs(usage, stderr);
+
+  exit(EXIT_FAILURE);
+}
+
+// 2 ops per byte h = strhash_fast_mix(h,x)
+#define strhash_fast_mix(h,x) ((h) * 37 + (x))
+
+// Write decimal num to dst, returns pointer to the end. No '\\0' is added
+static inline char* write_size(char *dst, size_t num)
+{
+  size_t i, n = num_of_digits(num);
+  for(i = n; i > 0; i--, num /= 10) dst[i-1] = '0' + (num % 10);
+  return dst + n;
+}
+
+// Seed for --rand if --seed is not given
+static uint64_t time_seed()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  uint64_t h;
+  h = strhash_fast_mix(0, (uint64_t)now.tv_sec);
+  h = strhash_fast_mix(h, (uint64_t)now.tv_usec);
+  h = strhash_fast_mix(h, (uint64_t)getpid());
+  return h;
+}
+
+//
+// xoshiro256** random number generator, seeded with splitmix64
+// (http://prng.di.unimi.it)
+//
+typedef struct { uint64_t s[4]; } rng_t;
+
+static inline uint64_t splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline void rng_seed(rng_t *rng, uint64_t seed)
+{
+  rng->s[0] = splitmix64(&seed);
+  rng->s[1] = splitmix64(&seed);
+  rng->s[2] = splitmix64(&seed);
+  rng->s[3] = splitmix64(&seed);
+}
+
+#define rng_rotl(x,k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+static inline uint64_t rng_next(rng_t *rng)
+{
+  uint64_t *s = rng->s;
+  uint64_t result = rng_rotl(s[1] * 5, 7) * 9, t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rng_rotl(s[3], 45);
+  return result;
+}
+
+// Names for -M,--rename read from a file, or generated by --rename-pattern
+typedef struct
+{
+  FILE *fh; // -M file, read through `in`
+  StreamBuffer in;
+  const char *pattern; // --rename-pattern
+  size_t count; // names given so far
+  seq_buf_t buf;
+  const char *name; // current name, in buf
+  size_t len;
+} renamer_t;
+
+// Returns true if pattern only uses %n, %p and %%
+static bool rename_pattern_valid(const char *pattern)
+{
+  for(; *pattern; pattern++)
+    if(*pattern == '%' && (!*++pattern || !strchr("np%", *pattern)))
+      return false;
+  return true;
+}
+
+// Set rn->name to the next name for a FASTA/FASTQ entry
+// Returns false if not renaming or there are no more names
+static bool renamer_next(renamer_t *rn, seq_format fmt)
+{
+  const char *p;
+  size_t i;
+
+  if(fmt != SEQ_FMT_FASTA && fmt != SEQ_FMT_FASTQ &&
+     fmt != SEQ_FMT_BAM && fmt != SEQ_FMT_SQC &&
+     fmt != SEQ_FMT_TWOBIT) return false;
+
+  rn->buf.end = 0;
+  if(rn->fh) {
+    if(!freadline_buf(rn->fh, &rn->in, &rn->buf.b, &rn->buf.end, &rn->buf.size))
+      return false;
+    cbuf_chomp(rn->buf.b, &rn->buf.end);
+    // Skip @ or > char at beginning
+    i = (rn->buf.end && (rn->buf.b[0] == '>' || rn->buf.b[0] == '@'));
+  }
+  else if(rn->pattern) {
+    // %n is 1,2,3,4,... %p is 1,1,2,2,...
+    for(p = rn->pattern; *p; p++) {
+      cbuf_capacity(&rn->buf.b, &rn->buf.size, rn->buf.end + 21);
+      if(*p == '%' && p[1] != '%') {
+        i = *++p == 'n' ? rn->count + 1 : rn->count / 2 + 1;
+        rn->buf.end = write_size(rn->buf.b + rn->buf.end, i) - rn->buf.b;
+      }
+      else rn->buf.b[rn->buf.end++] = (*p == '%' ? *++p : *p);
+    }
+    rn->buf.b[rn->buf.end] = '\0';
+    i = 0;
+  }
+  else return false;
+
+  rn->count++;
+  rn->name = rn->buf.b + i;
+  rn->len = rn->buf.end - i;
+  return true;
+}
+
+// A transform plan folds masking, case conversion and complementing into
+// lookup tables, so each read is transformed in a single pass
+typedef struct
+{
+  uint8_t ops;
+  bool identity; // fwd[] doesn't change anything
+  char fwd[256]; // mask + change case
+  char cmp[256]; // fwd[] then complement if OPS_COMPLEMENT
+  char lfwd[256], lcmp[256]; // lowercase versions for --key comparison
+} xform_plan_t;
+
+static void xform_plan_init(xform_plan_t *plan, uint8_t ops)
+{
+  int i;
+  char c;
+  plan->ops = ops;
+  plan->identity = true;
+  for(i = 0; i < 256; i++) {
+    c = (char)i;
+    if(ops & OPS_MASK_LC) {
+      switch(c) {
+        case 'A': case 'C': case 'G': case 'T': break;
+        default: c = 'N';
+      }
+    }
+    if(ops & OPS_UPPERCASE)       c = (char)toupper(c);
+    else if(ops & OPS_LOWERCASE)  c = (char)tolower(c);
+    plan->fwd[i] = c;
+    plan->cmp[i] = (ops & OPS_COMPLEMENT) ? seq_char_complement(c) : c;
+    plan->lfwd[i] = (char)tolower(plan->fwd[i]);
+    plan->lcmp[i] = (char)tolower(plan->cmp[i]);
+    if(c != (char)i) plan->identity = false;
+  }
+}
+
+// Compare masked/case converted seq with its reverse/complement (--key)
+static int xform_key_cmp(const xform_plan_t *plan, const char *seq, size_t len)
+{
+  const uint8_t *s = (const uint8_t*)seq;
+  bool rev = (plan->ops & OPS_REVERSE);
+  size_t i, j;
+  int cmp;
+  for(i = 0, j = len-1; i < len; i++, j--) {
+    cmp = (int)plan->lfwd[s[i]] - plan->lcmp[s[rev ? j : i]];
+    if(cmp) return cmp;
+  }
+  return 0;
+}
+
+static void process_read(read_t *r, const xform_plan_t *plan)
+{
+  const char *tbl = plan->fwd;
+  uint8_t ops = plan->ops;
+  char *s = r->seq.b, *q = r->qual.b, tmp;
+  size_t i, j, len = r->seq.end;
+  bool rev = false, identity = plan->identity;
+
+  if(ops & (OPS_REVERSE | OPS_COMPLEMENT)) {
+    if(!(ops & OPS_KEY) || xform_key_cmp(plan, s, len) > 0) {
+      tbl = plan->cmp;
+      rev = (ops & OPS_REVERSE);
+      identity = identity && !(ops & OPS_COMPLEMENT);
+    }
+  }
+
+  if(rev) {
+    if(r->qual.end > 0) { _seq_read_force_qual_seq_lmatch(r); q = r->qual.b; }
+    if(len == 0) return;
+    for(i = 0, j = len-1; i < j; i++, j--) {
+      tmp = s[i];
+      s[i] = tbl[(uint8_t)s[j]];
+      s[j] = tbl[(uint8_t)tmp];
+      if(r->qual.end) { tmp = q[i]; q[i] = q[j]; q[j] = tmp; }
+    }
+    if(i == j) s[i] = tbl[(uint8_t)s[i]];
+  }
+  else if(!identity) {
+    for(i = 0; i < len; i++) s[i] = tbl[(uint8_t)s[i]];
+  }
+}
+
+// Output is flushed to stdout once this many bytes are buffered
+#define OUT_FLUSH_BYTES (1UL<<20)
+
+// With --bam, output is compressed into BGZF blocks before going to stdout
+static seq_bgzf_writer_t *bam_out = NULL;
+
+// With --sqc, reads are written to a container rather than printed
+static seq_sqc_writer_t *sqc_out = NULL;
+
+// With --2bit, reads are packed in memory and written at the end
+static seq_twobit_writer_t *twobit_out = NULL;
+
+static void out_flush(StreamBuffer *out)
+{
+  if(out->end == 0) return;
+  if(bam_out) {
+    swrite_buf(seq_bgzf_writer_buf(bam_out), out->b, out->end);
+    seq_bgzf_writer_update(bam_out);
+    if(bam_out->status < 0) die("Cannot write to stdout: %s", strerror(errno));
+  }
+  else if(fwrite(out->b, 1, out->end, stdout) != out->end)
+    die("Cannot write to stdout: %s", strerror(errno));
+  out->end = 0;
+}
+
+// Pick the output format from the first read
+static seq_format read_out_fmt(seq_file_t *sf, seq_format fmt, uint8_t ops)
+{
+  if(fmt == SEQ_FMT_UNKNOWN) {
+    // default to plain format is printing names only with no fmt specified
+    if(ops & OPS_NAME_ONLY) fmt = SEQ_FMT_PLAIN;
+    else if(seq_is_plain(sf)) fmt = SEQ_FMT_PLAIN;
+    else if(seq_is_fasta(sf)) fmt = SEQ_FMT_FASTA;
+    else fmt = SEQ_FMT_FASTQ;
+  }
+  return fmt;
+}
+
+// Overwrite read name with the next name from --rename
+static void read_rename(read_t *r, seq_format fmt, renamer_t *rn)
+{
+  if(renamer_next(rn, fmt)) {
+    cbuf_capacity(&r->name.b, &r->name.size, rn->len);
+    memcpy(r->name.b, rn->name, rn->len);
+    r->name.b[r->name.end = rn->len] = '\0';
+  }
+}
+
+// Append a read to the output buffer
+static void read_sprint(const read_t *r, seq_format fmt, uint8_t ops,
+                        size_t linewrap, StreamBuffer *out)
+{
+  char lenstr[32];
+
+  if(ops & OPS_NAME_ONLY) {
+    switch(fmt) {
+      case SEQ_FMT_FASTA: sputc_buf(out, '>'); break;
+      case SEQ_FMT_FASTQ: sputc_buf(out, '@'); break;
+      case SEQ_FMT_PLAIN: break;
+      default: die("Got value: %i\n", (int)fmt);
+    }
+    swrite_buf(out, r->name.b, r->name.end);
+    if(ops & OPS_PRINT_LENGTH) {
+      sprintf(lenstr, "\t%zu", r->seq.end);
+      sputs_buf(out, lenstr);
+    }
+    sputc_buf(out, '\n');
+  }
+  else {
+    switch(fmt) {
+      case SEQ_FMT_FASTA: seq_sprint_fasta(r, out, linewrap); break;
+      case SEQ_FMT_FASTQ: seq_sprint_fastq(r, out, linewrap); break;
+      case SEQ_FMT_PLAIN:
+        swrite_buf(out, r->seq.b, r->seq.end);
+        sputc_buf(out, '\n');
+        break;
+      case SEQ_FMT_BAM:
+        if(seq_sprint_ubam(r, out, 0) < 0)
+          die("Read name too long for BAM: %s", r->name.b);
+        break;
+      default: die("Got value: %i\n", (int)fmt);
+    }
+  }
+}
+
+// Transform, rename and buffer reads for stdout
+typedef struct
+{
+  const xform_plan_t *plan;
+  seq_format fmt; // must be set before printing
+  size_t linewrap;
+  renamer_t *rename;
+  StreamBuffer out;
+} printer_t;
+
+// Print a read that has already been transformed and renamed
+static void printer_write(printer_t *p, const read_t *r)
+{
+  if(p->fmt == SEQ_FMT_SQC) {
+    if(seq_sqc_write(sqc_out, r) < 0)
+      die("Cannot write to stdout: %s", strerror(errno));
+    return;
+  }
+  if(p->fmt == SEQ_FMT_TWOBIT) {
+    if(seq_twobit_write(twobit_out, r) < 0)
+      die("Read too long or name over 255 characters for .2bit: %s", r->name.b);
+    return;
+  }
+  read_sprint(r, p->fmt, p->plan->ops, p->linewrap, &p->out);
+  if(p->out.end >= OUT_FLUSH_BYTES) out_flush(&p->out);
+}
+
+static void printer_print(printer_t *p, read_t *r)
+{
+  process_read(r, p->plan);
+  read_rename(r, p->fmt, p->rename);
+  printer_write(p, r);
+}
+
+// Iterate over reads from all inputs, one after another or interleaved.
+// Two interleaved inputs are read as pairs with seq_pair_read(); reads left
+// over when one ends are still returned. With more, each input is read ahead
+// on its own thread.
+typedef struct
+{
+  seq_file_t **inputs;
+  seq_prefetch_t *prefetch;
+  seq_pair_reader_t *pair;
+  read_t mate; // second read of a pair, returned by the next call
+  bool has_mate;
+  size_t num_inputs, curr, waiting;
+  bool interleave;
+} input_iter_t;
+
+static void input_iter_init(input_iter_t *it, seq_file_t **inputs,
+                            size_t num_inputs, bool interleave, bool prefetch)
+{
+  size_t i;
+  it->inputs = inputs;
+  it->prefetch = NULL;
+  it->pair = NULL;
+  it->has_mate = false;
+  it->num_inputs = it->waiting = num_inputs;
+  it->curr = 0;
+  it->interleave = interleave;
+
+  if(prefetch && interleave && num_inputs == 2) {
+    if((it->pair = malloc(sizeof(seq_pair_reader_t))) == NULL ||
+       seq_read_alloc(&it->mate) == NULL) die("Out of memory");
+    if(seq_pair_open_sf(it->pair, inputs[0], inputs[1], false) < 0)
+      die("Cannot start reading: %s", inputs[0]->path);
+    it->pair->uneven = true;
+  }
+  else if(prefetch && interleave && num_inputs > 1) {
+    it->prefetch = malloc(num_inputs * sizeof(seq_prefetch_t));
+    if(!it->prefetch) die("Out of memory");
+    for(i = 0; i < num_inputs; i++)
+      if(seq_prefetch_start(&it->prefetch[i], inputs[i], 0, 0) < 0)
+        die("Cannot start reading: %s", inputs[i]->path);
+  }
+}
+
+// Returns the file the next read of a pair came from, NULL at the end
+static seq_file_t* input_iter_pair(input_iter_t *it, read_t *r)
+{
+  seq_file_t *sf;
+  read_t tmp;
+  int s;
+
+  if(!it->has_mate) {
+    s = seq_pair_read(it->pair, r, &it->mate);
+    if(s == 1 || s == SEQ_PAIR_ONLY1) {
+      it->has_mate = (s == 1);
+      return it->inputs[0];
+    }
+    if(s != SEQ_PAIR_ONLY2) {
+      if(s < 0) die("Error reading from: %s, %s", it->inputs[0]->path,
+                    it->inputs[1]->path);
+      seq_pair_close(it->pair);
+      free(it->pair);
+      it->pair = NULL;
+      seq_read_dealloc(&it->mate);
+      it->inputs[0] = it->inputs[1] = NULL;
+      it->waiting = 0;
+      return NULL;
+    }
+  }
+
+  sf = it->inputs[1];
+  tmp = *r; *r = it->mate; it->mate = tmp;
+  it->has_mate = false;
+  return sf;
+}
+
+// Move to the next read, only parsing it if `skip` is false
+// Returns the file the read came from, NULL once all inputs are finished
+static seq_file_t* input_iter_next(input_iter_t *it, read_t *r, bool skip)
+{
+  seq_file_t *sf;
+  size_t i;
+  int s;
+
+  if(it->pair) return input_iter_pair(it, r);
+
+  while(it->waiting) {
+    i = it->curr;
+    if(it->interleave) it->curr = (it->curr+1) % it->num_inputs;
+    if((sf = it->inputs[i]) == NULL) continue;
+    if(it->prefetch) s = seq_prefetch_read(&it->prefetch[i], r);
+    else s = skip ? seq_skip_read(sf, r) : seq_read(sf, r);
+    if(s > 0) return sf;
+    if(s < 0) die("Error reading from: %s\n", sf->path);
+    if(it->prefetch) seq_prefetch_stop(&it->prefetch[i]);
+    seq_close(sf);
+    it->inputs[i] = NULL;
+    it->waiting--;
+    if(!it->interleave) it->curr++;
+  }
+
+  free(it->prefetch);
+  it->prefetch = NULL;
+  return NULL;
+}
+
+#define input_iter_read(it,r) input_iter_next(it,r,false)
+
+//
+// Multi-threaded (-t): the main thread fills jobs, worker threads process
+// them into output buffers, and a writer thread prints the buffers in order.
+// Jobs embed job_t as their first member.
+//
+typedef struct
+{
+  size_t id;
+  StreamBuffer out;
+} job_t;
+
+typedef struct
+{
+  void (*work)(job_t *job, void *arg);
+  void *arg;
+  size_t nthreads, njobs, next_id;
+  pthread_t *workers, writer;
+  seq_queue_t pool, todo, done;
+} workpool_t;
+
+static void* workpool_worker(void *ptr)
+{
+  workpool_t *wp = (workpool_t*)ptr;
+  job_t *job;
+  while((job = seq_queue_pop(&wp->todo)) != NULL) {
+    wp->work(job, wp->arg);
+    seq_queue_push(&wp->done, job);
+  }
+  return NULL;
+}
+
+// Jobs can finish out of order. At most njobs are in flight, so job `id` is
+// held in slot id % njobs until all jobs before it are written.
+static void* workpool_writer(void *ptr)
+{
+  workpool_t *wp = (workpool_t*)ptr;
+  job_t *job, **pending = calloc(wp->njobs, sizeof(job_t*));
+  size_t next = 0;
+
+  if(!pending) die("Out of memory");
+
+  while((job = seq_queue_pop(&wp->done)) != NULL) {
+    pending[job->id % wp->njobs] = job;
+    while((job = pending[next % wp->njobs]) != NULL) {
+      pending[next % wp->njobs] = NULL;
+      out_flush(&job->out);
+      seq_queue_push(&wp->pool, job);
+      next++;
+    }
+  }
+
+  free(pending);
+  return NULL;
+}
+
+// `jobs` is an array of njobs jobs of jobsize bytes each
+static void workpool_start(workpool_t *wp, size_t nthreads,
+                           void *jobs, size_t njobs, size_t jobsize,
+                           void (*work)(job_t *job, void *arg), void *arg)
+{
+  size_t i;
+  int rc = 0;
+
+  wp->work = work;
+  wp->arg = arg;
+  wp->nthreads = nthreads;
+  wp->njobs = njobs;
+  wp->next_id = 0;
+
+  if((wp->workers = malloc(nthreads * sizeof(pthread_t))) == NULL ||
+     seq_queue_alloc(&wp->pool, njobs) < 0 ||
+     seq_queue_alloc(&wp->todo, njobs) < 0 ||
+     seq_queue_alloc(&wp->done, njobs) < 0) die("Out of memory");
+
+  for(i = 0; i < njobs; i++)
+    seq_queue_push(&wp->pool, (char*)jobs + i*jobsize);
+
+  for(i = 0; i < nthreads && rc == 0; i++)
+    rc = pthread_create(&wp->workers[i], NULL, workpool_worker, wp);
+  if(rc == 0) rc = pthread_create(&wp->writer, NULL, workpool_writer, wp);
+  if(rc != 0) die("Cannot create thread: %s", strerror(rc));
+}
+
+// Get a free job, blocks until one is available
+static job_t* workpool_get(workpool_t *wp)
+{
+  return seq_queue_pop(&wp->pool);
+}
+
+static void workpool_submit(workpool_t *wp, job_t *job)
+{
+  job->id = wp->next_id++;
+  seq_queue_push(&wp->todo, job);
+}
+
+// Wait for all jobs to be written
+static void workpool_finish(workpool_t *wp)
+{
+  size_t i;
+  seq_queue_close(&wp->todo);
+  for(i = 0; i < wp->nthreads; i++) pthread_join(wp->workers[i], NULL);
+  seq_queue_close(&wp->done);
+  pthread_join(wp->writer, NULL);
+  free(wp->workers);
+  seq_queue_dealloc(&wp->pool);
+  seq_queue_dealloc(&wp->todo);
+  seq_queue_dealloc(&wp->done);
+}
+
+// Reads are passed to workers in batches
+#define BATCH_NREADS 4096
+#define BATCH_NBYTES (1UL<<22)
+
+typedef struct
+{
+  job_t job;
+  read_t *reads;
+  size_t nreads, nalloc;
+  seq_format fmt;
+} read_batch_t;
+
+static void batch_work(job_t *job, void *arg)
+{
+  read_batch_t *b = (read_batch_t*)job;
+  const printer_t *p = (const printer_t*)arg;
+  size_t i;
+  for(i = 0; i < b->nreads; i++) {
+    process_read(&b->reads[i], p->plan);
+    read_sprint(&b->reads[i], b->fmt, p->plan->ops, p->linewrap, &job->out);
+  }
+}
+
+// Returns format used
+static seq_format pipeline_run(input_iter_t *it, printer_t *printer,
+                               size_t nthreads)
+{
+  workpool_t wp;
+  read_batch_t *batches, *b;
+  read_t *r;
+  seq_file_t *sf;
+  size_t i, nbytes, nbatches = 4*nthreads;
+  bool more = true;
+
+  if((batches = calloc(nbatches, sizeof(read_batch_t))) == NULL)
+    die("Out of memory");
+
+  for(i = 0; i < nbatches; i++)
+    if((batches[i].reads = malloc(BATCH_NREADS * sizeof(read_t))) == NULL)
+      die("Out of memory");
+
+  workpool_start(&wp, nthreads, batches, nbatches, sizeof(read_batch_t),
+                 batch_work, printer);
+
+  // Reader stage: format detection and --rename happen here, in input order
+  while(more) {
+    b = (read_batch_t*)workpool_get(&wp);
+    for(b->nreads = nbytes = 0;
+        b->nreads < BATCH_NREADS && nbytes < BATCH_NBYTES;
+        b->nreads++)
+    {
+      r = &b->reads[b->nreads];
+      if(b->nreads == b->nalloc) {
+        if(seq_read_alloc(r) == NULL) die("Out of memory");
+        b->nalloc++;
+      }
+      if((sf = input_iter_read(it, r)) == NULL) { more = false; break; }
+      printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
+      read_rename(r, printer->fmt, printer->rename);
+      nbytes += r->name.end + r->seq.end + r->qual.end;
+    }
+    b->fmt = printer->fmt;
+    workpool_submit(&wp, &b->job);
+  }
+
+  workpool_finish(&wp);
+
+  for(i = 0; i < nbatches; i++) {
+    b = &batches[i];
+    while(b->nalloc) seq_read_dealloc(&b->reads[--b->nalloc]);
+    free(b->reads);
+    free(b->job.out.b);
+  }
+  free(batches);
+
+  return printer->fmt;
+}
+
+//
+// --repair: pair up mates from two inputs that are not in the same order.
+// Unmatched reads are held in a hash table keyed on their name key. Once the
+// table uses more than mem_limit bytes it is spilled to temporary files,
+// partitioned by hash, and the partitions are paired up at the end under the
+// same limit. A partition that still fills is split on the next 6 bits.
+//
+#define REPAIR_NPARTS 64
+#define REPAIR_MAXDEPTH 10 /* 6-bit slices of a 64-bit hash */
+#define REPAIR_PART(h,d) (((h) >> (58 - 6*(d))) & 63)
+
+typedef struct repair_ent_st
+{
+  read_t r;
+  uint64_t hash;
+  size_t keylen, nbytes;
+  int side;
+  struct repair_ent_st *next;
+} repair_ent_t;
+
+typedef struct
+{
+  repair_ent_t **buckets, *free_ents;
+  size_t nbuckets, nents, mem, mem_limit;
+  FILE *parts[2][REPAIR_NPARTS];
+  unsigned depth; // hash slice that parts are split on
+  bool spilled;
+  printer_t *printer;
+} repair_t;
+
+static void repair_alloc(repair_t *rp, printer_t *printer, size_t mem_limit)
+{
+  memset(rp, 0, sizeof(repair_t));
+  rp->nbuckets = 1024;
+  rp->buckets = calloc(rp->nbuckets, sizeof(repair_ent_t*));
+  if(!rp->buckets) die("Out of memory");
+  rp->mem_limit = mem_limit;
+  rp->printer = printer;
+}
+
+static void repair_free_ents(repair_t *rp)
+{
+  repair_ent_t *e;
+  while((e = rp->free_ents) != NULL) {
+    rp->free_ents = e->next;
+    seq_read_dealloc(&e->r);
+    free(e);
+  }
+}
+
+static void repair_dealloc(repair_t *rp)
+{
+  size_t i;
+  repair_ent_t *e;
+  for(i = 0; i < rp->nbuckets; i++) {
+    while((e = rp->buckets[i]) != NULL) {
+      rp->buckets[i] = e->next;
+      e->next = rp->free_ents;
+      rp->free_ents = e;
+    }
+  }
+  repair_free_ents(rp);
+  free(rp->buckets);
+}
+
+static void repair_grow(repair_t *rp)
+{
+  size_t i, n = rp->nbuckets*2;
+  repair_ent_t **buckets = calloc(n, sizeof(repair_ent_t*)), *e, *next;
+  if(!buckets) die("Out of memory");
+  for(i = 0; i < rp->nbuckets; i++) {
+    for(e = rp->buckets[i]; e != NULL; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash & (n-1)];
+      buckets[e->hash & (n-1)] = e;
+    }
+  }
+  free(rp->buckets);
+  rp->buckets = buckets;
+  rp->nbuckets = n;
+}
+
+// Empty the hash table, passing each entry to fh (if not NULL) or to the
+// partition files. Entries are moved to the free list.
+static void repair_drain(repair_t *rp, FILE *fh)
+{
+  size_t i;
+  repair_ent_t *e;
+  FILE **out;
+
+  for(i = 0; i < rp->nbuckets; i++) {
+    while((e = rp->buckets[i]) != NULL) {
+      rp->buckets[i] = e->next;
+      if(fh) out = &fh;
+      else {
+        out = &rp->parts[e->side][REPAIR_PART(e->hash, rp->depth)];
+        if(*out == NULL && (*out = tmpfile()) == NULL)
+          die("Cannot create temporary file: %s", strerror(errno));
+      }
+      if(seq_print_fastq(&e->r, *out, 0) != 0)
+        die("Cannot write temporary file: %s", strerror(errno));
+      e->next = rp->free_ents;
+      rp->free_ents = e;
+    }
+  }
+
+  rp->nents = rp->mem = 0;
+}
+
+// Rewind a temporary file and open it for reading. Closes fh.
+static seq_file_t* tmpfile_reopen(FILE *fh)
+{
+  seq_file_t *sf;
+  int fd;
+  if(fflush(fh) != 0 || (fd = dup(fileno(fh))) < 0)
+    die("Cannot read temporary file: %s", strerror(errno));
+  fclose(fh);
+  if(lseek(fd, 0, SEEK_SET) < 0 || (sf = seq_dopen(fd, 0, false, 1<<20)) == NULL)
+    die("Cannot read temporary file: %s", strerror(errno));
+  return sf;
+}
+
+// Print r with its mate if we have seen it, otherwise store it
+static void repair_add(repair_t *rp, read_t *r, int side)
+{
+  size_t keylen = seq_read_name_keylen(r->name.b);
+  uint64_t h = seq_read_name_hash(r->name.b, keylen);
+  repair_ent_t **ptr = &rp->buckets[h & (rp->nbuckets-1)], *e;
+  read_t tmp;
+
+  for(; (e = *ptr) != NULL; ptr = &e->next) {
+    if(e->side != side && e->hash == h && e->keylen == keylen &&
+       memcmp(e->r.name.b, r->name.b, keylen) == 0)
+    {
+      *ptr = e->next;
+      printer_print(rp->printer, side ? &e->r : r);
+      printer_print(rp->printer, side ? r : &e->r);
+      rp->nents--;
+      rp->mem -= e->nbytes;
+      e->next = rp->free_ents;
+      rp->free_ents = e;
+      return;
+    }
+  }
+
+  if((e = rp->free_ents) != NULL) rp->free_ents = e->next;
+  else if((e = malloc(sizeof(repair_ent_t))) == NULL ||
+          seq_read_alloc(&e->r) == NULL) die("Out of memory");
+
+  // Take r's buffers, give it the entry's old ones
+  tmp = e->r; e->r = *r; *r = tmp;
+  e->hash = h;
+  e->keylen = keylen;
+  e->side = side;
+  e->nbytes = sizeof(repair_ent_t) + e->r.name.size + e->r.seq.size + e->r.qual.size;
+  e->next = rp->buckets[h & (rp->nbuckets-1)];
+  rp->buckets[h & (rp->nbuckets-1)] = e;
+  rp->nents++;
+  rp->mem += e->nbytes;
+
+  if(rp->mem > rp->mem_limit) {
+    repair_drain(rp, NULL);
+    repair_free_ents(rp);
+    rp->spilled = true;
+  }
+  else if(rp->nents > rp->nbuckets) repair_grow(rp);
+}
+
+// Pair up the partitions in rp->parts, splitting any that don't fit in
+// mem_limit on the next hash slice. Unpaired reads are written to orphans.
+static void repair_parts(repair_t *rp, read_t *r, size_t mem_limit,
+                         FILE *orphans)
+{
+  FILE *parts[2][REPAIR_NPARTS];
+  unsigned depth = rp->depth + 1;
+  seq_file_t *sf;
+  size_t i;
+  int side, s;
+
+  memcpy(parts, rp->parts, sizeof(parts));
+  memset(rp->parts, 0, sizeof(rp->parts));
+
+  for(i = 0; i < REPAIR_NPARTS; i++) {
+    rp->depth = depth;
+    rp->spilled = false;
+    // Hashes have no bits left to split on past REPAIR_MAXDEPTH
+    rp->mem_limit = depth < REPAIR_MAXDEPTH ? mem_limit : SIZE_MAX;
+    for(side = 0; side < 2; side++) {
+      if(parts[side][i] == NULL) continue;
+      sf = tmpfile_reopen(parts[side][i]);
+      while((s = seq_read(sf, r)) > 0) repair_add(rp, r, side);
+      if(s < 0) die("Cannot read temporary file");
+      seq_close(sf);
+    }
+    if(rp->spilled) {
+      repair_drain(rp, NULL);
+      repair_parts(rp, r, mem_limit, orphans);
+    }
+    else repair_drain(rp, orphans);
+  }
+}
+
+// Pairs are printed as soon as both mates are seen, orphans at the end
+// Returns format used
+static seq_format repair_run(input_iter_t *it, printer_t *printer,
+                             size_t mem_limit)
+{
+  seq_file_t *sf, *sides[2] = {it->inputs[0], it->inputs[1]};
+  repair_ent_t *e;
+  FILE *orphans;
+  repair_t rp;
+  read_t r;
+  size_t i;
+  int s;
+
+  if(seq_read_alloc(&r) == NULL) die("Out of memory");
+  repair_alloc(&rp, printer, mem_limit);
+
+  while((sf = input_iter_read(it, &r)) != NULL) {
+    printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
+    repair_add(&rp, &r, sf == sides[1]);
+  }
+
+  if(!rp.spilled) {
+    for(i = 0; i < rp.nbuckets; i++)
+      for(e = rp.buckets[i]; e != NULL; e = e->next)
+        printer_print(printer, &e->r);
+  }
+  else {
+    // Pair up each partition in memory, collecting orphans
+    repair_drain(&rp, NULL);
+    if((orphans = tmpfile()) == NULL)
+      die("Cannot create temporary file: %s", strerror(errno));
+    repair_parts(&rp, &r, mem_limit, orphans);
+    sf = tmpfile_reopen(orphans);
+    while((s = seq_read(sf, &r)) > 0) printer_print(printer, &r);
+    if(s < 0) die("Cannot read temporary file");
+    seq_close(sf);
+  }
+
+  repair_dealloc(&rp);
+  seq_read_dealloc(&r);
+  return printer->fmt;
+}
+
+//
+// --dedup: drop reads (or pairs with -i) whose sequence has been seen before.
+// Fingerprints are held in memory up to mem_limit; after that, reads not
+// already seen are spilled to temporary files partitioned by fingerprint, and
+// each partition is deduplicated at the end under the same limit. A partition
+// that still fills is re-partitioned on the next 6 bits of the fingerprint.
+// Spilled reads are printed last.
+//
+#define DEDUP_NPARTS 64
+#define DEDUP_MAXDEPTH 10 /* 6-bit slices of a 64-bit fingerprint */
+#define DEDUP_PART(h,d) (((h) >> (58 - 6*(d))) & 63)
+
+static void dedup_spill(FILE **parts, uint64_t h, unsigned depth,
+                        read_t *r, size_t nreads)
+{
+  FILE **out = &parts[DEDUP_PART(h, depth)];
+  size_t i;
+  if(*out == NULL && (*out = tmpfile()) == NULL)
+    die("Cannot create temporary file: %s", strerror(errno));
+  for(i = 0; i < nreads; i++)
+    if(seq_print_fastq(&r[i], *out, 0) != 0)
+      die("Cannot write temporary file: %s", strerror(errno));
+}
+
+// Deduplicate partitions spilled on slice depth-1, re-partitioning on slice
+// `depth` any that do not fit in mem_limit. Returns number of reads printed.
+static size_t dedup_parts(FILE **parts, unsigned depth, printer_t *printer,
+                          size_t mem_limit, bool paired, bool canonical,
+                          read_t *r)
+{
+  size_t i, j, nreads = paired ? 2 : 1, nout = 0;
+  FILE *sub[DEDUP_NPARTS];
+  seq_dedup_t dd;
+  seq_file_t *sf;
+  uint64_t h;
+  int s;
+
+  // Duplicates share a fingerprint and so a partition
+  for(i = 0; i < DEDUP_NPARTS; i++) {
+    if(parts[i] == NULL) continue;
+    memset(sub, 0, sizeof(sub));
+    // Fingerprints have no bits left to split on past DEDUP_MAXDEPTH
+    if(seq_dedup_alloc(&dd, depth < DEDUP_MAXDEPTH ? mem_limit : 0) < 0)
+      die("Out of memory");
+    sf = tmpfile_reopen(parts[i]);
+    while((s = seq_read(sf, &r[0])) > 0 &&
+          (!paired || (s = seq_read(sf, &r[1])) > 0)) {
+      h = paired ? seq_dedup_hash_pair(&r[0], &r[1], canonical)
+                 : seq_dedup_hash(&r[0], canonical);
+      if((s = seq_dedup_add(&dd, h)) == SEQ_DEDUP_FULL)
+        dedup_spill(sub, h, depth, r, nreads);
+      else if(s) {
+        for(j = 0; j < nreads; j++) printer_print(printer, &r[j]);
+        nout += nreads;
+      }
+    }
+    if(s < 0) die("Cannot read temporary file");
+    seq_close(sf);
+    seq_dedup_dealloc(&dd);
+    nout += dedup_parts(sub, depth+1, printer, mem_limit, paired, canonical, r);
+  }
+  return nout;
+}
+
+// Returns format used
+static seq_format dedup_run(input_iter_t *it, printer_t *printer,
+                            size_t mem_limit, bool paired)
+{
+  bool canonical = (printer->plan->ops & OPS_KEY);
+  size_t j, nreads = paired ? 2 : 1, nin = 0, nout = 0;
+  FILE *parts[DEDUP_NPARTS] = {NULL};
+  seq_dedup_t dd;
+  seq_file_t *sf;
+  read_t r[2];
+  uint64_t h;
+  int s;
+
+  if(seq_read_alloc(&r[0]) == NULL || seq_read_alloc(&r[1]) == NULL ||
+     seq_dedup_alloc(&dd, mem_limit) < 0) die("Out of memory");
+
+  while((sf = input_iter_read(it, &r[0])) != NULL) {
+    printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
+    if(paired && input_iter_read(it, &r[1]) == NULL)
+      die("Odd number of reads in: %s", sf->path);
+    h = paired ? seq_dedup_hash_pair(&r[0], &r[1], canonical)
+               : seq_dedup_hash(&r[0], canonical);
+    nin += nreads;
+    if((s = seq_dedup_add(&dd, h)) == SEQ_DEDUP_FULL)
+      dedup_spill(parts, h, 0, r, nreads);
+    else if(s) {
+      for(j = 0; j < nreads; j++) printer_print(printer, &r[j]);
+      nout += nreads;
+    }
+  }
+
+  seq_dedup_dealloc(&dd);
+  nout += dedup_parts(parts, 1, printer, mem_limit, paired, canonical, r);
+
+  fprintf(stderr, "[dnacat] --dedup: kept %zu of %zu reads\n", nout, nin);
+
+  seq_read_dealloc(&r[0]);
+  seq_read_dealloc(&r[1]);
+  return printer->fmt;
+}
+
+//
+// --sort: reads are packed into arenas that share mem_limit. A full arena is
+// sorted and written to a temporary file as a run of binary records, on a
+// worker thread with -t. Runs are then merged with a loser tree. Sorting is
+// stable: reads that compare equal stay in input order.
+//
+#define SORT_NAME 1
+#define SORT_SEQ  2
+#define SORT_LEN  3
+#define SORT_MAX_MERGE 128 /* max runs merged at once */
+#define SORT_RUN_BUF (1UL<<18) /* read/write buffer for each run */
+
+typedef struct
+{
+  size_t off, nlen, slen, qlen, idx; // off is position in arena
+  const char *name, *seq, *qual; // set before sorting
+} sort_rec_t;
+
+static int sort_cmp_name(const sort_rec_t *a, const sort_rec_t *b)
+{
+  return seq_read_names_cmp(a->name, b->name);
+}
+
+static int sort_cmp_seq(const sort_rec_t *a, const sort_rec_t *b)
+{
+  int c = memcmp(a->seq, b->seq, a->slen < b->slen ? a->slen : b->slen);
+  return c ? c : (a->slen > b->slen) - (a->slen < b->slen);
+}
+
+static int sort_cmp_len(const sort_rec_t *a, const sort_rec_t *b)
+{
+  return (a->slen > b->slen) - (a->slen < b->slen);
+}
+
+static int (*const sort_cmps[])(const sort_rec_t*, const sort_rec_t*)
+  = {NULL, sort_cmp_name, sort_cmp_seq, sort_cmp_len};
+
+// qsort() comparators break ties on input order
+#define sort_qcmp(fname,cmp)                                                   \
+  static int fname(const void *aa, const void *bb) {                           \
+    const sort_rec_t *a = (const sort_rec_t*)aa, *b = (const sort_rec_t*)bb;   \
+    int c = cmp(a, b);                                                         \
+    return c ? c : (a->idx > b->idx) - (a->idx < b->idx);                      \
+  }
+
+sort_qcmp(sort_qcmp_name, sort_cmp_name)
+sort_qcmp(sort_qcmp_seq,  sort_cmp_seq)
+sort_qcmp(sort_qcmp_len,  sort_cmp_len)
+
+#undef sort_qcmp
+
+static int (*const sort_qcmps[])(const void*, const void*)
+  = {NULL, sort_qcmp_name, sort_qcmp_seq, sort_qcmp_len};
+
+typedef struct
+{
+  char *b; // name\0seq\0qual\0 for each read
+  size_t size, end;
+  sort_rec_t *recs;
+  size_t nrecs, cap;
+  size_t run; // run number this arena is written as
+  FILE *fh; // run written by a worker, collected by the main thread
+} sort_arena_t;
+
+typedef struct
+{
+  int mode;
+  size_t arena_bytes, nthreads, nreads;
+  sort_arena_t *arenas, *curr;
+  size_t narenas;
+  seq_queue_t todo, free;
+  pthread_t *workers;
+  FILE **runs;
+  size_t nruns, runs_cap;
+} sorter_t;
+
+// Returns false if the arena is full
+static bool sort_arena_add(sort_arena_t *a, const read_t *r, size_t idx,
+                           size_t max_bytes)
+{
+  size_t need = r->name.end + r->seq.end + r->qual.end + 3, size;
+  sort_rec_t *rec;
+
+  if(a->nrecs && a->end + need + (a->nrecs+1) * sizeof(sort_rec_t) > max_bytes)
+    return false;
+
+  if(a->end + need > a->size) {
+    size = a->size * 2 < max_bytes ? a->size * 2 : max_bytes;
+    if(size < a->end + need) size = a->end + need;
+    if((a->b = realloc(a->b, size)) == NULL) die("Out of memory");
+    a->size = size;
+  }
+  if(a->nrecs == a->cap) {
+    a->cap = a->cap ? a->cap * 2 : 1024;
+    if((a->recs = realloc(a->recs, a->cap * sizeof(sort_rec_t))) == NULL)
+      die("Out of memory");
+  }
+
+  rec = &a->recs[a->nrecs++];
+  rec->off = a->end;
+  rec->nlen = r->name.end;
+  rec->slen = r->seq.end;
+  rec->qlen = r->qual.end;
+  rec->idx = idx;
+  memcpy(a->b + a->end, r->name.b, r->name.end + 1);
+  a->end += r->name.end + 1;
+  memcpy(a->b + a->end, r->seq.b, r->seq.end + 1);
+  a->end += r->seq.end + 1;
+  memcpy(a->b + a->end, r->qual.b, r->qual.end + 1);
+  a->end += r->qual.end + 1;
+  return true;
+}
+
+static void sort_arena_sort(sort_arena_t *a, int mode)
+{
+  sort_rec_t *rec;
+  size_t i;
+  for(i = 0; i < a->nrecs; i++) {
+    rec = &a->recs[i];
+    rec->name = a->b + rec->off;
+    rec->seq = rec->name + rec->nlen + 1;
+    rec->qual = rec->seq + rec->slen + 1;
+  }
+  qsort(a->recs, a->nrecs, sizeof(sort_rec_t), sort_qcmps[mode]);
+}
+
+static FILE* sort_run_new()
+{
+  FILE *fh = tmpfile();
+  if(fh == NULL) die("Cannot create temporary file: %s", strerror(errno));
+  setvbuf(fh, NULL, _IOFBF, SORT_RUN_BUF);
+  return fh;
+}
+
+// Record lengths are written as varints
+static void sort_put_size(FILE *fh, size_t x)
+{
+  for(; x >= 128; x >>= 7) fputc((int)((x & 127) | 128), fh);
+  fputc((int)x, fh);
+}
+
+static bool sort_get_size(FILE *fh, size_t *x)
+{
+  size_t shift = 0;
+  int c;
+  *x = 0;
+  do {
+    if((c = fgetc(fh)) == EOF) return false;
+    *x |= (size_t)(c & 127) << shift;
+    shift += 7;
+  } while(c & 128);
+  return true;
+}
+
+static void sort_put_rec(FILE *fh, const sort_rec_t *rec)
+{
+  sort_put_size(fh, rec->nlen);
+  sort_put_size(fh, rec->slen);
+  sort_put_size(fh, rec->qlen);
+  fwrite(rec->name, 1, rec->nlen, fh);
+  fwrite(rec->seq, 1, rec->slen, fh);
+  if(fwrite(rec->qual, 1, rec->qlen, fh) != rec->qlen)
+    die("Cannot write temporary file: %s", strerror(errno));
+}
+
+// Sort an arena and write it to a new run, then empty it
+static void sort_arena_write(sort_arena_t *a, int mode)
+{
+  size_t i;
+  sort_arena_sort(a, mode);
+  a->fh = sort_run_new();
+  for(i = 0; i < a->nrecs; i++) sort_put_rec(a->fh, &a->recs[i]);
+  if(fflush(a->fh) != 0) die("Cannot write temporary file: %s", strerror(errno));
+  a->end = a->nrecs = 0;
+}
+
+static void* sort_worker(void *ptr)
+{
+  sorter_t *st = (sorter_t*)ptr;
+  sort_arena_t *a;
+  while((a = seq_queue_pop(&st->todo)) != NULL) {
+    sort_arena_write(a, st->mode);
+    seq_queue_push(&st->free, a);
+  }
+  return NULL;
+}
+
+static void sorter_alloc(sorter_t *st, int mode, size_t mem_limit,
+                         size_t nthreads)
+{
+  size_t i;
+  memset(st, 0, sizeof(sorter_t));
+  st->mode = mode;
+  st->nthreads = nthreads;
+  st->narenas = nthreads > 1 ? nthreads + 1 : 1;
+  st->arena_bytes = mem_limit / st->narenas;
+  st->arenas = calloc(st->narenas, sizeof(sort_arena_t));
+  if(!st->arenas) die("Out of memory");
+  st->curr = &st->arenas[0];
+
+  if(nthreads > 1) {
+    st->workers = malloc(nthreads * sizeof(pthread_t));
+    if(!st->workers ||
+       seq_queue_alloc(&st->todo, st->narenas) < 0 ||
+       seq_queue_alloc(&st->free, st->narenas) < 0) die("Out of memory");
+    for(i = 1; i < st->narenas; i++) seq_queue_push(&st->free, &st->arenas[i]);
+    for(i = 0; i < nthreads; i++)
+      if(pthread_create(&st->workers[i], NULL, sort_worker, st) != 0)
+        die("Cannot create thread");
+  }
+}
+
+// Take the run written from an arena
+static void sorter_collect(sorter_t *st, sort_arena_t *a)
+{
+  if(a->fh) { st->runs[a->run] = a->fh; a->fh = NULL; }
+}
+
+// Sort and write the current arena as the next run
+static void sorter_flush(sorter_t *st)
+{
+  if(st->nruns == st->runs_cap) {
+    st->runs_cap = st->runs_cap ? st->runs_cap * 2 : 64;
+    if((st->runs = realloc(st->runs, st->runs_cap * sizeof(FILE*))) == NULL)
+      die("Out of memory");
+  }
+  st->runs[st->nruns] = NULL;
+  st->curr->run = st->nruns++;
+
+  if(st->nthreads > 1) {
+    seq_queue_push(&st->todo, st->curr);
+    st->curr = seq_queue_pop(&st->free);
+    sorter_collect(st, st->curr);
+  } else {
+    sort_arena_write(st->curr, st->mode);
+    sorter_collect(st, st->curr);
+  }
+}
+
+static void sorter_add(sorter_t *st, const read_t *r)
+{
+  if(!sort_arena_add(st->curr, r, st->nreads, st->arena_bytes)) {
+    sorter_flush(st);
+    sort_arena_add(st->curr, r, st->nreads, st->arena_bytes);
+  }
+  st->nreads++;
+}
+
+// Stop workers and free arenas, keeping runs
+static void sorter_stop(sorter_t *st)
+{
+  size_t i;
+  if(st->nthreads > 1) {
+    seq_queue_close(&st->todo);
+    for(i = 0; i < st->nthreads; i++) pthread_join(st->workers[i], NULL);
+    seq_queue_dealloc(&st->todo);
+    seq_queue_dealloc(&st->free);
+    free(st->workers);
+  }
+  for(i = 0; i < st->narenas; i++) {
+    sorter_collect(st, &st->arenas[i]);
+    free(st->arenas[i].b);
+    free(st->arenas[i].recs);
+  }
+  free(st->arenas);
+  st->arenas = st->curr = NULL;
+}
+
+// A run being merged
+typedef struct
+{
+  FILE *fh;
+  read_t r;
+  sort_rec_t rec;
+  bool done;
+} sort_src_t;
+
+static void sort_src_next(sort_src_t *src)
+{
+  read_t *r = &src->r;
+  sort_rec_t *rec = &src->rec;
+
+  if(!sort_get_size(src->fh, &rec->nlen)) {
+    if(ferror(src->fh)) die("Cannot read temporary file: %s", strerror(errno));
+    src->done = true;
+    return;
+  }
+  if(!sort_get_size(src->fh, &rec->slen) || !sort_get_size(src->fh, &rec->qlen))
+    die("Cannot read temporary file");
+
+  cbuf_capacity(&r->name.b, &r->name.size, rec->nlen);
+  cbuf_capacity(&r->seq.b, &r->seq.size, rec->slen);
+  cbuf_capacity(&r->qual.b, &r->qual.size, rec->qlen);
+  if(fread(r->name.b, 1, rec->nlen, src->fh) != rec->nlen ||
+     fread(r->seq.b, 1, rec->slen, src->fh) != rec->slen ||
+     fread(r->qual.b, 1, rec->qlen, src->fh) != rec->qlen)
+    die("Cannot read temporary file");
+  r->name.b[r->name.end = rec->nlen] = '\0';
+  r->seq.b[r->seq.end = rec->slen] = '\0';
+  r->qual.b[r->qual.end = rec->qlen] = '\0';
+  rec->name = r->name.b;
+  rec->seq = r->seq.b;
+  rec->qual = r->qual.b;
+}
+
+// Returns true if source a is output before source b. Index n is a sentinel
+// that wins every game while the tree is built; finished sources lose.
+static inline bool sort_beats(const sort_src_t *srcs, size_t n, int mode,
+                              size_t a, size_t b)
+{
+  int c;
+  if(a == n || b == n) return a == n;
+  if(srcs[a].done || srcs[b].done) return !srcs[a].done;
+  c = sort_cmps[mode](&srcs[a].rec, &srcs[b].rec);
+  return c ? c < 0 : a < b;
+}
+
+// Replay games from leaf s to the root. tree[t] holds the loser at node t,
+// tree[0] the overall winner.
+static inline void sort_tree_adjust(size_t *tree, const sort_src_t *srcs,
+                                    size_t n, int mode, size_t s)
 {
-  size_t digits = 1;
-  while(1) {
-    if(num < 10) return digits;
-    if(num < 100) return digits+1;
-    if(num < 1000) return digits+2;
-    if(num < 10000) return digits+3;
-    num /= 10000;
-    digits += 4;
+  size_t t, tmp;
+  for(t = (s + n) / 2; t > 0; t /= 2) {
+    if(sort_beats(srcs, n, mode, tree[t], s)) {
+      tmp = s; s = tree[t]; tree[t] = tmp;
+    }
   }
-  return digits;
+  tree[0] = s;
 }
 
-// result must be long enough for result + 1 ('\0'). Max length required is:
-// strlen('18,446,744,073,709,551,615')+1 = 27
-// returns pointer to result
-char* ulong_to_str(unsigned long num, char* result)
+// Merge runs[0..n-1] into out_fh, or to the printer if out_fh is NULL.
+// Closes the runs.
+static void sort_merge(FILE **runs, size_t n, int mode,
+                       FILE *out_fh, printer_t *printer)
 {
-  unsigned int digits = num_of_digits(num);
-  unsigned int i, num_commas = (digits-1) / 3;
-  char *p = result + digits + num_commas;
-  *(p--) = '\0';
+  sort_src_t *srcs = calloc(n, sizeof(sort_src_t));
+  size_t i, w, *tree = calloc(n, sizeof(size_t));
 
-  for(i = 0; i < digits; i++, num /= 10) {
-    if(i > 0 && i % 3 == 0) *(p--) = ',';
-    *(p--) = '0' + (num % 10);
+  if(!srcs || !tree) die("Out of memory");
+
+  for(i = 0; i < n; i++) {
+    srcs[i].fh = runs[i];
+    if(seq_read_alloc(&srcs[i].r) == NULL) die("Out of memory");
+    rewind(srcs[i].fh);
+    sort_src_next(&srcs[i]);
+    tree[i] = n;
   }
 
-  return result;
-}
+  for(i = n; i > 0; i--) sort_tree_adjust(tree, srcs, n, mode, i-1);
 
-void print_usage(const char *err, ...)
-__attribute__((noreturn))
-__attribute__((format(printf, 1, 2)));
+  while(!srcs[w = tree[0]].done) {
+    if(out_fh) sort_put_rec(out_fh, &srcs[w].rec);
+    else printer_write(printer, &srcs[w].r);
+    sort_src_next(&srcs[w]);
+    sort_tree_adjust(tree, srcs, n, mode, w);
+  }
 
-void print_usage(const char *err, ...)
+  for(i = 0; i < n; i++) {
+    fclose(srcs[i].fh);
+    seq_read_dealloc(&srcs[i].r);
+  }
+  free(srcs);
+  free(tree);
+}
+
+// Returns format used
+static seq_format sort_run(input_iter_t *it, printer_t *printer, int mode,
+                           size_t mem_limit, size_t nthreads)
 {
-  if(err != NULL) {
-    fputc('\n', stderr);
-    va_list argptr;
-    fprintf(stderr, "Error: ");
-    va_start(argptr, err);
-    vfprintf(stderr, err, argptr);
-    va_end(argptr);
-    fputc('\n', stderr);
-    fputc('\n', stderr);
+  sorter_t st;
+  sort_arena_t *a;
+  seq_file_t *sf;
+  read_t r, view;
+  FILE *fh;
+  size_t i, j, n;
+
+  if(seq_read_alloc(&r) == NULL) die("Out of memory");
+  sorter_alloc(&st, mode, mem_limit, nthreads);
+
+  while((sf = input_iter_read(it, &r)) != NULL) {
+    printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
+    process_read(&r, printer->plan);
+    read_rename(&r, printer->fmt, printer->rename);
+    sorter_add(&st, &r);
   }
+  seq_read_dealloc(&r);
 
-  fprintf(stderr, "Usage: %s [OPTIONS] <file1> [file2] ..\n", cmdstr);
-  fputs(usage, stderr);
+  if(st.nruns == 0) {
+    // Everything fit in memory
+    a = st.curr;
+    sort_arena_sort(a, mode);
+    for(i = 0; i < a->nrecs; i++) {
+      view.name.b = (char*)a->recs[i].name; view.name.end = a->recs[i].nlen;
+      view.seq.b  = (char*)a->recs[i].seq;  view.seq.end  = a->recs[i].slen;
+      view.qual.b = (char*)a->recs[i].qual; view.qual.end = a->recs[i].qlen;
+      printer_write(printer, &view);
+    }
+    sorter_stop(&st);
+    return printer->fmt;
+  }
 
-  exit(EXIT_FAILURE);
+  if(st.curr->nrecs) sorter_flush(&st);
+  sorter_stop(&st);
+
+  // Merge groups of runs until few enough are left to merge at once
+  while(st.nruns > SORT_MAX_MERGE) {
+    for(i = j = 0; i < st.nruns; i += n, j++) {
+      n = st.nruns - i < SORT_MAX_MERGE ? st.nruns - i : SORT_MAX_MERGE;
+      fh = sort_run_new();
+      sort_merge(st.runs + i, n, mode, fh, NULL);
+      if(fflush(fh) != 0) die("Cannot write temporary file: %s", strerror(errno));
+      st.runs[j] = fh;
+    }
+    st.nruns = j;
+  }
+
+  sort_merge(st.runs, st.nruns, mode, NULL, printer);
+  free(st.runs);
+  return printer->fmt;
 }
 
-// 2 ops per byte h = strhash_fast_mix(h,x)
-#define strhash_fast_mix(h,x) ((h) * 37 + (x))
+//
+// --sample: keep each unit (a read, or one read from each input with -i)
+// with probability `fraction`, or keep `count` units chosen uniformly with a
+// reservoir. Either way the number of units to pass over before the next one
+// is kept is drawn up front, so passed over records are skipped by the parser
+// without being copied. Sampled units are printed in input order.
+//
 
-static void seed_random()
+// Uniform random number in (0,1]
+static inline double rng_unif(rng_t *rng)
 {
-  struct timeval now;
-  gettimeofday(&now, NULL);
-
-  uint32_t h;
-  h = strhash_fast_mix(0, (uint32_t)now.tv_sec);
-  h = strhash_fast_mix(h, (uint32_t)now.tv_usec);
-  h = strhash_fast_mix(h, (uint32_t)getpid());
-  srand(h);
+  return ((rng_next(rng) >> 11) + 1) * (1.0 / 9007199254740992.0);
 }
 
-// compare seq with the reverse complement of itself
-int dna_rc_ncasecmp(const char *seq, size_t len)
+// Number of failures before a success with probability p
+static size_t rng_geometric(rng_t *rng, double p)
 {
-  size_t i, j;
-  for(i = 0, j = len-1; i < len; i++, j--) {
-    int cmp = (int)tolower(seq[i]) - tolower(seq_char_complement(seq[j]));
-    if(cmp) return cmp;
-  }
-  return 0;
+  double g;
+  if(p >= 1) return 0;
+  g = floor(log(rng_unif(rng)) / log1p(-p));
+  return g < (double)SIZE_MAX ? (size_t)g : SIZE_MAX;
 }
 
-// compare seq with the reverse of itself
-int dna_r_ncasecmp(const char *seq, size_t len)
+// Skip n units, returns false at the end of input
+static bool sample_skip(input_iter_t *it, read_t *r, size_t n, size_t unit)
 {
   size_t i, j;
-  for(i = 0, j = len-1; i < len; i++, j--) {
-    int cmp = (int)tolower(seq[i]) - tolower(seq[j]);
-    if(cmp) return cmp;
-  }
-  return 0;
+  for(i = 0; i < n; i++)
+    for(j = 0; j < unit; j++)
+      if(input_iter_next(it, r, true) == NULL) return false;
+  return true;
 }
 
-// compare seq with the complement of itself
-int dna_c_ncasecmp(const char *seq, size_t len)
+// Read a unit into r[0..unit-1], returns false at the end of input
+static bool sample_read(input_iter_t *it, read_t *r, size_t unit,
+                        printer_t *printer)
 {
-  size_t i;
-  for(i = 0; i < len; i++) {
-    int cmp = (int)tolower(seq[i]) - tolower(seq_char_complement(seq[i]));
-    if(cmp) return cmp;
+  seq_file_t *sf;
+  size_t j;
+  for(j = 0; j < unit; j++) {
+    if((sf = input_iter_read(it, &r[j])) == NULL) return false;
+    printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
   }
-  return 0;
+  return true;
 }
 
-static inline bool _print_rename_hdr(FILE *rename_fh, seq_buf_t *rnbuf,
-                                     seq_format fmt)
+typedef struct
 {
-  if((fmt == SEQ_FMT_FASTA || fmt == SEQ_FMT_FASTQ) && rename_fh)
-  {
-    rnbuf->end = 0; rnbuf->b[0] = '\0';
-    if(!freadline(rename_fh, &rnbuf->b, &rnbuf->end, &rnbuf->size)) return false;
-    cbuf_chomp(rnbuf->b, &rnbuf->end);
+  read_t *r;
+  size_t idx;
+} sample_ent_t;
+
+static int sample_ent_cmp(const void *aa, const void *bb)
+{
+  const sample_ent_t *a = (const sample_ent_t*)aa, *b = (const sample_ent_t*)bb;
+  return (a->idx > b->idx) - (a->idx < b->idx);
+}
 
-    // Strip off @ or > char at beginning
-    if(rnbuf->end && (rnbuf->b[0] == '>' || rnbuf->b[0] == '@')) {
-      memmove(rnbuf->b, rnbuf->b+1, --rnbuf->end);
-      rnbuf->b[rnbuf->end] = '\0';
+// Returns format used
+static seq_format sample_run(input_iter_t *it, printer_t *printer,
+                             double fraction, size_t count, size_t unit,
+                             uint64_t seed)
+{
+  size_t i, j, n, nres = count ? count : 1;
+  sample_ent_t *res = calloc(nres, sizeof(sample_ent_t)), tmp;
+  read_t *reads = calloc((nres+1) * unit, sizeof(read_t)), *r;
+  double w;
+  rng_t rng;
+
+  if(!res || !reads) die("Out of memory");
+  for(i = 0; i < (nres+1) * unit; i++)
+    if(seq_read_alloc(&reads[i]) == NULL) die("Out of memory");
+  for(i = 0; i < nres; i++) res[i].r = &reads[i*unit];
+  r = &reads[nres*unit]; // next unit
+
+  rng_seed(&rng, seed);
+
+  if(!count) {
+    // Bernoulli sampling
+    while(sample_skip(it, r, rng_geometric(&rng, fraction), unit) &&
+          sample_read(it, r, unit, printer)) {
+      for(j = 0; j < unit; j++) printer_print(printer, &r[j]);
+    }
+  }
+  else {
+    // Reservoir sampling, Li's Algorithm L
+    for(n = 0; n < count && sample_read(it, res[n].r, unit, printer); n++)
+      res[n].idx = n;
+
+    if(n == count) {
+      w = exp(log(rng_unif(&rng)) / count);
+      while(1) {
+        i = rng_geometric(&rng, w);
+        if(!sample_skip(it, r, i, unit) || !sample_read(it, r, unit, printer))
+          break;
+        n += i;
+        // Swap into a random slot in the reservoir
+        j = rng_next(&rng) % count;
+        tmp = res[j];
+        res[j].r = r;
+        res[j].idx = n++;
+        r = tmp.r;
+        w *= exp(log(rng_unif(&rng)) / count);
+      }
     }
 
-    return true;
+    if(n > count) n = count;
+    qsort(res, n, sizeof(sample_ent_t), sample_ent_cmp);
+    for(i = 0; i < n; i++)
+      for(j = 0; j < unit; j++)
+        printer_print(printer, &res[i].r[j]);
   }
 
-  return false;
+  for(i = 0; i < (nres+1) * unit; i++) seq_read_dealloc(&reads[i]);
+  free(reads);
+  free(res);
+  return printer->fmt;
 }
 
-static void process_read(read_t *r, uint8_t ops)
+//
+// --split: write reads to numbered files <prefix><i>.<ext>[.gz]. A new file
+// is started every n reads or n bytes, or reads are spread over n files
+// round-robin or by a hash of the read name (so mates land together). With
+// -i one read from each input is a unit that always goes to one file. Files
+// are written and compressed by a pool of -t threads (seq_writer_pool_t),
+// with per-file buffers sized to keep all of them under SPLIT_MEM. The limit
+// is soft: buffers are never smaller than SPLIT_MIN_BUF_BYTES, so beyond about
+// 4000 files (SPLIT_MEM / SPLIT_MIN_BUF_BYTES) rr:<n> and hash:<n> take 64K
+// per file instead.
+//
+#define SPLIT_READS 1
+#define SPLIT_BYTES 2
+#define SPLIT_RR    3
+#define SPLIT_HASH  4
+#define SPLIT_BUF_BYTES (1UL<<20)
+#define SPLIT_MIN_BUF_BYTES (64UL<<10)
+#define SPLIT_MEM (256UL<<20)
+
+typedef struct
 {
-  size_t i;
+  int mode;
+  size_t n, nfiles; // n is the --split argument
+  const char *prefix;
+  bool gzip;
+  seq_writer_pool_t pool;
+  seq_pool_writer_t *w; // one per file, or one for the current file
+  bool *opened;
+  size_t file; // current file for reads/bytes
+  size_t nunits, nbytes; // in current file
+} splitter_t;
+
+// Parse <mode>:<n> e.g. reads:1000000, bytes:1G, rr:8, hash:8
+// A number on its own is the number of files, round-robin
+static bool parse_split(const char *str, int *mode, size_t *n)
+{
+  const char *arg = strchr(str, ':');
+  size_t len = arg ? (size_t)(arg - str) : 0;
+  if(!arg) { *mode = SPLIT_RR; return parse_entire_size(str, n) && *n > 0; }
+  arg++;
+  if(len == 5 && strncmp(str, "reads", 5) == 0) *mode = SPLIT_READS;
+  else if(len == 5 && strncmp(str, "bytes", 5) == 0) *mode = SPLIT_BYTES;
+  else if(len == 2 && strncmp(str, "rr", 2) == 0) *mode = SPLIT_RR;
+  else if(len == 4 && strncmp(str, "hash", 4) == 0) *mode = SPLIT_HASH;
+  else return false;
+  return (*mode == SPLIT_BYTES ? parse_mem_size(arg, n)
+                               : parse_entire_size(arg, n)) && *n > 0;
+}
 
-  if(ops & OPS_MASK_LC) {
-    for(i = 0; i < r->seq.end; i++) {
-      switch(r->seq.b[i]) {
-        case 'A': case 'C': case 'G': case 'T': break;
-        default: r->seq.b[i] = 'N';
-      }
-    }
-  }
+static void splitter_alloc(splitter_t *sp, int mode, size_t n,
+                           const char *prefix, bool gzip, size_t nthreads)
+{
+  size_t buf_size;
+  memset(sp, 0, sizeof(splitter_t));
+  sp->mode = mode;
+  sp->n = n;
+  sp->prefix = prefix;
+  sp->gzip = gzip;
+  sp->nfiles = (mode == SPLIT_RR || mode == SPLIT_HASH) ? n : 1;
+  sp->w = calloc(sp->nfiles, sizeof(seq_pool_writer_t));
+  sp->opened = calloc(sp->nfiles, sizeof(bool));
+  if(!sp->w || !sp->opened) die("Out of memory");
+  // Each file holds a buffer while it fills, plus two in flight per thread.
+  // Above SPLIT_MEM / SPLIT_MIN_BUF_BYTES files the floor wins over SPLIT_MEM
+  buf_size = SPLIT_MEM / (sp->nfiles + 2*nthreads);
+  if(buf_size > SPLIT_BUF_BYTES) buf_size = SPLIT_BUF_BYTES;
+  if(buf_size < SPLIT_MIN_BUF_BYTES) buf_size = SPLIT_MIN_BUF_BYTES;
+  if(seq_writer_pool_open(&sp->pool, nthreads, sp->nfiles + 2*nthreads,
+                          buf_size) < 0) die("Out of memory");
+}
+
+static void splitter_close(splitter_t *sp, size_t i)
+{
+  if(sp->opened[i] && seq_pool_writer_close(&sp->w[i]) < 0)
+    die("Cannot write to: %s%zu", sp->prefix, i);
+  sp->opened[i] = false;
+}
 
-  if(ops & OPS_UPPERCASE)       seq_read_to_uppercase(r);
-  else if(ops & OPS_LOWERCASE)  seq_read_to_lowercase(r);
+// Get writer i, opening file number `file` the first time
+static seq_pool_writer_t* splitter_writer(splitter_t *sp, size_t i, size_t file,
+                                     seq_format fmt)
+{
+  const char *ext = fmt == SEQ_FMT_FASTA ? "fa" :
+                    (fmt == SEQ_FMT_PLAIN ? "txt" : "fq");
+  size_t len = strlen(sp->prefix) + 40;
+  char path[len];
+
+  if(!sp->opened[i]) {
+    snprintf(path, len, "%s%zu.%s%s", sp->prefix, file, ext,
+             sp->gzip ? ".gz" : "");
+    if(seq_pool_writer_open(&sp->pool, &sp->w[i], path, sp->gzip) < 0)
+      die("Cannot open output: %s", path);
+    sp->opened[i] = true;
+  }
+  return &sp->w[i];
+}
 
-  if((ops & OPS_REVERSE) && (ops & OPS_COMPLEMENT)) {
-    if(!(ops & OPS_KEY) || dna_rc_ncasecmp(r->seq.b, r->seq.end) > 0)
-      seq_read_reverse_complement(r);
+// Print a unit of reads r[0..unit-1] to the file they belong in
+static void splitter_print(splitter_t *sp, read_t *r, size_t unit,
+                           const printer_t *p)
+{
+  seq_pool_writer_t *w;
+  StreamBuffer *buf;
+  size_t i, j = 0, start;
+
+  switch(sp->mode) {
+    case SPLIT_READS:
+    case SPLIT_BYTES:
+      if(sp->nunits && (sp->mode == SPLIT_READS ? sp->nunits : sp->nbytes) >= sp->n) {
+        splitter_close(sp, 0);
+        sp->file++;
+        sp->nunits = sp->nbytes = 0;
+      }
+      break;
+    case SPLIT_RR: j = sp->nunits % sp->n; break;
+    case SPLIT_HASH:
+      start = seq_read_name_keylen(r[0].name.b);
+      j = seq_read_name_hash(r[0].name.b, start) % sp->n;
+      break;
   }
-  else if((ops & OPS_REVERSE)) {
-    if(!(ops & OPS_KEY) || dna_r_ncasecmp(r->seq.b, r->seq.end) > 0)
-      seq_read_reverse(r);
-  } else if((ops & OPS_COMPLEMENT)) {
-    if(!(ops & OPS_KEY) || dna_c_ncasecmp(r->seq.b, r->seq.end) > 0)
-      seq_read_complement(r);
+
+  w = splitter_writer(sp, j, sp->nfiles > 1 ? j : sp->file, p->fmt);
+  for(i = 0; i < unit; i++) {
+    buf = seq_pool_writer_buf(w);
+    start = buf->end;
+    read_sprint(&r[i], p->fmt, p->plan->ops, p->linewrap, buf);
+    sp->nbytes += buf->end - start;
+    seq_pool_writer_update(w);
   }
+  sp->nunits++;
 }
 
 // Returns format used
-static seq_format read_print(seq_file_t *sf, read_t *r,
-                             seq_format fmt, uint8_t ops, size_t linewrap,
-                             FILE *rename_fh, seq_buf_t *rnbuf)
+static seq_format split_run(input_iter_t *it, printer_t *printer, int mode,
+                            size_t n, const char *prefix, bool gzip,
+                            size_t unit, size_t nthreads)
 {
-  process_read(r, ops);
+  splitter_t sp;
+  seq_file_t *sf;
+  read_t *r = calloc(unit, sizeof(read_t));
+  size_t i;
 
-  if(fmt == SEQ_FMT_UNKNOWN) {
-    // default to plain format is printing names only with no fmt specified
-    if(ops & OPS_NAME_ONLY) fmt = SEQ_FMT_PLAIN;
-    else if(seq_is_plain(sf)) fmt = SEQ_FMT_PLAIN;
-    else if(seq_is_fasta(sf)) fmt = SEQ_FMT_FASTA;
-    else fmt = SEQ_FMT_FASTQ;
+  if(!r) die("Out of memory");
+  for(i = 0; i < unit; i++)
+    if(seq_read_alloc(&r[i]) == NULL) die("Out of memory");
+
+  splitter_alloc(&sp, mode, n, prefix, gzip, nthreads);
+
+  while(1) {
+    for(i = 0; i < unit && (sf = input_iter_read(it, &r[i])) != NULL; i++) {
+      printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
+      process_read(&r[i], printer->plan);
+      read_rename(&r[i], printer->fmt, printer->rename);
+    }
+    if(i == 0) break;
+    if(i < unit) die("Inputs have different numbers of reads");
+    splitter_print(&sp, r, unit, printer);
   }
 
-  /* Overwrite read name with rename buffer */
-  if(_print_rename_hdr(rename_fh, rnbuf, fmt)) {
-    // seq_buf_t tmp = r->name; r->name = *rnbuf; *rnbuf = tmp;
-    cbuf_capacity(&r->name.b, &r->name.size, rnbuf->end);
-    memcpy(r->name.b, rnbuf->b, rnbuf->end);
-    r->name.b[r->name.end = rnbuf->end] = '\0';
+  for(i = 0; i < sp.nfiles; i++) splitter_close(&sp, i);
+  seq_writer_pool_close(&sp.pool);
+  for(i = 0; i < unit; i++) seq_read_dealloc(&r[i]);
+  free(sp.w);
+  free(sp.opened);
+  free(r);
+  return printer->fmt;
+}
+
+//
+// --rand: random entries are generated in blocks of RAND_BLOCK bases. Each
+// block has its own generator, seeded from --seed and the block's position,
+// so output for a given seed doesn't depend on the number of threads. A block
+// is generated in one piece then wrapped, so -w doesn't change the bases.
+//
+#define RAND_BLOCK (1UL<<20)
+
+// Each byte of a random number gives four bases
+static char rand_base_lut[256][4];
+
+static void rand_init_lut()
+{
+  size_t i, j;
+  for(i = 0; i < 256; i++)
+    for(j = 0; j < 4; j++)
+      rand_base_lut[i][j] = bases[(i >> (2*j)) & 3];
+}
+
+static void rand_bases(rng_t *rng, char *dst, size_t n)
+{
+  uint64_t x;
+  size_t i, j;
+  char tmp[32];
+  for(i = 0; i + 32 <= n; i += 32) {
+    x = rng_next(rng);
+    for(j = 0; j < 8; j++, x >>= 8) memcpy(dst+i+4*j, rand_base_lut[x & 0xff], 4);
   }
+  if(i < n) {
+    x = rng_next(rng);
+    for(j = 0; j < 8; j++, x >>= 8) memcpy(tmp+4*j, rand_base_lut[x & 0xff], 4);
+    memcpy(dst+i, tmp, n-i);
+  }
+}
 
-  if(ops & OPS_NAME_ONLY) {
-    switch(fmt) {
-      case SEQ_FMT_FASTA: fputc('>', stdout); break;
-      case SEQ_FMT_FASTQ: fputc('@', stdout); break;
-      case SEQ_FMT_PLAIN: break;
-      default: die("Got value: %i\n", (int)fmt);
-    }
-    fputs(r->name.b, stdout);
-    if(ops & OPS_PRINT_LENGTH) printf("\t%zu", r->seq.end);
-    fputc('\n', stdout);
+// Quality scores 33..73, one per byte of a random number
+static void rand_quals(rng_t *rng, char *dst, size_t n)
+{
+  uint64_t x = 0;
+  size_t i;
+  for(i = 0; i < n; i++, x >>= 8) {
+    if((i & 7) == 0) x = rng_next(rng);
+    dst[i] = (char)(33 + (((x & 0xff) * 41) >> 8));
   }
+}
+
+typedef struct
+{
+  job_t job;
+  size_t entry, start, end; // bases [start,end) of entry
+  bool qual, last; // quality scores or bases; newline at the end
+  char *tmp; // RAND_BLOCK bytes to wrap from, allocated if -w
+} rand_job_t;
+
+typedef struct
+{
+  uint64_t seed;
+  size_t linewrap;
+} rand_opts_t;
+
+static void rand_work(job_t *job, void *arg)
+{
+  rand_job_t *rj = (rand_job_t*)job;
+  const rand_opts_t *opts = (const rand_opts_t*)arg;
+  StreamBuffer *out = &job->out;
+  size_t p, n, wrap = opts->linewrap, len = rj->end - rj->start;
+  uint64_t x, seed;
+  const char *src;
+  char *dst;
+  rng_t rng;
+
+  // Mix in the entry, then the block and whether it is quality scores
+  x = opts->seed ^ rj->entry;
+  seed = splitmix64(&x);
+  x = seed ^ (rj->start / RAND_BLOCK * 2 + rj->qual);
+  seed = splitmix64(&x);
+  rng_seed(&rng, seed);
+
+  cbuf_capacity(&out->b, &out->size, out->end + len + (wrap ? len/wrap+1 : 0) + 1);
+
+  if(wrap && rj->tmp == NULL && (rj->tmp = malloc(RAND_BLOCK)) == NULL)
+    die("Out of memory");
+  dst = wrap ? rj->tmp : out->b + out->end;
+  if(rj->qual) rand_quals(&rng, dst, len);
+  else rand_bases(&rng, dst, len);
+
+  if(!wrap) out->end += len;
   else {
-    switch(fmt) {
-      case SEQ_FMT_FASTA: seq_print_fasta(r, stdout, linewrap); break;
-      case SEQ_FMT_FASTQ: seq_print_fastq(r, stdout, linewrap); break;
-      case SEQ_FMT_PLAIN: fputs(r->seq.b, stdout); fputc('\n', stdout); break;
-      default: die("Got value: %i\n", (int)fmt);
+    // Break lines before every multiple of linewrap
+    for(p = rj->start, src = rj->tmp; p < rj->end; p += n, src += n) {
+      if(p && p % wrap == 0) out->b[out->end++] = '\n';
+      n = rj->end - p;
+      if(n > wrap - p % wrap) n = wrap - p % wrap;
+      memcpy(out->b + out->end, src, n);
+      out->end += n;
     }
   }
 
-  return fmt;
+  if(rj->last) out->b[out->end++] = '\n';
+  out->b[out->end] = '\0';
 }
 
-static inline void _print_rnd_entries(const size_t *lens, size_t nentries,
-                                      uint8_t fmt, size_t linewrap,
-                                      FILE *rename_fh, seq_buf_t *rnbuf)
+static void _print_rnd_entries(const size_t *lens, size_t nentries,
+                               uint8_t fmt, size_t linewrap, uint64_t seed,
+                               size_t nthreads,
+                               renamer_t *rn)
 {
-  size_t i, j, k, rnd = 0;
+  rand_opts_t opts = {.seed = seed, .linewrap = linewrap};
+  size_t i, k, start, njobs = nthreads > 1 ? 4*nthreads : 1;
+  rand_job_t *jobs = calloc(njobs, sizeof(rand_job_t)), *rj;
+  StreamBuffer *out;
+  workpool_t wp;
+  char hdr[64];
+
+  if(!jobs) die("Out of memory");
+  rand_init_lut();
+
+  if(nthreads > 1) {
+    workpool_start(&wp, nthreads, jobs, njobs, sizeof(rand_job_t),
+                   rand_work, &opts);
+  }
 
   for(i = 0; i < nentries; i++)
   {
-    if(_print_rename_hdr(rename_fh, rnbuf, fmt))
-      printf("%c%s\n", fmt == SEQ_FMT_FASTQ ? '@' : '>', rnbuf->b);
-    else if(fmt == SEQ_FMT_FASTA) printf(">rand%zu\n", i);
-    else if(fmt == SEQ_FMT_FASTQ) printf("@rand%zu\n", i);
-
-    for(j = k = 0; j < lens[i]; j++, k++) {
-      if(linewrap && k == linewrap) { k = 0; fputc('\n', stdout); }
-      // use 2 bits per iteration, 32 bits in rand(), update every 16 iterations
-      if((j & 15) == 0) rnd = (size_t)rand();
-      fputc(bases[rnd&3], stdout);
-      rnd >>= 2;
-    }
-    if(fmt == SEQ_FMT_FASTQ) { /* quality scores */
-      fputs("\n+\n", stdout);
-      for(j = k = 0; j < lens[i]; j++, k++) {
-        if(linewrap && k == linewrap) { k = 0; fputc('\n', stdout); }
-        fputc(33+rand()%41, stdout); // 33..73
-      }
+    // Bases then, for FASTQ, quality scores
+    for(k = 0; k < (fmt == SEQ_FMT_FASTQ ? 2 : 1); k++)
+    {
+      start = 0;
+      do {
+        rj = nthreads > 1 ? (rand_job_t*)workpool_get(&wp) : jobs;
+        out = &rj->job.out;
+        rj->entry = i;
+        rj->qual = k;
+        rj->start = start;
+        rj->end = start = (lens[i] - start > RAND_BLOCK ? start + RAND_BLOCK : lens[i]);
+        rj->last = (rj->end == lens[i] && (k || fmt != SEQ_FMT_FASTQ));
+
+        if(rj->start == 0 && k == 0) {
+          if(renamer_next(rn, fmt)) {
+            sputc_buf(out, fmt == SEQ_FMT_FASTQ ? '@' : '>');
+            swrite_buf(out, rn->name, rn->len);
+            sputc_buf(out, '\n');
+          }
+          else if(fmt == SEQ_FMT_FASTA || fmt == SEQ_FMT_FASTQ) {
+            sprintf(hdr, "%crand%zu\n", fmt == SEQ_FMT_FASTQ ? '@' : '>', i);
+            sputs_buf(out, hdr);
+          }
+        }
+        else if(rj->start == 0) sputs_buf(out, "\n+\n");
+
+        if(nthreads > 1) workpool_submit(&wp, &rj->job);
+        else { rand_work(&rj->job, &opts); out_flush(out); }
+      } while(start < lens[i]);
     }
-    fputc('\n', stdout);
   }
+
+  if(nthreads > 1) workpool_finish(&wp);
+
+  for(i = 0; i < njobs; i++) { free(jobs[i].job.out.b); free(jobs[i].tmp); }
+  free(jobs);
 }
 
+// Long entries are summarised in pieces of this many bases
+#define STAT_CHUNK_BASES (1<<20)
+
 // @fast if true skip reading over all reads
-static void file_stat(seq_file_t *sf, read_t *r, uint8_t ops, bool fast)
+static void file_stat(seq_file_t *sf, read_t *r, const xform_plan_t *plan,
+                      bool fast)
 {
+  uint8_t ops = plan->ops;
   if(ops && fast)
     print_usage("-S,--fast-stat is not compatible with -l,-u,-r,-R,-C,-m");
 
@@ -347,9 +2195,10 @@ static void file_stat(seq_file_t *sf, read_t *r, uint8_t ops, bool fast)
   printf("[dnacat] File: %s\n", inpathstr(sf->path));
 
   int minq = -1, maxq = -1, s, fmti;
+  bool more = false;
 
   fmti = seq_guess_fastq_format(sf, &minq, &maxq);
-  s = seq_read(sf,r);
+  s = seq_read_chunk(sf, r, STAT_CHUNK_BASES, &more);
 
   if(s < 0) die("Error reading file: %s\n", inpathstr(sf->path));
   if(s == 0) die("Cannot get any reads from file: %s\n", inpathstr(sf->path));
@@ -377,24 +2226,45 @@ static void file_stat(seq_file_t *sf, read_t *r, uint8_t ops, bool fast)
 
   if(!fast)
   {
-    // We've already read one read
-    size_t i, char_count[256] = {0};
-    size_t total_len = 0, nreads = 0;
+    // We've already read one read (or the first piece of one)
+    // Pieces of a long entry are counted in rec_count until its length is
+    // known, since seq_read_chunk() doesn't apply --min-len/--max-len
+    size_t i, char_count[256] = {0}, rec_count[256] = {0}, *counts;
+    size_t total_len = 0, nreads = 0, rlen = 0;
     size_t min_rlen = SIZE_MAX, max_rlen = 0;
+    bool pieces = false;
 
     do {
-      process_read(r, ops);
-      total_len += r->seq.end;
-      max_rlen = r->seq.end > max_rlen ? r->seq.end : max_rlen;
-      min_rlen = r->seq.end < min_rlen ? r->seq.end : min_rlen;
-      nreads++;
+      if(!pieces && !more && !_seq_filter_len(sf, r->seq.end)) continue;
+      process_read(r, plan);
+      rlen += r->seq.end;
+      pieces |= more;
+      counts = pieces ? rec_count : char_count;
 
       for(i = 0; i < r->seq.end; i++)
-        char_count[(uint8_t)r->seq.b[i]]++;
+        counts[(uint8_t)r->seq.b[i]]++;
+
+      if(!more) {
+        if(pieces) {
+          if(_seq_filter_len(sf, rlen)) {
+            for(i = 0; i < 256; i++) char_count[i] += rec_count[i];
+          } else rlen = SIZE_MAX;
+          memset(rec_count, 0, sizeof(rec_count));
+          pieces = false;
+        }
+        if(rlen != SIZE_MAX) {
+          total_len += rlen;
+          max_rlen = rlen > max_rlen ? rlen : max_rlen;
+          min_rlen = rlen < min_rlen ? rlen : min_rlen;
+          nreads++;
+        }
+        rlen = 0;
+      }
     }
-    while((s = seq_read(sf,r)) > 0);
+    while((s = seq_read_chunk(sf, r, STAT_CHUNK_BASES, &more)) > 0);
 
-    size_t mean_rlen = (size_t)(((double)total_len / nreads) + 0.5);
+    if(nreads == 0) min_rlen = 0;
+    size_t mean_rlen = nreads ? (size_t)(((double)total_len / nreads) + 0.5) : 0;
 
     char nbasesstr[50], nreadsstr[50];
     char minrlenstr[50], maxrlenstr[50], meanrlenstr[50];
@@ -434,17 +2304,225 @@ static void vector_push(size_t **ptr, size_t *len, size_t *cap, size_t x)
   (*ptr)[(*len)++] = x;
 }
 
+//
+// --tile: print every window of <len> bases, every <step> bases, of each
+// input sequence. Windows are named <name>:<start>-<end> (1-based). Each job
+// takes a copy of the part of the sequence it covers, so sequences can be
+// split across threads and the output is written straight from that slice.
+//
+#define TILE_JOB_BYTES (1UL<<20)
+
+typedef struct
+{
+  job_t job;
+  seq_buf_t name, seq, qual; // name key and slice of sequence
+  size_t offset, nwin; // position of slice in the sequence, number of windows
+  seq_format fmt;
+} tile_job_t;
+
+typedef struct
+{
+  size_t len, step, linewrap;
+} tile_opts_t;
+
+// Copy src[start..end) into buf, clamping to the end of src
+static void tile_copy(seq_buf_t *buf, const seq_buf_t *src,
+                      size_t start, size_t end)
+{
+  if(end > src->end) end = src->end;
+  buf->end = start < end ? end - start : 0;
+  cbuf_capacity(&buf->b, &buf->size, buf->end);
+  memcpy(buf->b, src->b + start, buf->end);
+  buf->b[buf->end] = '\0';
+}
+
+// Copy n chars to dst, adding a newline every linewrap characters
+static inline char* tile_write_wrap(char *dst, const char *src, size_t n,
+                                    size_t linewrap)
+{
+  size_t i, m;
+  if(!linewrap) { memcpy(dst, src, n); return dst + n; }
+  for(i = 0; i < n; i += m) {
+    if(i) *dst++ = '\n';
+    m = n - i < linewrap ? n - i : linewrap;
+    memcpy(dst, src + i, m);
+    dst += m;
+  }
+  return dst;
+}
+
+static void tile_work(job_t *job, void *arg)
+{
+  const tile_job_t *tj = (const tile_job_t*)job;
+  const tile_opts_t *opts = (const tile_opts_t*)arg;
+  StreamBuffer *out = &job->out;
+  size_t w, s, len = opts->len;
+  size_t lines = opts->linewrap ? len / opts->linewrap + 1 : 1;
+  size_t maxlen = tj->name.end + 48 + 2 * (len + lines);
+  char *o;
+
+  cbuf_capacity(&out->b, &out->size, out->end + tj->nwin * maxlen);
+  o = out->b + out->end;
+
+  for(w = 0; w < tj->nwin; w++)
+  {
+    s = w * opts->step;
+    if(tj->fmt != SEQ_FMT_PLAIN) {
+      *o++ = tj->fmt == SEQ_FMT_FASTQ ? '@' : '>';
+      memcpy(o, tj->name.b, tj->name.end);
+      o += tj->name.end;
+      *o++ = ':';
+      o = write_size(o, tj->offset + s + 1);
+      *o++ = '-';
+      o = write_size(o, tj->offset + s + len);
+      *o++ = '\n';
+    }
+    o = tile_write_wrap(o, tj->seq.b + s, len, opts->linewrap);
+    if(tj->fmt == SEQ_FMT_FASTQ) {
+      memcpy(o, "\n+\n", 3);
+      o += 3;
+      o = tile_write_wrap(o, tj->qual.b + s, len, opts->linewrap);
+    }
+    *o++ = '\n';
+  }
+
+  out->end = o - out->b;
+  out->b[out->end] = '\0';
+}
+
+// Returns format used
+static seq_format tile_run(input_iter_t *it, printer_t *printer,
+                           size_t tile_len, size_t tile_step, size_t nthreads)
+{
+  tile_opts_t opts = {.len = tile_len, .step = tile_step,
+                      .linewrap = printer->linewrap};
+  size_t i, w, nwin, keylen, per_job, njobs = nthreads > 1 ? 4*nthreads : 1;
+  tile_job_t *jobs = calloc(njobs, sizeof(tile_job_t)), *tj;
+  workpool_t wp;
+  seq_file_t *sf;
+  read_t r;
+
+  if(!jobs || seq_read_alloc(&r) == NULL) die("Out of memory");
+
+  if(nthreads > 1) {
+    workpool_start(&wp, nthreads, jobs, njobs, sizeof(tile_job_t),
+                   tile_work, &opts);
+  }
+
+  while((sf = input_iter_read(it, &r)) != NULL)
+  {
+    printer->fmt = read_out_fmt(sf, printer->fmt, printer->plan->ops);
+    process_read(&r, printer->plan);
+    read_rename(&r, printer->fmt, printer->rename);
+    if(r.seq.end < tile_len) continue;
+
+    nwin = (r.seq.end - tile_len) / tile_step + 1;
+    for(keylen = 0; keylen < r.name.end && !isspace(r.name.b[keylen]); keylen++) {}
+    per_job = TILE_JOB_BYTES / (keylen + 48 + 2*tile_len);
+    if(per_job == 0) per_job = 1;
+
+    for(w = 0; w < nwin; w += per_job)
+    {
+      tj = nthreads > 1 ? (tile_job_t*)workpool_get(&wp) : jobs;
+      tj->fmt = printer->fmt;
+      tj->nwin = nwin - w < per_job ? nwin - w : per_job;
+      tj->offset = w * tile_step;
+      tile_copy(&tj->name, &r.name, 0, keylen);
+      tile_copy(&tj->seq, &r.seq, tj->offset,
+                tj->offset + (tj->nwin-1) * tile_step + tile_len);
+      if(tj->fmt == SEQ_FMT_FASTQ) {
+        // Pad missing quality scores, as seq_sprint_fastq() does
+        tile_copy(&tj->qual, &r.qual, tj->offset, tj->offset + tj->seq.end);
+        cbuf_capacity(&tj->qual.b, &tj->qual.size, tj->seq.end);
+        memset(tj->qual.b + tj->qual.end, '.', tj->seq.end - tj->qual.end);
+        tj->qual.b[tj->qual.end = tj->seq.end] = '\0';
+      }
+
+      if(nthreads > 1) workpool_submit(&wp, &tj->job);
+      else { tile_work(&tj->job, &opts); out_flush(&tj->job.out); }
+    }
+  }
+
+  if(nthreads > 1) workpool_finish(&wp);
+
+  for(i = 0; i < njobs; i++) {
+    free(jobs[i].name.b);
+    free(jobs[i].seq.b);
+    free(jobs[i].qual.b);
+    free(jobs[i].job.out.b);
+  }
+  free(jobs);
+  seq_read_dealloc(&r);
+
+  return printer->fmt;
+}
+
+// Print bases [start,end) of sequence `name` from each .2bit input, named
+// <name>:<start>-<end> (1-based) unless it is the whole sequence
+// Returns format used
+static seq_format region_run(seq_file_t **inputs, char **paths, size_t n,
+                             printer_t *printer, const char *name,
+                             size_t start, size_t end)
+{
+  char coords[64];
+  size_t i;
+  long idx;
+  read_t r;
+  int s;
+
+  if(seq_read_alloc(&r) == NULL) die("Out of memory");
+
+  for(i = 0; i < n; i++) {
+    if(!seq_is_twobit(inputs[i]))
+      die("--region needs .2bit input: %s", inpathstr(paths[i]));
+    if((idx = seq_twobit_find(inputs[i], name)) < 0)
+      die("No sequence '%s' in: %s", name, inpathstr(paths[i]));
+    if((s = seq_twobit_fetch(inputs[i], (size_t)idx, start, end, &r)) < 0)
+      die("Error reading from: %s", inpathstr(paths[i]));
+    if(s == 0 && end != SIZE_MAX)
+      die("Region is past the end of %s (%zu bases) in: %s", name,
+          seq_twobit_length(inputs[i], (size_t)idx), inpathstr(paths[i]));
+    if(end != SIZE_MAX) {
+      sprintf(coords, ":%zu-%zu", start + 1, start + r.seq.end);
+      cbuf_append_str(&r.name.b, &r.name.end, &r.name.size,
+                      coords, strlen(coords));
+    }
+    printer->fmt = read_out_fmt(inputs[i], printer->fmt, printer->plan->ops);
+    printer_print(printer, &r);
+    seq_close(inputs[i]);
+  }
+
+  seq_read_dealloc(&r);
+  return printer->fmt;
+}
+
 int main(int argc, char **argv)
 {
   cmdstr = argv[0];
 
-  bool interleave = false, stat = false, fast_stat = false;
+  bool interleave = false, stat = false, fast_stat = false, repair = false;
+  bool dedup = false, count = false, gzip = false;
+  int split_mode = 0;
+  size_t split_n = 0;
+  const char *split_prefix = "split.";
+  size_t shard_i = 0, shard_n = 0, tail = 0;
+  const char *region = NULL;
+  size_t region_start = 0, region_end = SIZE_MAX;
+  int sort_by = 0;
+  double sample_frac = 0;
+  size_t sample_count = 0;
+  char *endptr;
   uint8_t ops = 0, fmt_set = 0;
   seq_format fmt = SEQ_FMT_UNKNOWN;
-  size_t i, linewrap = 0;
-  char *rename_path = NULL;
+  size_t i, linewrap = 0, nthreads = 1, mem_limit = 1UL<<30;
+  size_t tile_len = 0, tile_step = 1;
+  char *rename_path = NULL, *rename_pattern = NULL;
+  seq_filter_t filter;
+  memset(&filter, 0, sizeof(filter));
 
   size_t *nrand = NULL, nrand_len = 0, nrand_cap = 0, tmprnd = 0;
+  uint64_t seed = 0;
+  bool seed_set = false;
 
   if(argc == 1) print_usage(NULL);
 
@@ -459,6 +2537,9 @@ int main(int argc, char **argv)
       case 'F': fmt_set++; fmt = SEQ_FMT_FASTA; break;
       case 'Q': fmt_set++; fmt = SEQ_FMT_FASTQ; break;
       case 'P': fmt_set++; fmt = SEQ_FMT_PLAIN; break;
+      case OPT_BAM: fmt_set++; fmt = SEQ_FMT_BAM; break;
+      case OPT_SQC: fmt_set++; fmt = SEQ_FMT_SQC; break;
+      case OPT_TWOBIT: fmt_set++; fmt = SEQ_FMT_TWOBIT; break;
       case 'w':
         if(!parse_entire_size(optarg, &linewrap))
           print_usage("Bad -w argument: %s\n", optarg);
@@ -481,6 +2562,76 @@ int main(int argc, char **argv)
       case 's': stat        = true;   break;
       case 'S': fast_stat   = true;   break;
       case 'M': rename_path = optarg; break;
+      case 't':
+        if(!parse_entire_size(optarg, &nthreads) || !nthreads)
+          print_usage("Bad -t argument: %s\n", optarg);
+        break;
+      case OPT_MIN_LEN:
+        if(!parse_entire_size(optarg, &filter.min_len))
+          print_usage("Bad --min-len argument: %s\n", optarg);
+        break;
+      case OPT_MAX_LEN:
+        if(!parse_entire_size(optarg, &filter.max_len) || !filter.max_len)
+          print_usage("Bad --max-len argument: %s\n", optarg);
+        break;
+      case OPT_NAME_PREFIX: filter.name_prefix = optarg; break;
+      case OPT_REPAIR: repair = true; break;
+      case OPT_DEDUP: dedup = true; break;
+      case OPT_COUNT: count = true; break;
+      case OPT_GZIP: gzip = true; break;
+      case OPT_SHARD:
+        if(!parse_shard(optarg, &shard_i, &shard_n))
+          print_usage("Bad --shard argument (<i>/<n>, i < n): %s\n", optarg);
+        break;
+      case OPT_TAIL:
+        if(!parse_entire_size(optarg, &tail) || !tail)
+          print_usage("Bad --tail argument: %s\n", optarg);
+        break;
+      case OPT_REGION:
+        if(!parse_region(optarg, &region_start, &region_end))
+          print_usage("Bad --region argument: %s\n", optarg);
+        region = optarg;
+        break;
+      case OPT_SPLIT_PREFIX: split_prefix = optarg; break;
+      case OPT_SPLIT:
+        if(!parse_split(optarg, &split_mode, &split_n))
+          print_usage("Bad --split argument (reads|bytes|rr|hash:<n>): %s\n",
+                      optarg);
+        break;
+      case OPT_SAMPLE:
+        if(strchr(optarg, '.')) {
+          sample_frac = strtod(optarg, &endptr);
+          if(*endptr || !(sample_frac > 0 && sample_frac <= 1))
+            print_usage("Bad --sample fraction: %s\n", optarg);
+        }
+        else if(!parse_entire_size(optarg, &sample_count) || !sample_count)
+          print_usage("Bad --sample argument: %s\n", optarg);
+        break;
+      case OPT_SORT:
+        if(strcmp(optarg,"name") == 0) sort_by = SORT_NAME;
+        else if(strcmp(optarg,"seq") == 0) sort_by = SORT_SEQ;
+        else if(strcmp(optarg,"len") == 0) sort_by = SORT_LEN;
+        else print_usage("Bad --sort argument (name|seq|len): %s\n", optarg);
+        break;
+      case OPT_SEED:
+        if(!parse_entire_size(optarg, &tmprnd))
+          print_usage("Bad --seed argument: %s\n", optarg);
+        seed = tmprnd;
+        seed_set = true;
+        break;
+      case OPT_RENAME_PAT:
+        if(!rename_pattern_valid(optarg))
+          print_usage("Bad --rename-pattern (use %%n, %%p, %%%%): %s\n", optarg);
+        rename_pattern = optarg;
+        break;
+      case OPT_TILE:
+        if(!parse_tile(optarg, &tile_len, &tile_step))
+          print_usage("Bad --tile argument: %s\n", optarg);
+        break;
+      case OPT_MEM:
+        if(!parse_mem_size(optarg, &mem_limit) || !mem_limit)
+          print_usage("Bad --mem argument: %s\n", optarg);
+        break;
       case ':': /* BADARG */
       case '?': /* BADCH getopt_long has already printed error */
         print_usage("Bad option: %s\n", argv[optind-1]);
@@ -489,7 +2640,8 @@ int main(int argc, char **argv)
   }
 
   if(fmt_set > 1)
-    print_usage("Please specify only one output format (-f,-q,-p)\n");
+    print_usage("Please specify only one output format "
+                "(-f,-q,-p,--bam,--sqc,--2bit)\n");
 
   size_t num_inputs = argc - optind;
   char **input_paths = argv + optind;
@@ -500,6 +2652,17 @@ int main(int argc, char **argv)
   // Default to plain format for random output
   if(nrand_len && !num_inputs && fmt == SEQ_FMT_UNKNOWN) fmt = SEQ_FMT_PLAIN;
 
+  if(fmt == SEQ_FMT_BAM && (linewrap || nrand_len || split_mode || tile_len))
+    print_usage("--bam is not compatible with -w,-n,--split,--tile");
+
+  if(fmt == SEQ_FMT_SQC &&
+     (linewrap || nrand_len || split_mode || tile_len || nthreads > 1))
+    print_usage("--sqc is not compatible with -w,-n,-t,--split,--tile");
+
+  if(fmt == SEQ_FMT_TWOBIT &&
+     (linewrap || nrand_len || split_mode || tile_len || nthreads > 1))
+    print_usage("--2bit is not compatible with -w,-n,-t,--split,--tile");
+
   if(linewrap && (fmt == SEQ_FMT_PLAIN))
     print_usage("Bad idea to use linewrap with plain output (specify -f or -q)");
 
@@ -518,77 +2681,214 @@ int main(int argc, char **argv)
   if(stat && (interleave || linewrap || fmt || nrand_len || ops))
     print_usage("-s,--stat is not compatible with other options");
 
+  if((stat || fast_stat) && nthreads > 1)
+    print_usage("-s,--stat and -S,--fast-stat are not compatible with -t,--threads");
+
   if(stat && fast_stat)
     print_usage("Cannot use -s,--stat and -S--fast-stat together");
 
-  FILE *rename_fh = NULL;
-  seq_buf_t rename_buf;
+  if(repair && num_inputs != 2)
+    print_usage("--repair needs exactly two input files");
+
+  if(repair && (interleave || stat || fast_stat || nthreads > 1))
+    print_usage("--repair is not compatible with -i,-s,-S,-t");
+
+  if(tile_len && ((ops & OPS_NAME_ONLY) || stat || fast_stat || repair))
+    print_usage("--tile is not compatible with -N,-L,-s,-S,--repair");
+
+  if(dedup && (stat || fast_stat || repair || tile_len || nthreads > 1 ||
+               (ops & OPS_NAME_ONLY)))
+    print_usage("--dedup is not compatible with -s,-S,-N,-L,-t,--repair,--tile");
+
+  bool sample = (sample_frac > 0 || sample_count > 0);
+
+  if(sample && (stat || fast_stat || repair || dedup || sort_by || tile_len ||
+                nthreads > 1))
+    print_usage("--sample is not compatible with -s,-S,-t,--repair,--dedup,"
+                "--sort,--tile");
+
+  if(count && (stat || fast_stat || interleave || linewrap || fmt ||
+               nrand_len || ops || repair || dedup || sort_by || tile_len ||
+               sample || rename_path || rename_pattern || nthreads > 1))
+    print_usage("--count can only be used with --min-len,--max-len,--name-prefix");
+
+  if(split_mode && (stat || fast_stat || count || repair || dedup || sort_by ||
+                    tile_len || sample))
+    print_usage("--split is not compatible with -s,-S,--count,--repair,"
+                "--dedup,--sort,--tile,--sample");
+
+  if(tail && shard_n)
+    print_usage("Cannot use --tail and --shard together");
+
+  if(region && (stat || fast_stat || count || interleave || nrand_len ||
+                 repair || dedup || sort_by || tile_len || sample ||
+                 split_mode || shard_n || tail || nthreads > 1 ||
+                 filter.min_len || filter.max_len || filter.name_prefix))
+    print_usage("--region is not compatible with -i,-s,-S,-n,-t,--count,"
+                "--repair,--dedup,--sort,--tile,--sample,--split,--shard,"
+                "--tail,--min-len,--max-len,--name-prefix");
+
+  if(gzip && !split_mode)
+    print_usage("--gzip is only used with --split");
+
+  if(sort_by && (stat || fast_stat || repair || dedup || tile_len))
+    print_usage("--sort is not compatible with -s,-S,--repair,--dedup,--tile");
+
+  if(dedup && interleave && num_inputs != 2)
+    print_usage("--dedup with -i needs exactly two input files");
+
+  if(rename_path && rename_pattern)
+    print_usage("Cannot use -M,--rename and --rename-pattern together");
+
+  if(filter.max_len && filter.min_len > filter.max_len)
+    print_usage("--min-len is greater than --max-len");
+
+  renamer_t renamer;
+  memset(&renamer, 0, sizeof(renamer));
+  renamer.pattern = rename_pattern;
 
   if(rename_path) {
-    if(strcmp(rename_path,"-") == 0) rename_fh = stdin;
-    else if((rename_fh = fopen(rename_path, "r")) == NULL)
+    if(strcmp(rename_path,"-") == 0) renamer.fh = stdin;
+    else if((renamer.fh = fopen(rename_path, "r")) == NULL)
       die("Cannot open --rename file: %s", inpathstr(rename_path));
-    rename_buf.size = 1024;
-    rename_buf.b = malloc(rename_buf.size);
-    if(!rename_buf.b) die("Out of memory%c", '!');
+    if(strm_buf_alloc(&renamer.in, 1<<16) == NULL) die("Out of memory");
   }
 
-  if(nrand_len) seed_random();
+  if((nrand_len || sample) && !seed_set) seed = time_seed();
 
   read_t r;
   seq_read_alloc(&r);
-  int s;
+
+  seq_file_t *sf;
+  input_iter_t it;
+
+  xform_plan_t plan;
+  xform_plan_init(&plan, ops);
 
   seq_file_t *inputs[num_inputs];
 
+  // Only parse the fields we are going to print
+  uint8_t skip = 0;
+  if(!stat && !fast_stat) {
+    if(ops & OPS_NAME_ONLY) skip = SEQ_SKIP_SEQ | SEQ_SKIP_QUAL;
+    else if(fmt == SEQ_FMT_PLAIN) skip = SEQ_SKIP_NAME | SEQ_SKIP_QUAL;
+    else if(fmt == SEQ_FMT_FASTA || fmt == SEQ_FMT_TWOBIT) skip = SEQ_SKIP_QUAL;
+    // --repair needs names, and sequence to hold reads in temporary files
+    if(repair) skip &= SEQ_SKIP_QUAL;
+    // --dedup needs sequence
+    if(dedup) skip &= ~SEQ_SKIP_SEQ;
+    // --sort needs the field it sorts on
+    if(sort_by == SORT_NAME) skip &= ~SEQ_SKIP_NAME;
+    else if(sort_by) skip &= ~SEQ_SKIP_SEQ;
+    // --split hash:<n> needs names
+    if(split_mode == SPLIT_HASH) skip &= ~SEQ_SKIP_NAME;
+  }
+
   for(i = 0; i < num_inputs; i++) {
-    if((inputs[i] = seq_open(input_paths[i])) == NULL)
+    if(shard_n) {
+      if((inputs[i] = seq_open_shard(input_paths[i], shard_i, shard_n)) == NULL)
+        print_usage("Couldn't read shard of file: %s\n",
+                    inpathstr(input_paths[i]));
+    }
+    else if((inputs[i] = seq_open(input_paths[i])) == NULL)
       print_usage("Couldn't read file: %s\n", inpathstr(input_paths[i]));
+    seq_skip_fields(inputs[i], skip);
+    seq_set_filter(inputs[i], &filter);
+    if(tail && seq_seek_tail(inputs[i], tail) < 0)
+      die("Cannot seek to end of file (--tail needs uncompressed, non-SAM/BAM "
+          "files): %s", inpathstr(input_paths[i]));
   }
 
   if(stat || fast_stat) {
     for(i = 0; i < num_inputs; i++)
-      file_stat(inputs[i], &r, ops, fast_stat);
-  }
-  else if(interleave) {
-    // read one entry from each file
-    size_t waiting_files = num_inputs;
-    while(waiting_files) {
-      for(i = 0; i < num_inputs; i++) {
-        if(inputs[i] != NULL) {
-          s = seq_read(inputs[i],&r);
-          if(s < 0) die("Error reading from: %s\n", inputs[i]->path);
-          else if(s > 0) {
-            fmt = read_print(inputs[i], &r, fmt, ops, linewrap,
-                             rename_fh, &rename_buf);
-          } else {
-            seq_close(inputs[i]); inputs[i] = NULL; waiting_files--;
-          }
-        }
-      }
+      file_stat(inputs[i], &r, &plan, fast_stat);
+  }
+  else if(count) {
+    for(i = 0; i < num_inputs; i++) {
+      size_t nreads = 0, nbases = 0;
+      if(seq_count(inputs[i], &nreads, &nbases) < 0)
+        die("Error reading from: %s", inpathstr(input_paths[i]));
+      printf("%s\t%zu\t%zu\n", inpathstr(input_paths[i]), nreads, nbases);
+      seq_close(inputs[i]);
     }
   }
   else {
-    for(i = 0; i < num_inputs; i++) {
-      while((s = seq_read(inputs[i],&r)) > 0) {
-        fmt = read_print(inputs[i], &r, fmt, ops, linewrap,
-                         rename_fh, &rename_buf);
+    printer_t printer = {.plan = &plan, .fmt = fmt, .linewrap = linewrap,
+                         .rename = &renamer,
+                         .out = strm_buf_init};
+    seq_bgzf_writer_t bam_writer;
+    if(fmt == SEQ_FMT_BAM) {
+      if(seq_bgzf_writer_open(&bam_writer, stdout,
+                              nthreads > SEQ_BGZF_NTHREADS ? nthreads
+                                                           : SEQ_BGZF_NTHREADS,
+                              Z_DEFAULT_COMPRESSION) < 0)
+        die("Cannot start writing BAM");
+      seq_sprint_ubam_header(seq_bgzf_writer_buf(&bam_writer));
+      bam_out = &bam_writer;
+    }
+    seq_sqc_writer_t sqc_writer;
+    if(fmt == SEQ_FMT_SQC) {
+      if(seq_sqc_writer_open(&sqc_writer, stdout) < 0)
+        die("Cannot write to stdout: %s", strerror(errno));
+      sqc_out = &sqc_writer;
+    }
+    seq_twobit_writer_t twobit_writer;
+    if(fmt == SEQ_FMT_TWOBIT) {
+      seq_twobit_writer_open(&twobit_writer, stdout);
+      twobit_out = &twobit_writer;
+    }
+    // --sample reads inputs on this thread so it can skip records
+    input_iter_init(&it, inputs, num_inputs, interleave || repair, !sample);
+    if(region) {
+      fmt = region_run(inputs, input_paths, num_inputs, &printer, region,
+                       region_start, region_end);
+    } else if(sample) {
+      fmt = sample_run(&it, &printer, sample_frac, sample_count,
+                       interleave ? num_inputs : 1, seed);
+    } else if(split_mode) {
+      fmt = split_run(&it, &printer, split_mode, split_n, split_prefix, gzip,
+                      interleave ? num_inputs : 1, nthreads);
+    } else if(sort_by) {
+      fmt = sort_run(&it, &printer, sort_by, mem_limit, nthreads);
+    } else if(tile_len) {
+      fmt = tile_run(&it, &printer, tile_len, tile_step, nthreads);
+    } else if(nthreads > 1) {
+      fmt = pipeline_run(&it, &printer, nthreads);
+    } else if(repair) {
+      fmt = repair_run(&it, &printer, mem_limit);
+    } else if(dedup) {
+      fmt = dedup_run(&it, &printer, mem_limit, interleave);
+    } else {
+      while((sf = input_iter_read(&it, &r)) != NULL) {
+        printer.fmt = read_out_fmt(sf, printer.fmt, ops);
+        printer_print(&printer, &r);
       }
-      if(s < 0) die("Error reading from: %s\n", inputs[i]->path);
-      seq_close(inputs[i]);
+      fmt = printer.fmt;
     }
+    out_flush(&printer.out);
+    free(printer.out.b);
+    if(bam_out && seq_bgzf_writer_close(bam_out) < 0)
+      die("Cannot write to stdout: %s", strerror(errno));
+    bam_out = NULL;
+    if(sqc_out && seq_sqc_writer_close(sqc_out) < 0)
+      die("Cannot write to stdout: %s", strerror(errno));
+    sqc_out = NULL;
+    if(twobit_out && seq_twobit_writer_close(twobit_out) < 0)
+      die("Cannot write to stdout: %s", strerror(errno));
+    twobit_out = NULL;
   }
-
   seq_read_dealloc(&r);
 
   // Print random entries
-  _print_rnd_entries(nrand, nrand_len, fmt, linewrap, rename_fh, &rename_buf);
+  _print_rnd_entries(nrand, nrand_len, fmt, linewrap, seed, nthreads,
+                     &renamer);
   free(nrand);
 
-  if(rename_fh) {
-    fclose(rename_fh);
-    free(rename_buf.b);
+  if(renamer.fh) {
+    fclose(renamer.fh);
+    strm_buf_dealloc(&renamer.in);
   }
+  free(renamer.buf.b);
 
   return EXIT_SUCCESS;
 }
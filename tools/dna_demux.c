@@ -13,21 +13,32 @@ Nov 2016, Public Domain
 #include <stdio.h>
 #include <stdarg.h>
 #include <getopt.h>
+#include <errno.h>
 
 #include "seq_file.h"
+#include "seq_pair.h"
+#include "seq_writer.h"
 
 const char *cmdstr = NULL;
-FILE *fh1 = NULL, *fh2 = NULL;
-gzFile gz1, gz2;
 seq_format fmt = SEQ_FMT_UNKNOWN;
 
 const char usage[] = "  Demultiplex input sequence\n"
+"\n"
+"  Split an interleaved file into <out1> and <out2>, or with -b split reads\n"
+"  into one file per sample by barcode.\n"
+"\n"
 "  -F,--fasta       print in FASTA format\n"
 "  -Q,--fastq       print in FASTQ format\n"
 "  -P,--plain       print in plain format\n"
-"  -z,--gzip        gzip output\n";
+"  -z,--gzip        gzip output\n"
+"  -b,--barcodes <f> file of '<barcode> <sample>' lines\n"
+"  -o,--out <pre>   write samples to <pre><sample>.fq [default: ./]\n"
+"  -m,--mismatches <k> allow <k> mismatches in barcodes [default: 0]\n"
+"  -I,--index <f>   take barcodes from index reads in <f> rather than from\n"
+"                   the end of read names (e.g. '@r1 1:N:0:ACGTACGT')\n"
+"  -i,--interleaved input is interleaved, keep mates together\n";
 
-const char shortopts[] = "hFQPz";
+const char shortopts[] = "hFQPzb:o:m:I:i";
 static struct option longopts[] =
 {
   {"help",       no_argument,       NULL, 'h'},
@@ -35,9 +46,30 @@ static struct option longopts[] =
   {"fastq",      no_argument,       NULL, 'Q'},
   {"plain",      no_argument,       NULL, 'P'},
   {"gzip",       no_argument,       NULL, 'z'},
+  {"barcodes",   required_argument, NULL, 'b'},
+  {"out",        required_argument, NULL, 'o'},
+  {"mismatches", required_argument, NULL, 'm'},
+  {"index",      required_argument, NULL, 'I'},
+  {"interleaved",no_argument,       NULL, 'i'},
   {NULL, 0, NULL, 0}
 };
 
+#define die(...) die_(__func__, __LINE__, __VA_ARGS__)
+
+void die_(const char *func, int line, const char *fmt, ...)
+__attribute__((noreturn))
+__attribute__((format(printf, 3, 4)));
+
+void die_(const char *func, int line, const char *fmt, ...)
+{
+  va_list argptr;
+  fprintf(stderr, "[%s:%i] Error: %s() ", __FILE__, line, func);
+  va_start(argptr, fmt);
+  vfprintf(stderr, fmt, argptr);
+  va_end(argptr);
+  fputc('\n', stderr);
+  exit(EXIT_FAILURE);
+}
 
 void print_usage(const char *err, ...)
 __attribute__((noreturn))
@@ -57,29 +89,445 @@ void print_usage(const char *err, ...)
   }
 
   fprintf(stderr, "Usage: %s [OPTIONS] <out1> <out2> [in]\n", cmdstr);
+  fprintf(stderr, "       %s [OPTIONS] -b <barcodes.txt> [in]\n", cmdstr);
   fputs(usage, stderr);
 
   exit(EXIT_FAILURE);
 }
 
+//
+// Output files: reads are formatted into buffers that are written out, and
+// compressed, on other threads. The two outputs of a split get a thread each;
+// sample outputs share a pool of SAMPLE_NTHREADS however many samples there
+// are, with a buffer each plus two per thread.
+//
+#define SAMPLE_NTHREADS 4
+#define SAMPLE_BUF_BYTES (1UL<<16)
+#define PAIR_NBUFS 4
+#define PAIR_BUF_BYTES (1UL<<20)
 
-static void print_read(const read_t *r, FILE *fh, gzFile gz)
+typedef struct
 {
-  if(fh) {
-    switch(fmt) {
-      case SEQ_FMT_FASTA: seq_print_fasta(r, fh, 0); break;
-      case SEQ_FMT_FASTQ: seq_print_fastq(r, fh, 0); break;
-      case SEQ_FMT_PLAIN: fputs(r->seq.b, fh); fputc('\n', fh); break;
-      default: fprintf(stderr, "Got value: %i\n", (int)fmt); exit(-1);
-    }
+  char *path;
+  seq_writer_pool_t *pool; // NULL if written by its own thread
+  seq_writer_t w;
+  seq_pool_writer_t pw;
+  size_t nreads, nbytes;
+} output_t;
+
+static bool gzip_out = false;
+
+static void output_open(output_t *out, char *path, seq_writer_pool_t *pool)
+{
+  int s;
+  out->path = path;
+  out->pool = pool;
+  out->nreads = out->nbytes = 0;
+  s = pool ? seq_pool_writer_open(pool, &out->pw, path, gzip_out)
+           : seq_writer_open(&out->w, path, gzip_out, PAIR_NBUFS, PAIR_BUF_BYTES);
+  if(s < 0) die("Cannot open output: %s", path);
+}
+
+static void output_close(output_t *out)
+{
+  double mb = out->nbytes / (1024.0*1024.0);
+  if(out->pool) {
+    if(seq_pool_writer_close(&out->pw) < 0)
+      die("Cannot write to: %s", out->path);
+    fprintf(stderr, "[dnademux] %s: %zu reads, %.1f MB\n",
+            out->path, out->nreads, mb);
   } else {
-    switch(fmt) {
-      case SEQ_FMT_FASTA: seq_gzprint_fasta(r, gz, 0); break;
-      case SEQ_FMT_FASTQ: seq_gzprint_fastq(r, gz, 0); break;
-      case SEQ_FMT_PLAIN: gzputs(gz, r->seq.b); gzputc(gz, '\n'); break;
-      default: fprintf(stderr, "Got value: %i\n", (int)fmt); exit(-1);
+    if(seq_writer_close(&out->w) < 0) die("Cannot write to: %s", out->path);
+    fprintf(stderr, "[dnademux] %s: %zu reads, %.1f MB in %.2f secs (%.1f MB/s)\n",
+            out->path, out->nreads, mb, out->w.secs,
+            out->w.secs > 0 ? mb / out->w.secs : 0);
+  }
+}
+
+static void print_read(const read_t *r, output_t *out)
+{
+  StreamBuffer *buf = out->pool ? seq_pool_writer_buf(&out->pw)
+                                : seq_writer_buf(&out->w);
+  size_t start = buf->end;
+  switch(fmt) {
+    case SEQ_FMT_FASTA: seq_sprint_fasta(r, buf, 0); break;
+    case SEQ_FMT_FASTQ: seq_sprint_fastq(r, buf, 0); break;
+    case SEQ_FMT_PLAIN:
+      swrite_buf(buf, r->seq.b, r->seq.end);
+      sputc_buf(buf, '\n');
+      break;
+    default: fprintf(stderr, "Got value: %i\n", (int)fmt); exit(-1);
+  }
+  out->nreads++;
+  out->nbytes += buf->end - start;
+  if(out->pool) seq_pool_writer_update(&out->pw);
+  else seq_writer_update(&out->w);
+}
+
+//
+// Barcode lookup. Barcodes of up to 32 bases are packed 2 bits per base.
+// Every sequence within k mismatches of a barcode is added to an open
+// addressing hash table, so matching a read is a single lookup. Sequences
+// equally close to two barcodes are marked ambiguous.
+//
+#define BC_MAXLEN 32
+#define BC_EMPTY -1
+#define BC_AMBIG -2
+
+typedef struct
+{
+  uint64_t code;
+  int sample;
+  uint8_t dist;
+} bc_entry_t;
+
+typedef struct
+{
+  bc_entry_t *table;
+  size_t size; // power of two
+  uint64_t *codes; // packed barcode of each sample
+  size_t nbarcodes, len, k;
+} bc_index_t;
+
+static uint8_t bc_base_code[256];
+
+static void bc_init_base_codes()
+{
+  memset(bc_base_code, 4, sizeof(bc_base_code));
+  bc_base_code['A'] = bc_base_code['a'] = 0;
+  bc_base_code['C'] = bc_base_code['c'] = 1;
+  bc_base_code['G'] = bc_base_code['g'] = 2;
+  bc_base_code['T'] = bc_base_code['t'] = 3;
+}
+
+// Returns 0 on success, -1 if str contains a non-ACGT base
+static int bc_pack(const char *str, size_t len, uint64_t *code)
+{
+  size_t i;
+  uint64_t c = 0;
+  uint8_t b;
+  for(i = 0; i < len; i++) {
+    if((b = bc_base_code[(uint8_t)str[i]]) > 3) return -1;
+    c |= (uint64_t)b << (2*i);
+  }
+  *code = c;
+  return 0;
+}
+
+static inline size_t bc_hash(uint64_t code)
+{
+  code ^= code >> 33;
+  code *= 0xff51afd7ed558ccdULL;
+  code ^= code >> 33;
+  return (size_t)code;
+}
+
+static void bc_insert(bc_index_t *bc, uint64_t code, int sample, uint8_t dist)
+{
+  size_t i = bc_hash(code) & (bc->size-1);
+  bc_entry_t *e;
+  while(1) {
+    e = &bc->table[i];
+    if(e->sample == BC_EMPTY) {
+      e->code = code; e->sample = sample; e->dist = dist;
+      return;
+    }
+    if(e->code == code) {
+      if(dist < e->dist) { e->sample = sample; e->dist = dist; }
+      else if(dist == e->dist && e->sample != sample) e->sample = BC_AMBIG;
+      return;
+    }
+    i = (i+1) & (bc->size-1);
+  }
+}
+
+static void bc_add_variants(bc_index_t *bc, uint64_t code, size_t start,
+                            size_t k, int sample, uint8_t dist)
+{
+  size_t pos;
+  uint64_t b;
+  if(dist) bc_insert(bc, code, sample, dist);
+  if(dist == k) return;
+  for(pos = start; pos < bc->len; pos++)
+    for(b = 1; b < 4; b++)
+      bc_add_variants(bc, code ^ (b << (2*pos)), pos+1, k, sample, dist+1);
+}
+
+static void bc_build(bc_index_t *bc, char **barcodes, size_t n, size_t k)
+{
+  size_t i, j, nvariants = 1, perdist = 1;
+
+  bc->len = strlen(barcodes[0]);
+  bc->nbarcodes = n;
+  bc->k = k;
+
+  if(bc->len == 0 || bc->len > BC_MAXLEN)
+    die("Barcodes must be 1-%i bases: %s", BC_MAXLEN, barcodes[0]);
+  if(k >= bc->len) die("Too many mismatches for barcode length: %zu", k);
+
+  for(i = 1; i <= k; i++) {
+    perdist = perdist * 3 * (bc->len - i + 1) / i;
+    nvariants += perdist;
+  }
+
+  bc->size = ROUNDUP2POW(2 * n * nvariants);
+  bc->table = malloc(bc->size * sizeof(bc_entry_t));
+  bc->codes = malloc(n * sizeof(uint64_t));
+  if(!bc->table || !bc->codes) die("Out of memory");
+  for(i = 0; i < bc->size; i++) bc->table[i].sample = BC_EMPTY;
+
+  // Exact matches first
+  for(i = 0; i < n; i++) {
+    if(strlen(barcodes[i]) != bc->len)
+      die("Barcodes must all be the same length: %s", barcodes[i]);
+    if(bc_pack(barcodes[i], bc->len, &bc->codes[i]) < 0)
+      die("Barcode is not ACGT: %s", barcodes[i]);
+    for(j = 0; j < i; j++)
+      if(bc->codes[j] == bc->codes[i]) die("Duplicate barcode: %s", barcodes[i]);
+    bc_insert(bc, bc->codes[i], (int)i, 0);
+  }
+
+  for(i = 0; i < n; i++)
+    bc_add_variants(bc, bc->codes[i], 0, k, (int)i, 0);
+}
+
+static void bc_free(bc_index_t *bc)
+{
+  free(bc->table);
+  free(bc->codes);
+}
+
+// Slow path for barcodes with N or other non-ACGT bases, which count as
+// mismatches. Returns sample or -1
+static int bc_lookup_scan(const bc_index_t *bc, const char *str)
+{
+  size_t i, j, dist, best = SIZE_MAX;
+  int sample = -1;
+  uint8_t b;
+  for(i = 0; i < bc->nbarcodes; i++) {
+    for(j = dist = 0; j < bc->len && dist <= bc->k; j++) {
+      b = bc_base_code[(uint8_t)str[j]];
+      dist += (b != ((bc->codes[i] >> (2*j)) & 3));
+    }
+    if(dist < best) { best = dist; sample = (int)i; }
+    else if(dist == best) sample = -1;
+  }
+  return best <= bc->k ? sample : -1;
+}
+
+// Returns sample or -1 if unmatched or ambiguous
+static int bc_lookup(const bc_index_t *bc, const char *str, size_t len)
+{
+  uint64_t code;
+  size_t i;
+  const bc_entry_t *e;
+
+  if(len != bc->len) return -1;
+  if(bc_pack(str, len, &code) < 0) return bc_lookup_scan(bc, str);
+
+  for(i = bc_hash(code) & (bc->size-1); ; i = (i+1) & (bc->size-1)) {
+    e = &bc->table[i];
+    if(e->sample == BC_EMPTY) return -1;
+    if(e->code == code) return e->sample < 0 ? -1 : e->sample;
+  }
+}
+
+// Barcode from the end of a read name e.g. '@r1 1:N:0:ACGTACGT+TTGGCCAA'
+// Dual index barcodes are joined. Returns length
+static size_t bc_from_name(const read_t *r, char *bc)
+{
+  const char *str = strrchr(r->name.b, ':');
+  size_t len = 0;
+  str = str ? str+1 : r->name.b;
+  for(; *str && !isspace((unsigned char)*str) && len <= BC_MAXLEN; str++)
+    if(*str != '+') bc[len++] = *str;
+  bc[len] = '\0';
+  return len;
+}
+
+//
+// Barcode sample sheet
+//
+typedef struct
+{
+  char **barcodes, **samples;
+  size_t n, cap;
+} sample_sheet_t;
+
+static void sheet_load(sample_sheet_t *sh, const char *path)
+{
+  FILE *fh;
+  char *line = NULL, *bc, *name;
+  size_t len = 0, size = 0;
+  const char *delim = " \t\r\n";
+
+  memset(sh, 0, sizeof(sample_sheet_t));
+  if((fh = fopen(path, "r")) == NULL) die("Cannot open: %s", path);
+
+  while(freadline(fh, &line, &len, &size) > 0) {
+    bc = strtok(line, delim);
+    name = strtok(NULL, delim);
+    if(bc && *bc != '#') {
+      if(!name) die("Expected '<barcode> <sample>' in %s: %s", path, bc);
+      if(sh->n == sh->cap) {
+        sh->cap = sh->cap ? sh->cap*2 : 64;
+        sh->barcodes = realloc(sh->barcodes, sh->cap * sizeof(char*));
+        sh->samples = realloc(sh->samples, sh->cap * sizeof(char*));
+        if(!sh->barcodes || !sh->samples) die("Out of memory");
+      }
+      sh->barcodes[sh->n] = strdup(bc);
+      sh->samples[sh->n] = strdup(name);
+      sh->n++;
+    }
+    len = 0;
+  }
+
+  fclose(fh);
+  free(line);
+  if(sh->n == 0) die("No barcodes in: %s", path);
+}
+
+static void sheet_free(sample_sheet_t *sh)
+{
+  size_t i;
+  for(i = 0; i < sh->n; i++) { free(sh->barcodes[i]); free(sh->samples[i]); }
+  free(sh->barcodes);
+  free(sh->samples);
+}
+
+static char* output_path(const char *prefix, const char *sample)
+{
+  const char *ext = fmt == SEQ_FMT_FASTA ? "fa" :
+                    (fmt == SEQ_FMT_PLAIN ? "txt" : "fq");
+  size_t len = strlen(prefix) + strlen(sample) + 10;
+  char *path = malloc(len);
+  if(!path) die("Out of memory");
+  snprintf(path, len, "%s%s.%s%s", prefix, sample, ext, gzip_out ? ".gz" : "");
+  return path;
+}
+
+static void detect_format(seq_file_t *sf)
+{
+  if(fmt == SEQ_FMT_UNKNOWN) { /* detect output format */
+    if(seq_is_plain(sf)) fmt = SEQ_FMT_PLAIN;
+    else if(seq_is_fasta(sf)) fmt = SEQ_FMT_FASTA;
+    else fmt = SEQ_FMT_FASTQ;
+  }
+}
+
+static void demux_barcodes(seq_file_t *sf, const char *barcode_path,
+                           const char *prefix, size_t k,
+                           const char *index_path, bool interleaved)
+{
+  sample_sheet_t sheet;
+  bc_index_t bc;
+  seq_writer_pool_t pool;
+  output_t *outs;
+  seq_file_t *idx = NULL;
+  seq_pair_reader_t pr;
+  read_t r1, r2, ri;
+  char namebc[BC_MAXLEN+2];
+  const char *bcstr;
+  size_t i, bclen, nreads = 0;
+  int sample, s;
+
+  sheet_load(&sheet, barcode_path);
+  bc_build(&bc, sheet.barcodes, sheet.n, k);
+
+  if(index_path && (idx = seq_open(index_path)) == NULL)
+    die("Cannot open index reads: %s", index_path);
+
+  seq_read_alloc(&r1);
+  seq_read_alloc(&r2);
+  seq_read_alloc(&ri);
+
+  // Last output is for unmatched reads
+  outs = malloc((sheet.n+1) * sizeof(output_t));
+  if(!outs) die("Out of memory");
+
+  if(interleaved && seq_pair_open_sf(&pr, sf, NULL, false) < 0)
+    die("Cannot start reading: %s", sf->path);
+
+  while((s = interleaved ? seq_pair_read(&pr, &r1, &r2)
+                         : seq_read(sf, &r1)) > 0) {
+    if(!nreads++) {
+      detect_format(sf);
+      if(seq_writer_pool_open(&pool, SAMPLE_NTHREADS,
+                              sheet.n + 1 + 2*SAMPLE_NTHREADS,
+                              SAMPLE_BUF_BYTES) < 0) die("Out of memory");
+      for(i = 0; i < sheet.n; i++)
+        output_open(&outs[i], output_path(prefix, sheet.samples[i]), &pool);
+      output_open(&outs[sheet.n], output_path(prefix, "undetermined"), &pool);
+    }
+
+    if(idx) {
+      if(seq_read(idx, &ri) <= 0) die("Too few index reads in: %s", index_path);
+      bcstr = ri.seq.b;
+      bclen = ri.seq.end < bc.len ? ri.seq.end : bc.len;
+    } else {
+      bcstr = namebc;
+      bclen = bc_from_name(&r1, namebc);
+    }
+
+    sample = bc_lookup(&bc, bcstr, bclen);
+    if(sample < 0) sample = (int)sheet.n;
+
+    print_read(&r1, &outs[sample]);
+    if(interleaved) print_read(&r2, &outs[sample]);
+  }
+
+  if(s < 0) die("Error reading from: %s", sf->path);
+  if(interleaved) seq_pair_close(&pr);
+  else seq_close(sf);
+
+  if(nreads) {
+    for(i = 0; i <= sheet.n; i++) {
+      output_close(&outs[i]);
+      free(outs[i].path);
     }
+    seq_writer_pool_close(&pool);
+  }
+
+  free(outs);
+  if(idx) seq_close(idx);
+  seq_read_dealloc(&r1);
+  seq_read_dealloc(&r2);
+  seq_read_dealloc(&ri);
+  bc_free(&bc);
+  sheet_free(&sheet);
+}
+
+static void demux_pairs(seq_file_t *sf, char *path1, char *path2)
+{
+  output_t out1, out2;
+  output_open(&out1, path1, NULL);
+  output_open(&out2, path2, NULL);
+
+  seq_pair_reader_t pr;
+  read_t r1, r2;
+  int s;
+  seq_read_alloc(&r1);
+  seq_read_alloc(&r2);
+
+  if(seq_pair_open_sf(&pr, sf, NULL, false) < 0)
+    die("Cannot start reading: %s", sf->path);
+  pr.uneven = true; // a last unpaired read goes to out1
+
+  while((s = seq_pair_read(&pr, &r1, &r2)) > 0 || s == SEQ_PAIR_ONLY1) {
+    detect_format(sf);
+    print_read(&r1, &out1);
+    if(s == SEQ_PAIR_ONLY1) { fprintf(stderr, "[dnademux] Odd number of reads\n"); }
+    else print_read(&r2, &out2);
   }
+
+  if(s < 0) die("Error reading from: %s", sf->path);
+  seq_pair_close(&pr);
+
+  output_close(&out1);
+  output_close(&out2);
+
+  seq_read_dealloc(&r1);
+  seq_read_dealloc(&r2);
 }
 
 int main(int argc, char **argv)
@@ -87,7 +535,10 @@ int main(int argc, char **argv)
   cmdstr = argv[0];
 
   int fmt_set = 0;
-  bool gzip_out = false;
+  bool interleaved = false;
+  const char *barcode_path = NULL, *index_path = NULL, *prefix = "./";
+  char *endptr;
+  size_t k = 0;
   if(argc == 1) print_usage(NULL);
 
   // Arg parsing
@@ -102,54 +553,43 @@ int main(int argc, char **argv)
       case 'Q': fmt_set++; fmt = SEQ_FMT_FASTQ; break;
       case 'P': fmt_set++; fmt = SEQ_FMT_PLAIN; break;
       case 'z': gzip_out = true; break;
+      case 'b': barcode_path = optarg; break;
+      case 'o': prefix = optarg; break;
+      case 'I': index_path = optarg; break;
+      case 'i': interleaved = true; break;
+      case 'm':
+        k = strtoul(optarg, &endptr, 10);
+        if(*optarg < '0' || *optarg > '9' || *endptr != '\0')
+          print_usage("Bad -m argument: %s", optarg);
+        break;
+      case ':': /* BADARG */
       case '?': /* BADCH getopt_long has already printed error */
         print_usage("Bad option: %s\n", argv[optind-1]);
       default: abort();
     }
   }
 
-  size_t nargs = argc - optind;
-  if(nargs < 2) print_usage("Need two output files");
-  if(nargs > 3) print_usage("Can't have more than one input file");
+  if(fmt_set > 1) print_usage("Please specify only one output format");
 
-  // open output files
-  if(gzip_out) {
-    gz1 = gzopen(argv[optind], "w");
-    gz2 = gzopen(argv[optind+1], "w");
-  } else {
-    fh1 = fopen(argv[optind], "w");
-    fh2 = fopen(argv[optind+1], "w");
-  }
-
-  seq_file_t *sf = seq_open(nargs == 3 ? argv[optind+2] : "-");
-
-  read_t r1, r2;
-  seq_read_alloc(&r1);
-  seq_read_alloc(&r2);
+  size_t nargs = argc - optind;
+  seq_file_t *sf;
 
-  while(seq_read(sf, &r1)) {
-    if(fmt == SEQ_FMT_UNKNOWN) { /* detect output format */
-      if(seq_is_plain(sf)) fmt = SEQ_FMT_PLAIN;
-      else if(seq_is_fasta(sf)) fmt = SEQ_FMT_FASTA;
-      else fmt = SEQ_FMT_FASTQ;
-    }
-    print_read(&r1, fh1, gz1);
-    if(!seq_read(sf, &r2)) { fprintf(stderr, "[dnademux] Odd number of reads\n"); }
-    else print_read(&r2, fh2, gz2);
+  if(barcode_path) {
+    if(nargs > 1) print_usage("Can't have more than one input file");
+    if((sf = seq_open(nargs ? argv[optind] : "-")) == NULL)
+      die("Cannot open input: %s", nargs ? argv[optind] : "-");
+    bc_init_base_codes();
+    demux_barcodes(sf, barcode_path, prefix, k, index_path, interleaved);
   }
-
-  if(gzip_out) {
-    gzclose(gz1);
-    gzclose(gz2);
-  } else {
-    fclose(fh1);
-    fclose(fh2);
+  else {
+    if(index_path || interleaved || k)
+      print_usage("-I,-i and -m can only be used with -b,--barcodes");
+    if(nargs < 2) print_usage("Need two output files");
+    if(nargs > 3) print_usage("Can't have more than one input file");
+    if((sf = seq_open(nargs == 3 ? argv[optind+2] : "-")) == NULL)
+      die("Cannot open input: %s", nargs == 3 ? argv[optind+2] : "-");
+    demux_pairs(sf, argv[optind], argv[optind+1]);
   }
 
-  seq_close(sf);
-
-  seq_read_dealloc(&r1);
-  seq_read_dealloc(&r2);
-
   return EXIT_SUCCESS;
 }